@@ -0,0 +1,153 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <time.h>
+
+#include <config/parser.h>
+
+#include "can.h"
+
+#define CAN_BENCHMARK_PARAMETER_NODE_ID       "node-id"
+#define CAN_BENCHMARK_PARAMETER_INDEX         "index"
+#define CAN_BENCHMARK_PARAMETER_SUBINDEX      "subindex"
+#define CAN_BENCHMARK_PARAMETER_TRANSACTIONS  "transactions"
+
+config_param_t can_benchmark_default_params[] = {
+  {CAN_BENCHMARK_PARAMETER_NODE_ID,
+    config_param_type_int,
+    "1",
+    "[1, 127]",
+    "The identifier of the node to exchange SDO messages with"},
+  {CAN_BENCHMARK_PARAMETER_INDEX,
+    config_param_type_int,
+    "24576",
+    "[0, 65535]",
+    "The index of the object to be written and read"},
+  {CAN_BENCHMARK_PARAMETER_SUBINDEX,
+    config_param_type_int,
+    "0",
+    "[0, 255]",
+    "The subindex of the object to be written and read"},
+  {CAN_BENCHMARK_PARAMETER_TRANSACTIONS,
+    config_param_type_int,
+    "100000",
+    "[1, inf)",
+    "The number of SDO transactions to be performed"},
+};
+
+const config_default_t can_benchmark_default_config = {
+  can_benchmark_default_params,
+  sizeof(can_benchmark_default_params)/sizeof(config_param_t),
+};
+
+int main(int argc, char **argv) {
+  config_parser_t parser;
+  can_device_t dev;
+  can_message_t message;
+  struct timespec start, stop;
+  int i, node_id, index, subindex, num_transactions;
+  double time, round_trip, min_round_trip = 0.0, max_round_trip = 0.0;
+  double sum_round_trip = 0.0;
+  int round_trips;
+
+  config_parser_init(&parser,
+    "Measure the SDO transaction rate of the CANopen library",
+    "Alternately writes and reads a 4-byte object over the CAN device "
+    "and reports the achieved number of transactions per second. Using "
+    "the CAN-Loopback alternative, this yields the overhead of the "
+    "library without any I/O. With timestamps enabled, the round trip "
+    "times of the transactions are reported as well, unless the back-end "
+    "takes reception times from its driver.");
+  config_parser_add_option_group(&parser, "benchmark",
+    &can_benchmark_default_config, "Benchmark options",
+    "These options control the SDO transactions performed by the "
+    "benchmark.");
+  if (can_device_init_config_parse(&dev, &parser, 0, argc, argv,
+      config_parser_exit_error)) {
+    fprintf(stderr, "%s\n", error_get(&dev.error));
+    return -1;
+  }
+
+  const config_t* config = &config_parser_get_option_group(&parser,
+    "benchmark")->options;
+  node_id = config_get_int(config, CAN_BENCHMARK_PARAMETER_NODE_ID);
+  index = config_get_int(config, CAN_BENCHMARK_PARAMETER_INDEX);
+  subindex = config_get_int(config, CAN_BENCHMARK_PARAMETER_SUBINDEX);
+  num_transactions = config_get_int(config,
+    CAN_BENCHMARK_PARAMETER_TRANSACTIONS);
+  
+  if (can_device_open(&dev)) {
+    fprintf(stderr, "%s\n", error_get(&dev.error));
+    return -1;
+  }
+  
+  /* Driver reception times are not on the clock of the send timestamp. */
+  round_trips = dev.timestamps && !dev.backend->driver_timestamps;
+  if (dev.timestamps && !round_trips)
+    fprintf(stderr, "Round trip times unavailable with driver timestamps\n");
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < num_transactions; ++i) {
+    message.id = CAN_COB_ID_SDO_SEND+node_id;
+    message.content[0] = (i % 2) ? CAN_CMD_SDO_READ_SEND :
+      CAN_CMD_SDO_WRITE_SEND_4_BYTE;
+    message.content[1] = index;
+    message.content[2] = index >> 8;
+    message.content[3] = subindex;
+    message.content[4] = i;
+    message.content[5] = i >> 8;
+    message.content[6] = i >> 16;
+    message.content[7] = i >> 24;
+    message.length = 8;
+
+    if (can_device_send_message(&dev, &message)) {
+      fprintf(stderr, "%s\n", error_get(&dev.send_error));
+      break;
+    }
+    if (can_device_receive_message(&dev, &message)) {
+      fprintf(stderr, "%s\n", error_get(&dev.receive_error));
+      break;
+    }
+    
+    if (round_trips) {
+      round_trip = message.timestamp-dev.send_timestamp;
+      if (!i || (round_trip < min_round_trip))
+        min_round_trip = round_trip;
+      if (!i || (round_trip > max_round_trip))
+        max_round_trip = round_trip;
+      sum_round_trip += round_trip;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+
+  time = (stop.tv_sec-start.tv_sec)+(stop.tv_nsec-start.tv_nsec)*1e-9;
+  fprintf(stdout, "%d transactions in %.3f s: %.1f transactions/s\n",
+    i, time, i/time);
+  if (round_trips && i)
+    fprintf(stdout, "round trip: min %.1f us, mean %.1f us, max %.1f us\n",
+      min_round_trip*1e6, sum_round_trip/i*1e6, max_round_trip*1e6);
+
+  can_device_close(&dev);
+  can_device_destroy(&dev);
+  config_parser_destroy(&parser);
+
+  return (i < num_transactions) ? -1 : 0;
+}
@@ -0,0 +1,198 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <config/parser.h>
+
+#include "can_crc.h"
+
+#define CAN_CRC_TEST_PARAMETER_ITERATIONS   "iterations"
+#define CAN_CRC_TEST_PARAMETER_MAX_SIZE     "max-size"
+#define CAN_CRC_TEST_PARAMETER_SEED         "seed"
+
+#define CAN_CRC_TEST_MAX_SIZE               4096
+
+config_param_t can_crc_test_default_params[] = {
+  {CAN_CRC_TEST_PARAMETER_ITERATIONS,
+    config_param_type_int,
+    "200000",
+    "[1, inf)",
+    "The number of random buffers to be checked"},
+  {CAN_CRC_TEST_PARAMETER_MAX_SIZE,
+    config_param_type_int,
+    "1024",
+    "[4, 4096]",
+    "The maximum size of the random buffers in bytes"},
+  {CAN_CRC_TEST_PARAMETER_SEED,
+    config_param_type_int,
+    "1",
+    "[0, inf)",
+    "The seed of the random buffers"},
+};
+
+const config_default_t can_crc_test_default_config = {
+  can_crc_test_default_params,
+  sizeof(can_crc_test_default_params)/sizeof(config_param_t),
+};
+
+typedef unsigned short (*can_crc_test_kernel_t)(unsigned short crc,
+  const unsigned char* data, size_t num);
+
+/* The bit-serial CRC-CCITT of the RS232 back-end before the shared
+ * kernel, over the words of a frame in host byte order */
+unsigned short can_crc_test_serial_alg(unsigned short* data, size_t num) {
+  unsigned short shift, c, carry, crc = 0;
+  int i;
+
+  for (i = 0; i < num; ++i) {
+    shift = 0x8000;
+    c = (data[i] << 8) | (data[i] >> 8);
+
+    do {
+      carry = crc & 0x8000;
+      crc <<= 1;
+
+      if (c & shift)
+        ++crc;
+      if (carry)
+        crc ^= 0x1021;
+
+      shift >>= 1;
+    }
+    while (shift);
+  }
+
+  return crc;
+}
+
+/* The bit-serial CRC-CCITT of the USB back-end before the shared kernel,
+ * which does not swap the bytes of the header word */
+unsigned short can_crc_test_usb_alg(unsigned short* data, size_t num) {
+  unsigned short shift, c, carry, crc = 0;
+  int i;
+
+  for (i = 0; i < num; ++i) {
+    shift = 0x8000;
+    if (i)
+      c = (data[i] << 8) | (data[i] >> 8);
+    else
+      c = data[i];
+
+    do {
+      carry = crc & 0x8000;
+      crc <<= 1;
+
+      if (c & shift)
+        ++crc;
+      if (carry)
+        crc ^= 0x1021;
+
+      shift >>= 1;
+    }
+    while (shift);
+  }
+
+  return crc;
+}
+
+/* The checksum of an RS232 frame as computed by can_serial_calc_crc() */
+unsigned short can_crc_test_serial(can_crc_test_kernel_t kernel, const
+    unsigned char* data, size_t num) {
+  return kernel(0, data, num-2)^((data[num-2] << 8) | data[num-1]);
+}
+
+/* The checksum of a USB frame as computed by can_usb_calc_crc() */
+unsigned short can_crc_test_usb(can_crc_test_kernel_t kernel, const
+    unsigned char* data, size_t num) {
+  unsigned char header[2] = {data[1], data[0]};
+
+  return kernel(kernel(0, header, 2), &data[2], num-4)^
+    ((data[num-2] << 8) | data[num-1]);
+}
+
+int main(int argc, char **argv) {
+  config_parser_t parser;
+  unsigned char data[CAN_CRC_TEST_MAX_SIZE];
+  unsigned short words[CAN_CRC_TEST_MAX_SIZE/2];
+  can_crc_test_kernel_t kernels[] = {can_crc_ccitt_table,
+    can_crc_ccitt_clmul, can_crc_ccitt};
+  const char* kernel_names[] = {"table", "clmul", "dispatch"};
+  size_t i, j, k, num, num_kernels = 1, num_mismatches = 0;
+  size_t num_iterations, max_size;
+  unsigned short serial_crc, usb_crc;
+
+  config_parser_init(&parser,
+    "Check the CRC-CCITT kernels of the CANopen library",
+    "Compares the checksums of random frames computed by the table-driven "
+    "and the carry-less multiplication kernels with the bit-serial "
+    "algorithms the RS232 and USB back-ends used before. The carry-less "
+    "multiplication kernel is only checked on processors supporting it.");
+  config_parser_add_option_group(&parser, "crc-test",
+    &can_crc_test_default_config, "CRC test options",
+    "These options control the random frames checked by the test.");
+  if (config_parser_parse(&parser, argc, argv, config_parser_exit_error)) {
+    fprintf(stderr, "%s\n", error_get(&parser.error));
+    return -1;
+  }
+
+  const config_t* config = &config_parser_get_option_group(&parser,
+    "crc-test")->options;
+  num_iterations = config_get_int(config, CAN_CRC_TEST_PARAMETER_ITERATIONS);
+  max_size = config_get_int(config, CAN_CRC_TEST_PARAMETER_MAX_SIZE);
+  srand(config_get_int(config, CAN_CRC_TEST_PARAMETER_SEED));
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+    num_kernels = 3;
+#endif
+
+  for (i = 0; i < num_iterations; ++i) {
+    num = 4+2*(rand() % ((max_size-2)/2));
+    for (j = 0; j < num; ++j)
+      data[j] = rand();
+    memcpy(words, data, num);
+
+    serial_crc = can_crc_test_serial_alg(words, num/2);
+    usb_crc = can_crc_test_usb_alg(words, num/2);
+
+    for (k = 0; k < num_kernels; ++k) {
+      if (can_crc_test_serial(kernels[k], data, num) != serial_crc) {
+        fprintf(stderr, "%s kernel mismatch on RS232 frame of %zu bytes\n",
+          kernel_names[k], num);
+        ++num_mismatches;
+      }
+      if (can_crc_test_usb(kernels[k], data, num) != usb_crc) {
+        fprintf(stderr, "%s kernel mismatch on USB frame of %zu bytes\n",
+          kernel_names[k], num);
+        ++num_mismatches;
+      }
+    }
+  }
+
+  fprintf(stdout, "%zu frames checked with %zu kernels: %zu mismatches\n",
+    num_iterations, num_kernels, num_mismatches);
+
+  config_parser_destroy(&parser);
+
+  return num_mismatches ? -1 : 0;
+}
@@ -0,0 +1,658 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include <config/parser.h>
+
+#define EPOS_EMULATOR_PARAMETER_PROTOCOL      "protocol"
+#define EPOS_EMULATOR_PARAMETER_LINK          "link"
+#define EPOS_EMULATOR_PARAMETER_BAUD_RATE     "baud-rate"
+#define EPOS_EMULATOR_PARAMETER_LATENCY       "latency"
+#define EPOS_EMULATOR_PARAMETER_TIMEOUT       "timeout"
+
+#define EPOS_EMULATOR_PROTOCOL_RS232          0
+#define EPOS_EMULATOR_PROTOCOL_USB            1
+
+#define EPOS_EMULATOR_OPCODE_RESPONSE         0x00
+#define EPOS_EMULATOR_OPCODE_READ             0x10
+#define EPOS_EMULATOR_OPCODE_WRITE            0x11
+#define EPOS_EMULATOR_OPCODE_READ_SEG_INIT    0x12
+#define EPOS_EMULATOR_OPCODE_WRITE_SEG_INIT   0x13
+#define EPOS_EMULATOR_OPCODE_READ_SEG         0x14
+#define EPOS_EMULATOR_OPCODE_WRITE_SEG        0x15
+
+#define EPOS_EMULATOR_SEGMENT_LENGTH          0x3F
+#define EPOS_EMULATOR_SEGMENT_TOGGLE          0x40
+#define EPOS_EMULATOR_SEGMENT_MORE            0x80
+
+#define EPOS_EMULATOR_ACK_OKAY                0x4F
+#define EPOS_EMULATOR_ACK_FAILED              0x46
+
+#define EPOS_EMULATOR_SYNC_DLE                0x90
+#define EPOS_EMULATOR_SYNC_STX                0x02
+
+#define EPOS_EMULATOR_ABORT_TOGGLE            0x05030000
+#define EPOS_EMULATOR_ABORT_OPCODE            0x05040001
+#define EPOS_EMULATOR_ABORT_CRC               0x05040004
+#define EPOS_EMULATOR_ABORT_MEMORY            0x05040005
+#define EPOS_EMULATOR_ABORT_OBJECT            0x06020000
+
+#define EPOS_EMULATOR_NUM_OBJECTS             4096
+#define EPOS_EMULATOR_OBJECT_USED             0x80000000
+#define EPOS_EMULATOR_NUM_DOMAINS             16
+#define EPOS_EMULATOR_DOMAIN_SIZE             1048576
+#define EPOS_EMULATOR_FRAME_SIZE              (2*255+6)
+#define EPOS_EMULATOR_PACE_SIZE               8
+
+typedef struct epos_emulator_object_t {
+  unsigned int key;
+  unsigned int value;
+} epos_emulator_object_t;
+
+typedef struct epos_emulator_domain_t {
+  unsigned int key;
+  size_t size;
+  unsigned char* data;
+} epos_emulator_domain_t;
+
+typedef struct epos_emulator_t {
+  int master_fd;
+  int slave_fd;
+
+  int protocol;
+  int baud_rate;
+  double latency;
+  double timeout;
+
+  epos_emulator_object_t objects[EPOS_EMULATOR_NUM_OBJECTS];
+
+  epos_emulator_domain_t domains[EPOS_EMULATOR_NUM_DOMAINS];
+  epos_emulator_domain_t object_domain;
+  unsigned char object_data[4];
+  epos_emulator_domain_t* transfer;
+  size_t transfer_pos;
+  unsigned char toggle;
+} epos_emulator_t;
+
+config_param_t epos_emulator_default_params[] = {
+  {EPOS_EMULATOR_PARAMETER_PROTOCOL,
+    config_param_type_enum,
+    "rs232",
+    "rs232|usb",
+    "The EPOS protocol spoken by the emulator"},
+  {EPOS_EMULATOR_PARAMETER_LINK,
+    config_param_type_string,
+    "",
+    "",
+    "Optional path of a symbolic link to the emulated device's "
+    "pseudo-terminal"},
+  {EPOS_EMULATOR_PARAMETER_BAUD_RATE,
+    config_param_type_int,
+    "0",
+    "[0, 3000000]",
+    "The emulated baud rate in [baud] used for pacing the data transfer, "
+    "zero disables pacing"},
+  {EPOS_EMULATOR_PARAMETER_LATENCY,
+    config_param_type_float,
+    "0.0",
+    "[0.0, inf)",
+    "The emulated latency in [s] between request and response"},
+  {EPOS_EMULATOR_PARAMETER_TIMEOUT,
+    config_param_type_float,
+    "1.0",
+    "[0.0, inf)",
+    "The timeout in [s] for receiving the remainder of a started frame"},
+};
+
+const config_default_t epos_emulator_default_config = {
+  epos_emulator_default_params,
+  sizeof(epos_emulator_default_params)/sizeof(config_param_t),
+};
+
+void epos_emulator_sleep(double period) {
+  struct timespec time;
+
+  if (period > 0.0) {
+    time.tv_sec = period;
+    time.tv_nsec = (period-time.tv_sec)*1e9;
+
+    while (nanosleep(&time, &time));
+  }
+}
+
+void epos_emulator_pace(epos_emulator_t* emulator, size_t num) {
+  struct timespec start, time;
+  double period;
+
+  /* Busy waiting, since sleeping overshoots character times at high baud
+     rates by far */
+  if (emulator->baud_rate) {
+    period = num*10.0/emulator->baud_rate;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do {
+      clock_gettime(CLOCK_MONOTONIC, &time);
+    }
+    while ((time.tv_sec-start.tv_sec)+(time.tv_nsec-start.tv_nsec)*1e-9 <
+      period);
+  }
+}
+
+int epos_emulator_read(epos_emulator_t* emulator, unsigned char* data,
+    size_t num, double timeout) {
+  struct pollfd set = {emulator->master_fd, POLLIN, 0};
+  size_t i = 0;
+  int result;
+
+  while (i < num) {
+    result = poll(&set, 1, (timeout < 0.0) ? -1 : timeout*1e3);
+    if (result <= 0)
+      return -1;
+
+    if ((result = read(emulator->master_fd, &data[i], num-i)) <= 0)
+      return -1;
+    i += result;
+  }
+  epos_emulator_pace(emulator, num);
+
+  return num;
+}
+
+int epos_emulator_write(epos_emulator_t* emulator, const unsigned char*
+    data, size_t num) {
+  size_t i = 0, n;
+  int result;
+
+  while (i < num) {
+    n = (num-i < EPOS_EMULATOR_PACE_SIZE) ? num-i : EPOS_EMULATOR_PACE_SIZE;
+    epos_emulator_pace(emulator, n);
+    
+    if ((result = write(emulator->master_fd, &data[i], n)) <= 0)
+      return -1;
+    i += result;
+  }
+
+  return num;
+}
+
+void epos_emulator_change_byte_order(unsigned char* data, size_t num) {
+  unsigned char tmp;
+  size_t i;
+
+  for (i = 2; i+1 < num; i += 2) {
+    tmp = data[i];
+
+    data[i] = data[i+1];
+    data[i+1] = tmp;
+  }
+}
+
+void epos_emulator_change_word_order(unsigned char* data, size_t num) {
+  unsigned char tmp_lb, tmp_hb;
+  size_t i;
+
+  for (i = 2; i+2 < num; i += 4) {
+    tmp_hb = data[i];
+    tmp_lb = data[i+1];
+
+    data[i] = data[i+2];
+    data[i+1] = data[i+3];
+
+    data[i+2] = tmp_hb;
+    data[i+3] = tmp_lb;
+  }
+}
+
+unsigned short epos_emulator_crc(const unsigned char* data, size_t num,
+    int swap_header) {
+  unsigned short crc = 0;
+  unsigned char c;
+  size_t i;
+  int j;
+
+  for (i = 0; i < num; ++i) {
+    c = (swap_header && (i < 2)) ? data[1-i] : data[i];
+
+    for (j = 7; j >= 0; --j) {
+      int carry = crc & 0x8000;
+
+      crc = (crc << 1) | ((c >> j) & 0x01);
+      if (carry)
+        crc ^= 0x1021;
+    }
+  }
+
+  return crc;
+}
+
+epos_emulator_object_t* epos_emulator_lookup(epos_emulator_t* emulator,
+    unsigned int key, int insert) {
+  size_t i, mask = EPOS_EMULATOR_NUM_OBJECTS-1;
+  size_t index = ((key ^ (key >> 15))*2654435761U) & mask;
+
+  key |= EPOS_EMULATOR_OBJECT_USED;
+
+  for (i = 0; i < EPOS_EMULATOR_NUM_OBJECTS; ++i) {
+    epos_emulator_object_t* object = &emulator->objects[(index+i) & mask];
+
+    if (object->key == key)
+      return object;
+    else if (!object->key) {
+      if (insert) {
+        object->key = key;
+        object->value = 0;
+      }
+      return insert ? object : 0;
+    }
+  }
+
+  return 0;
+}
+
+epos_emulator_domain_t* epos_emulator_lookup_domain(epos_emulator_t*
+    emulator, unsigned int key, int insert) {
+  size_t i;
+
+  key |= EPOS_EMULATOR_OBJECT_USED;
+
+  for (i = 0; i < EPOS_EMULATOR_NUM_DOMAINS; ++i) {
+    epos_emulator_domain_t* domain = &emulator->domains[i];
+
+    if (domain->key == key)
+      return domain;
+    else if (!domain->key) {
+      if (insert) {
+        domain->key = key;
+        domain->size = 0;
+        domain->data = malloc(EPOS_EMULATOR_DOMAIN_SIZE);
+      }
+      return insert ? domain : 0;
+    }
+  }
+
+  return 0;
+}
+
+size_t epos_emulator_process_segmented(epos_emulator_t* emulator, const
+    unsigned char* request, size_t num, unsigned int key, unsigned int*
+    abort, unsigned char* response) {
+  epos_emulator_object_t* object;
+  unsigned char control = request[3];
+  size_t i, length = control & EPOS_EMULATOR_SEGMENT_LENGTH;
+  size_t num_words = 0;
+
+  switch (request[0]) {
+    case EPOS_EMULATOR_OPCODE_READ_SEG_INIT:
+      if (!(emulator->transfer = epos_emulator_lookup_domain(emulator, key,
+          0)) && (object = epos_emulator_lookup(emulator, key, 0))) {
+        emulator->object_data[0] = object->value;
+        emulator->object_data[1] = object->value >> 8;
+        emulator->object_data[2] = object->value >> 16;
+        emulator->object_data[3] = object->value >> 24;
+        emulator->object_domain.key = key;
+        emulator->object_domain.size = sizeof(emulator->object_data);
+        emulator->object_domain.data = emulator->object_data;
+        emulator->transfer = &emulator->object_domain;
+      }
+      
+      if (emulator->transfer) {
+        response[6] = emulator->transfer->size >> 8;
+        response[7] = emulator->transfer->size;
+        response[8] = emulator->transfer->size >> 24;
+        response[9] = emulator->transfer->size >> 16;
+        num_words = 2;
+      }
+      else
+        *abort = EPOS_EMULATOR_ABORT_OBJECT;
+      emulator->transfer_pos = 0;
+      emulator->toggle = 0;
+      break;
+    case EPOS_EMULATOR_OPCODE_WRITE_SEG_INIT:
+      length = (request[8] << 24) | (request[9] << 16) | (request[6] << 8) |
+        request[7];
+      if ((length > EPOS_EMULATOR_DOMAIN_SIZE) ||
+          !(emulator->transfer = epos_emulator_lookup_domain(emulator, key,
+          1)))
+        *abort = EPOS_EMULATOR_ABORT_MEMORY;
+      else
+        emulator->transfer->size = 0;
+      emulator->transfer_pos = 0;
+      emulator->toggle = 0;
+      break;
+    case EPOS_EMULATOR_OPCODE_READ_SEG:
+      if (!emulator->transfer)
+        *abort = EPOS_EMULATOR_ABORT_OBJECT;
+      else if ((control & EPOS_EMULATOR_SEGMENT_TOGGLE) != emulator->toggle)
+        *abort = EPOS_EMULATOR_ABORT_TOGGLE;
+      else {
+        length = emulator->transfer->size-emulator->transfer_pos;
+        if (length > EPOS_EMULATOR_SEGMENT_LENGTH)
+          length = EPOS_EMULATOR_SEGMENT_LENGTH;
+
+        response[7] = emulator->toggle | length;
+        if (emulator->transfer_pos+length < emulator->transfer->size)
+          response[7] |= EPOS_EMULATOR_SEGMENT_MORE;
+        for (i = 0; i < length; ++i)
+          response[(7+i) ^ 0x01] = emulator->transfer->data[
+            emulator->transfer_pos+i];
+        num_words = (length+2)/2;
+
+        emulator->transfer_pos += length;
+        emulator->toggle ^= EPOS_EMULATOR_SEGMENT_TOGGLE;
+      }
+      break;
+    case EPOS_EMULATOR_OPCODE_WRITE_SEG:
+      if (!emulator->transfer)
+        *abort = EPOS_EMULATOR_ABORT_OBJECT;
+      else if ((control & EPOS_EMULATOR_SEGMENT_TOGGLE) != emulator->toggle)
+        *abort = EPOS_EMULATOR_ABORT_TOGGLE;
+      else if ((length+3 > num-2) || (emulator->transfer->size+length >
+          EPOS_EMULATOR_DOMAIN_SIZE))
+        *abort = EPOS_EMULATOR_ABORT_MEMORY;
+      else {
+        for (i = 0; i < length; ++i)
+          emulator->transfer->data[emulator->transfer->size+i] =
+            request[(3+i) ^ 0x01];
+        emulator->transfer->size += length;
+
+        response[7] = emulator->toggle;
+        num_words = 1;
+
+        emulator->toggle ^= EPOS_EMULATOR_SEGMENT_TOGGLE;
+      }
+      break;
+  }
+
+  return num_words;
+}
+
+size_t epos_emulator_process(epos_emulator_t* emulator, const unsigned
+    char* request, size_t num, unsigned int abort, unsigned char* response) {
+  epos_emulator_object_t* object;
+  unsigned int key, value = 0;
+  size_t num_words = 2;
+
+  /* Expedited and segmented requests address objects by the same words,
+   * the index followed by the node identifier and the subindex, such that
+   * objects written by expedited transfer may be read by segmented
+   * transfer */
+  key = (request[4] << 24) | (request[2] << 16) | (request[3] << 8) |
+    request[5];
+  memset(response, 0, EPOS_EMULATOR_FRAME_SIZE);
+
+  if (!abort) switch (request[0]) {
+    case EPOS_EMULATOR_OPCODE_WRITE:
+      if ((object = epos_emulator_lookup(emulator, key, 1))) {
+        object->value = (request[6] << 8) | request[7];
+        if (num >= 12)
+          object->value |= (request[8] << 24) | (request[9] << 16);
+      }
+      else
+        abort = EPOS_EMULATOR_ABORT_MEMORY;
+      break;
+    case EPOS_EMULATOR_OPCODE_READ:
+      if ((object = epos_emulator_lookup(emulator, key, 0)))
+        value = object->value;
+      num_words = 4;
+      break;
+    case EPOS_EMULATOR_OPCODE_READ_SEG_INIT:
+    case EPOS_EMULATOR_OPCODE_WRITE_SEG_INIT:
+    case EPOS_EMULATOR_OPCODE_READ_SEG:
+    case EPOS_EMULATOR_OPCODE_WRITE_SEG:
+      num_words = 2+epos_emulator_process_segmented(emulator, request, num,
+        key, &abort, response);
+      if (abort)
+        num_words = 2;
+      response[0] = EPOS_EMULATOR_OPCODE_RESPONSE;
+      response[2] = abort >> 8;
+      response[3] = abort;
+      response[4] = abort >> 24;
+      response[5] = abort >> 16;
+      return num_words;
+    default:
+      abort = EPOS_EMULATOR_ABORT_OPCODE;
+  }
+
+  response[0] = EPOS_EMULATOR_OPCODE_RESPONSE;
+  response[2] = abort >> 24;
+  response[3] = abort >> 16;
+  response[4] = abort >> 8;
+  response[5] = abort;
+  if (num_words > 2) {
+    response[6] = value >> 24;
+    response[7] = value >> 16;
+    response[8] = value >> 8;
+    response[9] = value;
+  }
+  epos_emulator_change_word_order(response, 2*num_words+4);
+
+  return num_words;
+}
+
+void epos_emulator_run_rs232(epos_emulator_t* emulator) {
+  unsigned char request[EPOS_EMULATOR_FRAME_SIZE];
+  unsigned char response[EPOS_EMULATOR_FRAME_SIZE];
+  unsigned char ack;
+  unsigned short crc;
+  size_t num, num_words;
+
+  while (epos_emulator_read(emulator, request, 1, -1.0) > 0) {
+    if ((request[0] < EPOS_EMULATOR_OPCODE_READ) ||
+        (request[0] > EPOS_EMULATOR_OPCODE_WRITE_SEG)) {
+      ack = EPOS_EMULATOR_ACK_FAILED;
+      epos_emulator_write(emulator, &ack, 1);
+      continue;
+    }
+    ack = EPOS_EMULATOR_ACK_OKAY;
+    epos_emulator_write(emulator, &ack, 1);
+
+    if (epos_emulator_read(emulator, &request[1], 1, emulator->timeout) < 1)
+      continue;
+    num = 2*request[1]+6;
+    if (epos_emulator_read(emulator, &request[2], num-2,
+        emulator->timeout) < 0)
+      continue;
+
+    epos_emulator_change_byte_order(request, num);
+    ack = epos_emulator_crc(request, num, 0) ? EPOS_EMULATOR_ACK_FAILED :
+      EPOS_EMULATOR_ACK_OKAY;
+    epos_emulator_write(emulator, &ack, 1);
+    if (ack != EPOS_EMULATOR_ACK_OKAY)
+      continue;
+
+    num_words = epos_emulator_process(emulator, request, num, 0, response);
+    response[1] = num_words-1;
+    num = 2*num_words+4;
+
+    crc = epos_emulator_crc(response, num, 0);
+    response[num-2] = crc >> 8;
+    response[num-1] = crc;
+    epos_emulator_change_byte_order(response, num);
+
+    epos_emulator_sleep(emulator->latency);
+
+    if ((epos_emulator_write(emulator, response, 1) < 1) ||
+        (epos_emulator_read(emulator, &ack, 1, emulator->timeout) < 1) ||
+        (ack != EPOS_EMULATOR_ACK_OKAY))
+      continue;
+    if ((epos_emulator_write(emulator, &response[1], num-1) < 0) ||
+        (epos_emulator_read(emulator, &ack, 1, emulator->timeout) < 1))
+      continue;
+  }
+}
+
+int epos_emulator_read_usb(epos_emulator_t* emulator, unsigned char* data,
+    size_t num) {
+  unsigned char buffer;
+  size_t i;
+
+  for (i = 0; i < num; ++i) {
+    if (epos_emulator_read(emulator, &data[i], 1, emulator->timeout) < 1)
+      return -1;
+
+    if (data[i] == EPOS_EMULATOR_SYNC_DLE) {
+      if (epos_emulator_read(emulator, &buffer, 1, emulator->timeout) < 1)
+        return -1;
+      else if (buffer != EPOS_EMULATOR_SYNC_DLE)
+        return -1;
+    }
+  }
+
+  return num;
+}
+
+void epos_emulator_run_usb(epos_emulator_t* emulator) {
+  unsigned char request[EPOS_EMULATOR_FRAME_SIZE];
+  unsigned char response[EPOS_EMULATOR_FRAME_SIZE];
+  unsigned char frame[2*EPOS_EMULATOR_FRAME_SIZE+2];
+  unsigned char buffer = 0;
+  unsigned short crc;
+  unsigned int abort;
+  size_t i, j, num, num_words;
+
+  while (1) {
+    if (buffer != EPOS_EMULATOR_SYNC_DLE) {
+      if (epos_emulator_read(emulator, &buffer, 1, -1.0) < 1)
+        break;
+      else if (buffer != EPOS_EMULATOR_SYNC_DLE)
+        continue;
+    }
+    if (epos_emulator_read(emulator, &buffer, 1, emulator->timeout) < 1)
+      continue;
+    else if (buffer != EPOS_EMULATOR_SYNC_STX)
+      continue;
+    buffer = 0;
+
+    if (epos_emulator_read_usb(emulator, request, 2) < 0)
+      continue;
+    num = 2*request[1]+4;
+    if (epos_emulator_read_usb(emulator, &request[2], num-2) < 0)
+      continue;
+
+    epos_emulator_change_byte_order(request, num);
+    abort = epos_emulator_crc(request, num, 1) ? EPOS_EMULATOR_ABORT_CRC : 0;
+
+    num_words = epos_emulator_process(emulator, request, num, abort,
+      response);
+    response[1] = num_words;
+    num = 2*num_words+4;
+
+    crc = epos_emulator_crc(response, num, 1);
+    response[num-2] = crc >> 8;
+    response[num-1] = crc;
+    epos_emulator_change_byte_order(response, num);
+
+    frame[0] = EPOS_EMULATOR_SYNC_DLE;
+    frame[1] = EPOS_EMULATOR_SYNC_STX;
+    for (i = 0, j = 2; i < num; ++i) {
+      frame[j++] = response[i];
+      if (response[i] == EPOS_EMULATOR_SYNC_DLE)
+        frame[j++] = response[i];
+    }
+
+    epos_emulator_sleep(emulator->latency);
+    epos_emulator_write(emulator, frame, j);
+  }
+}
+
+int main(int argc, char **argv) {
+  config_parser_t parser;
+  const config_t* config;
+  epos_emulator_t emulator;
+  struct termios attributes;
+  const char* link;
+  const char* name;
+
+  config_parser_init(&parser,
+    "Emulate an EPOS controller on a pseudo-terminal",
+    "Opens a pseudo-terminal and answers expedited and segmented SDO read "
+    "and write requests according to the EPOS RS232 or USB protocol from an "
+    "object dictionary held in memory. Reply latency and baud rate pacing "
+    "may be configured for benchmarking the serial communication path "
+    "without hardware.");
+  config_parser_add_option_group(&parser, "emulator",
+    &epos_emulator_default_config, "Emulator options",
+    "These options control the behavior of the EPOS emulator.");
+  if (config_parser_parse(&parser, argc, argv, config_parser_exit_error))
+    return -1;
+
+  config = &config_parser_get_option_group(&parser, "emulator")->options;
+  memset(&emulator, 0, sizeof(emulator));
+  emulator.protocol = config_get_int(config,
+    EPOS_EMULATOR_PARAMETER_PROTOCOL);
+  emulator.baud_rate = config_get_int(config,
+    EPOS_EMULATOR_PARAMETER_BAUD_RATE);
+  emulator.latency = config_get_float(config,
+    EPOS_EMULATOR_PARAMETER_LATENCY);
+  emulator.timeout = config_get_float(config,
+    EPOS_EMULATOR_PARAMETER_TIMEOUT);
+  link = config_get_string(config, EPOS_EMULATOR_PARAMETER_LINK);
+
+  if (((emulator.master_fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0) ||
+      grantpt(emulator.master_fd) || unlockpt(emulator.master_fd) ||
+      !(name = ptsname(emulator.master_fd))) {
+    perror("Failed to open pseudo-terminal");
+    return -1;
+  }
+
+  /* Holding the slave open prevents hangups between client sessions */
+  if ((emulator.slave_fd = open(name, O_RDWR | O_NOCTTY)) < 0) {
+    perror(name);
+    return -1;
+  }
+  tcgetattr(emulator.slave_fd, &attributes);
+  cfmakeraw(&attributes);
+  tcsetattr(emulator.slave_fd, TCSANOW, &attributes);
+
+  if (link && link[0]) {
+    unlink(link);
+    if (symlink(name, link)) {
+      perror(link);
+      return -1;
+    }
+    name = link;
+  }
+  fprintf(stdout, "Emulating EPOS %s on %s\n", (emulator.protocol ==
+    EPOS_EMULATOR_PROTOCOL_USB) ? "USB" : "RS232", name);
+  fflush(stdout);
+
+  if (emulator.protocol == EPOS_EMULATOR_PROTOCOL_USB)
+    epos_emulator_run_usb(&emulator);
+  else
+    epos_emulator_run_rs232(&emulator);
+
+  if (link && link[0])
+    unlink(link);
+  close(emulator.slave_fd);
+  close(emulator.master_fd);
+  config_parser_destroy(&parser);
+
+  return 0;
+}
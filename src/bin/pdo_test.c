@@ -0,0 +1,213 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <config/parser.h>
+
+#include "can_pdo.h"
+
+#define CAN_PDO_TEST_PARAMETER_ITERATIONS   "iterations"
+#define CAN_PDO_TEST_PARAMETER_SEED         "seed"
+
+config_param_t can_pdo_test_default_params[] = {
+  {CAN_PDO_TEST_PARAMETER_ITERATIONS,
+    config_param_type_int,
+    "100000",
+    "[1, inf)",
+    "The number of random values packed per mapping"},
+  {CAN_PDO_TEST_PARAMETER_SEED,
+    config_param_type_int,
+    "1",
+    "[0, inf)",
+    "The seed of the random values"},
+};
+
+const config_default_t can_pdo_test_default_config = {
+  can_pdo_test_default_params,
+  sizeof(can_pdo_test_default_params)/sizeof(config_param_t),
+};
+
+/* A mapping under test, given by the bit lengths and signs of its
+ * entries in the order of their values in the PDO */
+typedef struct can_pdo_test_mapping_t {
+  const char* name;
+  size_t bit_lengths[CAN_PDO_MAX_ENTRIES];
+  int signs[CAN_PDO_MAX_ENTRIES];
+  size_t num_entries;
+} can_pdo_test_mapping_t;
+
+can_pdo_test_mapping_t can_pdo_test_mappings[] = {
+  {"aligned", {32, 16, 8, 8}, {1, 0, 1, 0}, 4},
+  {"unaligned", {3, 12, 17, 1, 31}, {0, 0, 0, 0, 0}, 5},
+  {"sign-extended", {5, 11, 20, 7, 21}, {1, 1, 1, 1, 1}, 5},
+  {"mixed", {4, 8, 16, 4, 32}, {1, 0, 1, 0, 1}, 5},
+};
+
+/* Read a structure member of the size compiled for a mapping entry */
+uint32_t can_pdo_test_get(const uint32_t* member, size_t bit_length) {
+  if (bit_length > 16)
+    return *member;
+  else if (bit_length > 8)
+    return *(const uint16_t*)member;
+  else
+    return *(const uint8_t*)member;
+}
+
+/* Write a structure member of the size compiled for a mapping entry */
+void can_pdo_test_set(uint32_t* member, size_t bit_length, uint32_t value) {
+  if (bit_length > 16)
+    *member = value;
+  else if (bit_length > 8)
+    *(uint16_t*)member = value;
+  else
+    *(uint8_t*)member = value;
+}
+
+/* The PDO content packed bit by bit, least significant bit first */
+void can_pdo_test_pack(const can_pdo_test_mapping_t* mapping, const
+    uint32_t* values, unsigned char* content) {
+  size_t i, j, bit_offset = 0;
+
+  memset(content, 0, 8);
+  for (i = 0; i < mapping->num_entries; ++i)
+    for (j = 0; j < mapping->bit_lengths[i]; ++j, ++bit_offset)
+      if (values[i] & (1U << j))
+        content[bit_offset/8] |= 1 << (bit_offset % 8);
+}
+
+int main(int argc, char **argv) {
+  config_parser_t parser;
+  can_pdo_test_mapping_t* mapping;
+  can_pdo_entry_t entries[CAN_PDO_MAX_ENTRIES];
+  uint32_t values[CAN_PDO_MAX_ENTRIES], data[CAN_PDO_MAX_ENTRIES];
+  uint32_t mask, expected;
+  unsigned char content[8];
+  can_message_t message;
+  can_pdo_t pdo;
+  size_t i, j, k, num_iterations, num_mismatches = 0;
+  size_t num_mappings = sizeof(can_pdo_test_mappings)/
+    sizeof(can_pdo_test_mapping_t);
+
+  config_parser_init(&parser,
+    "Check the PDO packing of the CANopen library",
+    "Packs random values into PDOs of aligned, unaligned, and signed "
+    "mappings, compares the messages with PDOs packed bit by bit, and "
+    "checks that unpacking them restores the values, sign-extended where "
+    "the mapping is signed. An invalid mapping must leave the previous "
+    "one intact.");
+  config_parser_add_option_group(&parser, "pdo-test",
+    &can_pdo_test_default_config, "PDO test options",
+    "These options control the random values checked by the test.");
+  if (config_parser_parse(&parser, argc, argv, config_parser_exit_error)) {
+    fprintf(stderr, "%s\n", error_get(&parser.error));
+    return -1;
+  }
+
+  const config_t* config = &config_parser_get_option_group(&parser,
+    "pdo-test")->options;
+  num_iterations = config_get_int(config, CAN_PDO_TEST_PARAMETER_ITERATIONS);
+  srand(config_get_int(config, CAN_PDO_TEST_PARAMETER_SEED));
+
+  can_pdo_init(&pdo, 1, 1, CAN_PDO_TRANSMIT);
+
+  for (k = 0; k < num_mappings; ++k) {
+    mapping = &can_pdo_test_mappings[k];
+    for (i = 0; i < mapping->num_entries; ++i) {
+      entries[i].index = 0x2000;
+      entries[i].subindex = i+1;
+      entries[i].bit_length = mapping->bit_lengths[i];
+      entries[i].offset = i*sizeof(uint32_t);
+      entries[i].sign = mapping->signs[i];
+    }
+
+    if (can_pdo_set_mapping(&pdo, entries, mapping->num_entries)) {
+      fprintf(stderr, "%s mapping rejected: %s\n", mapping->name,
+        error_get(&pdo.error));
+      ++num_mismatches;
+      continue;
+    }
+
+    for (j = 0; j < num_iterations; ++j) {
+      for (i = 0; i < mapping->num_entries; ++i) {
+        values[i] = ((uint32_t)rand() << 16) ^ rand();
+        can_pdo_test_set(&data[i], mapping->bit_lengths[i], values[i]);
+      }
+
+      can_pdo_pack(&pdo, data, &message);
+      can_pdo_test_pack(mapping, values, content);
+      if ((message.length != pdo.length) ||
+          memcmp(message.content, content, pdo.length)) {
+        fprintf(stderr, "%s mapping packed wrong content\n", mapping->name);
+        ++num_mismatches;
+        continue;
+      }
+
+      memset(data, 0, sizeof(data));
+      if (can_pdo_unpack(&pdo, &message, data)) {
+        fprintf(stderr, "%s mapping failed to unpack: %s\n", mapping->name,
+          error_get(&pdo.error));
+        ++num_mismatches;
+        continue;
+      }
+
+      for (i = 0; i < mapping->num_entries; ++i) {
+        mask = (mapping->bit_lengths[i] < 32) ?
+          (1U << mapping->bit_lengths[i])-1 : ~0U;
+        expected = values[i] & mask;
+        if (mapping->signs[i] &&
+            (expected & (1U << (mapping->bit_lengths[i]-1))))
+          expected |= ~mask;
+        can_pdo_test_set(&values[i], mapping->bit_lengths[i], expected);
+
+        if (can_pdo_test_get(&data[i], mapping->bit_lengths[i]) !=
+            can_pdo_test_get(&values[i], mapping->bit_lengths[i])) {
+          fprintf(stderr, "%s mapping unpacked wrong entry %zu\n",
+            mapping->name, i+1);
+          ++num_mismatches;
+        }
+      }
+    }
+  }
+
+  entries[0].bit_length = 12;
+  entries[1].bit_length = 33;
+  if (!can_pdo_set_mapping(&pdo, entries, mapping->num_entries)) {
+    fprintf(stderr, "invalid mapping accepted\n");
+    ++num_mismatches;
+  }
+  else if ((pdo.num_entries != mapping->num_entries) ||
+      (pdo.ops[0].bit_length != mapping->bit_lengths[0]) ||
+      (pdo.entries[1].bit_length != mapping->bit_lengths[1])) {
+    fprintf(stderr, "invalid mapping modified the previous one\n");
+    ++num_mismatches;
+  }
+
+  fprintf(stdout, "%zu mappings checked with %zu values: %zu mismatches\n",
+    num_mappings, num_iterations, num_mismatches);
+
+  can_pdo_destroy(&pdo);
+  config_parser_destroy(&parser);
+
+  return num_mismatches ? -1 : 0;
+}
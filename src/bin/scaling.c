@@ -0,0 +1,229 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <config/parser.h>
+
+#include "can.h"
+
+#define CAN_SCALING_PARAMETER_DEVICES       "devices"
+#define CAN_SCALING_PARAMETER_NODE_ID       "node-id"
+#define CAN_SCALING_PARAMETER_INDEX         "index"
+#define CAN_SCALING_PARAMETER_SUBINDEX      "subindex"
+#define CAN_SCALING_PARAMETER_TRANSACTIONS  "transactions"
+
+config_param_t can_scaling_default_params[] = {
+  {CAN_SCALING_PARAMETER_DEVICES,
+    config_param_type_int,
+    "8",
+    "[1, 64]",
+    "The number of devices to be opened in parallel threads"},
+  {CAN_SCALING_PARAMETER_NODE_ID,
+    config_param_type_int,
+    "1",
+    "[1, 127]",
+    "The identifier of the node to exchange SDO messages with"},
+  {CAN_SCALING_PARAMETER_INDEX,
+    config_param_type_int,
+    "24576",
+    "[0, 65535]",
+    "The index of the object to be written and read"},
+  {CAN_SCALING_PARAMETER_SUBINDEX,
+    config_param_type_int,
+    "0",
+    "[0, 255]",
+    "The subindex of the object to be written and read"},
+  {CAN_SCALING_PARAMETER_TRANSACTIONS,
+    config_param_type_int,
+    "10000",
+    "[1, inf)",
+    "The number of SDO transactions to be performed per device"},
+};
+
+const config_default_t can_scaling_default_config = {
+  can_scaling_default_params,
+  sizeof(can_scaling_default_params)/sizeof(config_param_t),
+};
+
+typedef struct can_scaling_thread_t {
+  pthread_t thread;
+  const config_t* config;
+  int node_id;
+  int index;
+  int subindex;
+  int num_transactions;
+  int started;
+  int num_completed;
+  int result;
+} can_scaling_thread_t;
+
+void* can_scaling_run(void* arg) {
+  can_scaling_thread_t* thread = arg;
+  can_device_t dev;
+  can_message_t message;
+  int i;
+
+  thread->num_completed = 0;
+  thread->result = 0;
+
+  if (can_device_init_config(&dev, thread->config) ||
+      can_device_open(&dev)) {
+    fprintf(stderr, "%s\n", error_get(&dev.error));
+    can_device_destroy(&dev);
+    thread->result = -1;
+    
+    return 0;
+  }
+
+  for (i = 0; i < thread->num_transactions; ++i) {
+    message.id = CAN_COB_ID_SDO_SEND+thread->node_id;
+    message.content[0] = (i % 2) ? CAN_CMD_SDO_READ_SEND :
+      CAN_CMD_SDO_WRITE_SEND_4_BYTE;
+    message.content[1] = thread->index;
+    message.content[2] = thread->index >> 8;
+    message.content[3] = thread->subindex;
+    message.content[4] = i;
+    message.content[5] = i >> 8;
+    message.content[6] = i >> 16;
+    message.content[7] = i >> 24;
+    message.length = 8;
+
+    if (can_device_send_message(&dev, &message)) {
+      fprintf(stderr, "%s\n", error_get(&dev.send_error));
+      thread->result = -1;
+      break;
+    }
+    if (can_device_receive_message(&dev, &message)) {
+      fprintf(stderr, "%s\n", error_get(&dev.receive_error));
+      thread->result = -1;
+      break;
+    }
+  }
+  thread->num_completed = i;
+
+  if (can_device_close(&dev)) {
+    fprintf(stderr, "%s\n", error_get(&dev.error));
+    thread->result = -1;
+  }
+  can_device_destroy(&dev);
+
+  return 0;
+}
+
+double can_scaling_measure(can_scaling_thread_t* threads, size_t num,
+    int* num_completed) {
+  struct timespec start, stop;
+  size_t i;
+  int result = 0;
+
+  *num_completed = 0;
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < num; ++i) {
+    threads[i].started = !pthread_create(&threads[i].thread, 0,
+      can_scaling_run, &threads[i]);
+    if (!threads[i].started) {
+      threads[i].result = -1;
+      threads[i].num_completed = 0;
+    }
+  }
+  for (i = 0; i < num; ++i) {
+    if (threads[i].started)
+      pthread_join(threads[i].thread, 0);
+    *num_completed += threads[i].num_completed;
+    result |= threads[i].result;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+
+  if (result)
+    *num_completed = -1;
+  
+  return (stop.tv_sec-start.tv_sec)+(stop.tv_nsec-start.tv_nsec)*1e-9;
+}
+
+int main(int argc, char **argv) {
+  config_parser_t parser;
+  can_device_t dev;
+  can_scaling_thread_t* threads;
+  int i, num_devices, num_single, num_parallel = 0;
+  double time_single, time_parallel;
+
+  config_parser_init(&parser,
+    "Measure the scaling of the CANopen library with the number of devices",
+    "Opens the configured CAN device once and then as many times as "
+    "requested from parallel threads. Each thread alternately writes and "
+    "reads a 4-byte object over its own device and closes it again. The "
+    "achieved transaction rates are reported together with the speedup of "
+    "the parallel devices over the single device. All devices share the "
+    "configuration, which suits the CAN-Loopback alternative and back-ends "
+    "addressing any connected device.");
+  config_parser_add_option_group(&parser, "scaling",
+    &can_scaling_default_config, "Scaling options",
+    "These options control the devices and the SDO transactions performed "
+    "by the scaling test.");
+  if (can_device_init_config_parse(&dev, &parser, 0, argc, argv,
+      config_parser_exit_error)) {
+    fprintf(stderr, "%s\n", error_get(&dev.error));
+    return -1;
+  }
+
+  const config_t* config = &config_parser_get_option_group(&parser,
+    "scaling")->options;
+  num_devices = config_get_int(config, CAN_SCALING_PARAMETER_DEVICES);
+  
+  threads = malloc(num_devices*sizeof(can_scaling_thread_t));
+  for (i = 0; i < num_devices; ++i) {
+    threads[i].config = &dev.config;
+    threads[i].node_id = config_get_int(config,
+      CAN_SCALING_PARAMETER_NODE_ID);
+    threads[i].index = config_get_int(config, CAN_SCALING_PARAMETER_INDEX);
+    threads[i].subindex = config_get_int(config,
+      CAN_SCALING_PARAMETER_SUBINDEX);
+    threads[i].num_transactions = config_get_int(config,
+      CAN_SCALING_PARAMETER_TRANSACTIONS);
+  }
+
+  time_single = can_scaling_measure(threads, 1, &num_single);
+  if (num_single >= 0) {
+    fprintf(stdout, "1 device: %d transactions in %.3f s: "
+      "%.1f transactions/s\n", num_single, time_single,
+      num_single/time_single);
+    
+    time_parallel = can_scaling_measure(threads, num_devices,
+      &num_parallel);
+    if (num_parallel >= 0) {
+      fprintf(stdout, "%d devices: %d transactions in %.3f s: "
+        "%.1f transactions/s\n", num_devices, num_parallel, time_parallel,
+        num_parallel/time_parallel);
+      fprintf(stdout, "speedup: %.2f of %d\n", (num_parallel/time_parallel)/
+        (num_single/time_single), num_devices);
+    }
+  }
+
+  free(threads);
+  can_device_destroy(&dev);
+  config_parser_destroy(&parser);
+
+  return ((num_single < 0) || (num_parallel < 0)) ? -1 : 0;
+}
@@ -18,6 +18,11 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+
 #include "string/string.h"
 
 #include "can.h"
@@ -30,59 +35,509 @@ const char* can_errors[] = {
   "Failed to close CAN device",
   "Failed to send CAN message",
   "Failed to receive CAN message",
+  "CAN operation would block",
+};
+
+config_param_t can_default_params[] = {
+  {CAN_PARAMETER_BACKEND,
+    config_param_type_string,
+    "",
+    "",
+    "The short name of the CAN communication back-end, e.g. serial, usb, "
+    "cpc, socketcan, or loopback. If empty, the back-end of the "
+    "momentarily selected alternative of the CANopen library is used"},
+  {CAN_PARAMETER_TIMESTAMPS,
+    config_param_type_enum,
+    "off",
+    "off|on",
+    "Timestamp the CAN messages received and sent"},
 };
 
+void can_device_init_default(can_device_t* dev, const can_backend_t*
+  backend);
+void can_backend_get_default_config(const can_backend_t* backend,
+  config_default_t* default_config);
+pthread_mutex_t* can_device_get_receive_mutex(can_device_t* dev);
+void can_device_lock(can_device_t* dev);
+void can_device_unlock(can_device_t* dev);
+int can_device_send(can_device_t* dev, const can_message_t* message,
+  int (*send)(can_device_t*, const can_message_t*));
+int can_device_receive(can_device_t* dev, can_message_t* message,
+  int (*receive)(can_device_t*, can_message_t*));
+
 void can_device_init(can_device_t* dev) {
+  dev->backend_handle = 0;
   dev->comm_dev = 0;
   
   dev->num_references = 0;
-  dev->num_sent = 0;
-  dev->num_received = 0;
+  pthread_mutex_init(&dev->mutex, 0);
+  
+  dev->timestamps = 0;
+  
+  dev->filters = 0;
+  dev->num_filters = 0;
+  memset(dev->filter_map, 0xff, sizeof(dev->filter_map));
   
-  config_init_default(&dev->config, &can_default_config);
+  can_device_init_default(dev, &can_backend);
   error_init(&dev->error, can_errors);
+  
+  pthread_mutex_init(&dev->send_mutex, 0);
+  dev->num_sent = 0;
+  dev->send_timestamp = 0.0;
+  error_init(&dev->send_error, can_errors);
+  
+  pthread_mutex_init(&dev->receive_mutex, 0);
+  dev->num_received = 0;
+  error_init(&dev->receive_error, can_errors);
 }
 
 int can_device_init_config(can_device_t* dev, const config_t* config) {
+  config_param_t* backend_param;
+  
   can_device_init(dev);
   
+  if ((backend_param = config_get_param(config, CAN_PARAMETER_BACKEND)) &&
+      can_device_select_backend(dev, backend_param->value))
+    return dev->error.code;
+  
   if (config_set(&dev->config, config))
     error_blame(&dev->error, &dev->config.error, CAN_ERROR_CONFIG);
 
   return dev->error.code;
 }
 
+int can_device_select_backend(can_device_t* dev, const char* name) {
+  const can_backend_t* backend = &can_backend;
+  void* backend_handle = 0;
+  char* library = 0;
+  config_t config;
+  
+  error_clear(&dev->error);
+  
+  if (dev->num_references) {
+    error_setf(&dev->error, CAN_ERROR_CONFIG, "Device is open");
+    return dev->error.code;
+  }
+  
+  if (name && name[0] && strcmp(name, can_backend.name)) {
+    string_printf(&library, CAN_BACKEND_LIBRARY, name);
+    backend_handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+    string_destroy(&library);
+    
+    if (!backend_handle) {
+      error_setf(&dev->error, CAN_ERROR_CONFIG, "%s", dlerror());
+      return dev->error.code;
+    }
+    if (!(backend = dlsym(backend_handle, CAN_BACKEND_SYMBOL))) {
+      error_setf(&dev->error, CAN_ERROR_CONFIG, "%s", dlerror());
+      dlclose(backend_handle);
+      
+      return dev->error.code;
+    }
+  }
+  
+  if (backend != dev->backend) {
+    config = dev->config;
+    
+    can_device_init_default(dev, backend);
+    config_set(&dev->config, &config);
+    config_destroy(&config);
+  }
+  
+  if (dev->backend_handle)
+    dlclose(dev->backend_handle);
+  dev->backend_handle = backend_handle;
+
+  return dev->error.code;
+}
+
 int can_device_init_config_parse(can_device_t* dev, config_parser_t* parser,
     const char* option_group, int argc, char **argv, config_parser_exit_t
     exit) {
+  config_default_t default_config;
+  config_t* options;
   char* summary = 0;
   char* description = 0;
   
   can_device_init(dev);
   
-   option_group = option_group ? option_group : CAN_CONFIG_PARSER_OPTION_GROUP;
-  string_printf(&summary, "%s options", can_device_name);
+  option_group = option_group ? option_group : CAN_CONFIG_PARSER_OPTION_GROUP;
+  string_printf(&summary, "%s options", dev->backend->device_name);
   string_printf(&description,
     "These options control the settings for the %s communication interface. "
     "The type of interface depends on the momentarily selected alternative "
-    "of the underlying CANopen library. Use the update-alternatives command "
-    "to inspect or change this alternative.", can_device_name);
-  config_parser_add_option_group(parser, option_group, &can_default_config,
+    "of the underlying CANopen library, unless another back-end is requested "
+    "by name. Use the update-alternatives command to inspect or change this "
+    "alternative.", dev->backend->device_name);
+  can_backend_get_default_config(dev->backend, &default_config);
+  config_parser_add_option_group(parser, option_group, &default_config,
     summary, description);
 
+  free(default_config.params);
   string_destroy(&summary);
   string_destroy(&description);
   
   if (config_parser_parse(parser, argc, argv, exit))
     error_blame(&dev->error, &parser->error, CAN_ERROR_CONFIG);
-  else if (config_set(&dev->config, &config_parser_get_option_group(
-      parser, option_group)->options))
-    error_blame(&dev->error, &dev->config.error, CAN_ERROR_CONFIG);
+  else {
+    options = &config_parser_get_option_group(parser, option_group)->options;
+    
+    if (!can_device_select_backend(dev, config_get_string(options,
+        CAN_PARAMETER_BACKEND)) && config_set(&dev->config, options))
+      error_blame(&dev->error, &dev->config.error, CAN_ERROR_CONFIG);
+  }
 
   return dev->error.code;
 }
 
 void can_device_destroy(can_device_t* dev) {
+  free(dev->filters);
+  dev->filters = 0;
+  dev->num_filters = 0;
+  
   config_destroy(&dev->config);
   error_destroy(&dev->error);
+  error_destroy(&dev->send_error);
+  error_destroy(&dev->receive_error);
+  
+  pthread_mutex_destroy(&dev->mutex);
+  pthread_mutex_destroy(&dev->send_mutex);
+  pthread_mutex_destroy(&dev->receive_mutex);
+  
+  if (dev->backend_handle) {
+    dlclose(dev->backend_handle);
+    dev->backend_handle = 0;
+  }
+}
+
+int can_device_open(can_device_t* dev) {
+  int result;
+  
+  can_device_lock(dev);
+  
+  if (!dev->num_references) {
+    dev->timestamps = config_get_int(&dev->config, CAN_PARAMETER_TIMESTAMPS);
+    
+    __atomic_store_n(&dev->num_sent, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&dev->num_received, 0, __ATOMIC_RELAXED);
+  }
+  result = dev->backend->open(dev);
+  
+  can_device_unlock(dev);
+  
+  return result;
+}
+
+int can_device_close(can_device_t* dev) {
+  int result;
+  
+  can_device_lock(dev);
+  result = dev->backend->close(dev);
+  can_device_unlock(dev);
+  
+  return result;
+}
+
+int can_device_send_message(can_device_t* dev, const can_message_t* message) {
+  int result;
+  
+  pthread_mutex_lock(&dev->send_mutex);
+  result = can_device_send(dev, message, dev->backend->send_message);
+  pthread_mutex_unlock(&dev->send_mutex);
+  
+  return result;
+}
+
+int can_device_receive_message(can_device_t* dev, can_message_t* message) {
+  pthread_mutex_t* mutex = can_device_get_receive_mutex(dev);
+  int result;
+  
+  pthread_mutex_lock(mutex);
+  result = can_device_receive(dev, message, dev->backend->receive_message);
+  pthread_mutex_unlock(mutex);
+  
+  return result;
+}
+
+int can_device_transfer_message(can_device_t* dev, const can_message_t*
+    request, can_message_t* response) {
+  pthread_mutex_t* mutex = can_device_get_receive_mutex(dev);
+  int result;
+  
+  pthread_mutex_lock(&dev->send_mutex);
+  if (mutex != &dev->send_mutex)
+    pthread_mutex_lock(mutex);
+  
+  *response = *request;
+  if (!(result = can_device_send(dev, response, dev->backend->send_message)))
+    result = can_device_receive(dev, response, dev->backend->receive_message);
+  
+  if (mutex != &dev->send_mutex)
+    pthread_mutex_unlock(mutex);
+  pthread_mutex_unlock(&dev->send_mutex);
+  
+  return result;
+}
+
+int can_device_send_messages(can_device_t* dev, const can_message_t*
+    messages, size_t num) {
+  int result = 0;
+  
+  pthread_mutex_lock(&dev->send_mutex);
+  
+  if (dev->backend->send_messages)
+    result = dev->backend->send_messages(dev, messages, num);
+  else {
+    error_clear(&dev->send_error);
+    while ((result < num) &&
+        !dev->backend->send_message(dev, &messages[result]))
+      ++result;
+    
+    if (!result && dev->send_error.code)
+      result = -dev->send_error.code;
+  }
+  
+  if (result > 0) {
+    __atomic_add_fetch(&dev->num_sent, result, __ATOMIC_RELAXED);
+    if (dev->timestamps)
+      dev->send_timestamp = can_get_time();
+  }
+  
+  pthread_mutex_unlock(&dev->send_mutex);
+  
+  return result;
+}
+
+int can_device_receive_messages(can_device_t* dev, can_message_t* messages,
+    size_t num) {
+  pthread_mutex_t* mutex = can_device_get_receive_mutex(dev);
+  int result = 0, i, j;
+  
+  pthread_mutex_lock(mutex);
+  
+  if (!dev->backend->receive_messages) {
+    error_clear(&dev->receive_error);
+    while ((result < num) && !can_device_receive(dev, &messages[result],
+        dev->backend->receive_message))
+      ++result;
+    
+    if (!result && dev->receive_error.code)
+      result = -dev->receive_error.code;
+  }
+  else {
+    while (!result && num) {
+      if ((result = dev->backend->receive_messages(dev, messages, num)) < 0)
+        break;
+      
+      if (dev->num_filters && dev->backend->set_filters) {
+        for (i = 0, j = 0; i < result; ++i)
+          if (can_device_accepts(dev, messages[i].id))
+            messages[j++] = messages[i];
+        result = j;
+      }
+    }
+    
+    if (result > 0) {
+      __atomic_add_fetch(&dev->num_received, result, __ATOMIC_RELAXED);
+      if (dev->timestamps)
+        for (i = 0; i < result; ++i)
+          if (messages[i].timestamp == 0.0)
+            messages[i].timestamp = can_get_time();
+    }
+  }
+  
+  pthread_mutex_unlock(mutex);
+  
+  return result;
+}
+
+int can_device_get_fd(can_device_t* dev) {
+  int result;
+  
+  can_device_lock(dev);
+  
+  if (dev->backend->get_fd)
+    result = dev->backend->get_fd(dev);
+  else {
+    error_setf(&dev->error, CAN_ERROR_SETUP, "%s device is not pollable",
+      dev->backend->device_name);
+    result = -dev->error.code;
+  }
+  
+  can_device_unlock(dev);
+  
+  return result;
+}
+
+int can_device_try_send_message(can_device_t* dev, const can_message_t*
+    message) {
+  int result;
+  
+  pthread_mutex_lock(&dev->send_mutex);
+  result = can_device_send(dev, message, dev->backend->try_send_message ?
+    dev->backend->try_send_message : dev->backend->send_message);
+  pthread_mutex_unlock(&dev->send_mutex);
+  
+  return result;
+}
+
+int can_device_try_receive_message(can_device_t* dev, can_message_t*
+    message) {
+  pthread_mutex_t* mutex = can_device_get_receive_mutex(dev);
+  int result;
+  
+  pthread_mutex_lock(mutex);
+  result = can_device_receive(dev, message,
+    dev->backend->try_receive_message ? dev->backend->try_receive_message :
+    dev->backend->receive_message);
+  pthread_mutex_unlock(mutex);
+  
+  return result;
+}
+
+ssize_t can_device_get_num_sent(const can_device_t* dev) {
+  return __atomic_load_n(&dev->num_sent, __ATOMIC_RELAXED);
+}
+
+ssize_t can_device_get_num_received(const can_device_t* dev) {
+  return __atomic_load_n(&dev->num_received, __ATOMIC_RELAXED);
+}
+
+double can_get_time(void) {
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec+time.tv_nsec*1e-9;
+}
+
+int can_device_set_filters(can_device_t* dev, const can_filter_t* filters,
+    size_t num) {
+  unsigned char filter_map[(CAN_ID_MAX+1)/8];
+  can_filter_t* new_filters = 0;
+  can_filter_t* old_filters;
+  size_t i;
+  int id, result;
+  
+  /* The filters are compiled beforehand, such that receivers which check
+   * the map under the receive mutex only ever see a complete one. */
+  if (num) {
+    new_filters = malloc(num*sizeof(can_filter_t));
+    memcpy(new_filters, filters, num*sizeof(can_filter_t));
+    
+    memset(filter_map, 0, sizeof(filter_map));
+    for (id = 0; id <= CAN_ID_MAX; ++id)
+      for (i = 0; i < num; ++i)
+        if (!((id ^ filters[i].id) & filters[i].mask)) {
+          filter_map[id >> 3] |= 1 << (id & 0x07);
+          break;
+        }
+  }
+  else
+    memset(filter_map, 0xff, sizeof(filter_map));
+  
+  can_device_lock(dev);
+  error_clear(&dev->error);
+  
+  old_filters = dev->filters;
+  dev->filters = new_filters;
+  dev->num_filters = num;
+  memcpy(dev->filter_map, filter_map, sizeof(filter_map));
+  
+  if (dev->num_references && dev->backend->set_filters)
+    dev->backend->set_filters(dev);
+  
+  result = dev->error.code;
+  can_device_unlock(dev);
+  
+  free(old_filters);
+  
+  return result;
+}
+
+int can_device_accepts(const can_device_t* dev, int id) {
+  return (id >= 0) && (id <= CAN_ID_MAX) &&
+    (dev->filter_map[id >> 3] & (1 << (id & 0x07)));
+}
+
+void can_device_init_default(can_device_t* dev, const can_backend_t*
+    backend) {
+  config_default_t default_config;
+  
+  can_backend_get_default_config(backend, &default_config);
+  config_init_default(&dev->config, &default_config);
+  free(default_config.params);
+  
+  dev->backend = backend;
+}
+
+void can_backend_get_default_config(const can_backend_t* backend,
+    config_default_t* default_config) {
+  size_t num_default_params = sizeof(can_default_params)/
+    sizeof(config_param_t);
+  
+  default_config->num_params = num_default_params+
+    backend->default_config->num_params;
+  default_config->params = malloc(default_config->num_params*
+    sizeof(config_param_t));
+  
+  memcpy(default_config->params, can_default_params,
+    sizeof(can_default_params));
+  memcpy(&default_config->params[num_default_params],
+    backend->default_config->params, backend->default_config->num_params*
+    sizeof(config_param_t));
+}
+
+pthread_mutex_t* can_device_get_receive_mutex(can_device_t* dev) {
+  return dev->backend->lock_step ? &dev->send_mutex : &dev->receive_mutex;
+}
+
+void can_device_lock(can_device_t* dev) {
+  pthread_mutex_lock(&dev->mutex);
+  pthread_mutex_lock(&dev->send_mutex);
+  if (!dev->backend->lock_step)
+    pthread_mutex_lock(&dev->receive_mutex);
+}
+
+void can_device_unlock(can_device_t* dev) {
+  if (!dev->backend->lock_step)
+    pthread_mutex_unlock(&dev->receive_mutex);
+  pthread_mutex_unlock(&dev->send_mutex);
+  pthread_mutex_unlock(&dev->mutex);
+}
+
+int can_device_send(can_device_t* dev, const can_message_t* message,
+    int (*send)(can_device_t*, const can_message_t*)) {
+  if (!send(dev, message)) {
+    __atomic_add_fetch(&dev->num_sent, 1, __ATOMIC_RELAXED);
+    if (dev->timestamps)
+      dev->send_timestamp = can_get_time();
+  }
+  
+  return dev->send_error.code;
+}
+
+int can_device_receive(can_device_t* dev, can_message_t* message,
+    int (*receive)(can_device_t*, can_message_t*)) {
+  can_message_t sent;
+  
+  message->timestamp = 0.0;
+  
+  if (!dev->num_filters || !dev->backend->set_filters)
+    receive(dev, message);
+  else {
+    sent = *message;
+    while (!receive(dev, message)) {
+      if (can_device_accepts(dev, message->id))
+        break;
+      *message = sent;
+    }
+  }
+  
+  if (!dev->receive_error.code) {
+    __atomic_add_fetch(&dev->num_received, 1, __ATOMIC_RELAXED);
+    if (dev->timestamps && (message->timestamp == 0.0))
+      message->timestamp = can_get_time();
+  }
+  
+  return dev->receive_error.code;
 }
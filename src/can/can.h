@@ -28,6 +28,8 @@
   * These methods are implemented by all CAN communication back-ends.
   */
 
+#include <pthread.h>
+
 #include <config/parser.h>
 
 #include <error/error.h>
@@ -36,6 +38,22 @@
   */
 #define CAN_CONFIG_PARSER_OPTION_GROUP            "can"
 
+/** \name Parameters
+  * \brief Predefined CAN parameters common to all back-ends
+  */
+//@{
+#define CAN_PARAMETER_BACKEND                     "backend"
+#define CAN_PARAMETER_TIMESTAMPS                  "timestamps"
+//@}
+
+/** \name Back-End Loading
+  * \brief Predefined conventions for loading CAN communication back-ends
+  */
+//@{
+#define CAN_BACKEND_LIBRARY                       "libcan-%s.so"
+#define CAN_BACKEND_SYMBOL                        "can_backend"
+//@}
+
 /** \name Node Identifiers
   * \brief Predefined node identifiers as specified by the CANopen standard
   */
@@ -44,6 +62,13 @@
 #define CAN_NODE_ID_BROADCAST                     0x0000
 //@}
 
+/** \name Message Identifiers
+  * \brief Predefined message identifier limits of standard CAN frames
+  */
+//@{
+#define CAN_ID_MAX                                0x07FF
+//@}
+
 /** \name SDO Communication Object Identifiers
   * \brief Predefined SDO object identifiers as specified by CANopen
   */
@@ -53,6 +78,29 @@
 #define CAN_COB_ID_SDO_EMERGENCY                  0x0080
 //@}
 
+/** \name PDO Communication Object Identifiers
+  * \brief Predefined PDO object identifiers as specified by CANopen
+  * 
+  * Transmit PDOs are sent by a node, receive PDOs are received by a node.
+  */
+//@{
+#define CAN_COB_ID_PDO_TRANSMIT_1                 0x0180
+#define CAN_COB_ID_PDO_RECEIVE_1                  0x0200
+#define CAN_COB_ID_PDO_TRANSMIT_2                 0x0280
+#define CAN_COB_ID_PDO_RECEIVE_2                  0x0300
+#define CAN_COB_ID_PDO_TRANSMIT_3                 0x0380
+#define CAN_COB_ID_PDO_RECEIVE_3                  0x0400
+#define CAN_COB_ID_PDO_TRANSMIT_4                 0x0480
+#define CAN_COB_ID_PDO_RECEIVE_4                  0x0500
+//@}
+
+/** \name NMT Communication Object Identifiers
+  * \brief Predefined NMT object identifiers as specified by CANopen
+  */
+//@{
+#define CAN_COB_ID_NMT_HEARTBEAT                  0x0700
+//@}
+
 /** \name SDO Commands
   * \brief Predefined SDO commands as specified by the CANopen standard
   */
@@ -94,6 +142,8 @@
 //!< Failed to send CAN message
 #define CAN_ERROR_RECEIVE                         6
 //!< Failed to receive CAN message
+#define CAN_ERROR_WOULD_BLOCK                     7
+//!< CAN operation would block
 //@}
 
 /** \brief Predefined CAN error descriptions
@@ -107,29 +157,111 @@ typedef struct can_message_t {
 
   unsigned char content[8];   //!< The actual CAN message content.
   size_t length;              //!< The length of the CAN message.
+  
+  double timestamp;           //!< The reception time in [s], if enabled.
 } can_message_t;
 
+/** \brief Structure defining a CAN message identifier filter
+  * 
+  * A message passes the filter if its identifier matches the filter
+  * identifier in all bits which are set in the filter mask.
+  */
+typedef struct can_filter_t {
+  int id;                     //!< The CAN message identifier to pass.
+  int mask;                   //!< The mask of identifier bits to compare.
+} can_filter_t;
+
 /** \brief Structure defining a CAN device
+  * 
+  * A device may be used from several threads at once. Opening, closing,
+  * and configuring the device is serialized by the device mutex. Senders
+  * are serialized by the send mutex and receivers by the receive mutex,
+  * such that a sender never waits for a receiver. Lock-step back-ends
+  * derive each response from a request and thus serialize senders and
+  * receivers by the send mutex. Errors of the send and receive functions
+  * are reported in separate error members, and the counters of sent and
+  * received messages are only written by the holder of the respective
+  * mutex.
   */
 typedef struct can_device_t {
+  const struct can_backend_t* backend; //!< The CAN communication back-end.
+  void* backend_handle;       //!< The handle of the loaded back-end library.
+  
   void* comm_dev;             //!< The opaque CAN communication device.
 
   config_t config;            //!< The CAN configuration parameters.
 
   ssize_t num_references;     //!< Number of references to this device.
-  ssize_t num_sent;           //!< The number of CAN messages sent.
-  ssize_t num_received;       //!< The number of CAN messages read.
+  pthread_mutex_t mutex;      //!< Mutex serializing the device setup.
+
+  int timestamps;             //!< Flag enabling message timestamps.
+
+  can_filter_t* filters;      //!< The message identifier filters.
+  size_t num_filters;         //!< The number of identifier filters.
+  unsigned char filter_map[(CAN_ID_MAX+1)/8];
+  //!< Bitmap of the message identifiers passing the filters.
     
   error_t error;              //!< The most recent CAN device error.
+
+  pthread_mutex_t send_mutex; //!< Mutex serializing the senders.
+  ssize_t num_sent;           //!< The number of CAN messages sent.
+  double send_timestamp;      //!< The time of the most recent send in [s].
+  error_t send_error;         //!< The most recent CAN send error.
+
+  pthread_mutex_t receive_mutex; //!< Mutex serializing the receivers.
+  ssize_t num_received;       //!< The number of CAN messages read.
+  error_t receive_error;      //!< The most recent CAN receive error.
 } can_device_t;
 
-/** \brief Predefined CAN device name
+/** \brief Structure defining a CAN communication back-end
+  * 
+  * Each back-end library exports an instance of this structure under the
+  * symbol name CAN_BACKEND_SYMBOL. The CAN device functions dispatch to
+  * the back-end selected for the device. Lock-step back-ends, such as the
+  * EPOS gateways, transform each sent message into its response and must
+  * receive the responses in the order of the requests. Their users must
+  * either not share the device between threads or pair requests with
+  * responses by can_device_transfer_message().
+  * 
+  * The hooks are invoked with the mutex of the device serializing their
+  * kind of operation. The send hooks report errors in the send error of
+  * the device, the receive hooks in its receive error, and all other hooks
+  * in the device error. Back-ends which are not lock-step must allow one
+  * send and one receive hook to run concurrently.
   */
-extern const char* can_device_name;
+typedef struct can_backend_t {
+  const char* name;           //!< The short name of the back-end.
+  const char* device_name;    //!< The name of the back-end's CAN device.
+  const config_default_t* default_config; //!< The back-end's parameters.
+  
+  int (*open)(can_device_t* dev);     //!< Open CAN communication.
+  int (*close)(can_device_t* dev);    //!< Close CAN communication.
+  int (*send_message)(can_device_t* dev,
+    const can_message_t* message);    //!< Send a CANopen SDO message.
+  int (*receive_message)(can_device_t* dev,
+    can_message_t* message);          //!< Receive a CANopen SDO message.
+  int (*set_filters)(can_device_t* dev); //!< Apply filters, optional.
+  int (*send_messages)(can_device_t* dev,
+    const can_message_t* messages,
+    size_t num);                      //!< Send messages, optional.
+  int (*receive_messages)(can_device_t* dev,
+    can_message_t* messages,
+    size_t num);                      //!< Receive messages, optional.
+  int lock_step;              //!< Responses are derived from requests.
+  int (*get_fd)(can_device_t* dev);   //!< Get pollable descriptor, optional.
+  int (*try_send_message)(can_device_t* dev,
+    const can_message_t* message);    //!< Send without blocking, optional.
+  int (*try_receive_message)(can_device_t* dev,
+    can_message_t* message);          //!< Receive without blocking, optional.
+  int driver_timestamps;      //!< Receive times refer to the driver's clock.
+} can_backend_t;
 
-/** \brief Predefined CAN default configuration
+/** \brief The CAN communication back-end built into this library
+  * \note This back-end is implemented by each CAN communication back-end
+  *   library and selected for all devices which do not request a back-end
+  *   by name.
   */
-extern const config_default_t can_default_config;
+extern const can_backend_t can_backend;
 
 /** \brief Initialize CAN device
   * \note The device will be initialized using default configuration
@@ -149,6 +281,23 @@ int can_device_init_config(
   can_device_t* dev,
   const config_t* config);
 
+/** \brief Select the communication back-end of a CAN device
+  * \param[in] dev The initialized, closed CAN device for which to select
+  *   the back-end.
+  * \param[in] name The short name of the back-end to be selected. If null
+  *   or empty, the back-end built into this library will be selected.
+  *   Otherwise, the back-end is loaded from the shared library whose name
+  *   results from substituting the back-end name into CAN_BACKEND_LIBRARY.
+  * \return The resulting error code.
+  * 
+  * When the back-end changes, the device configuration is re-initialized
+  * with the default parameters of the selected back-end. Parameters common
+  * to all back-ends retain their values.
+  */
+int can_device_select_backend(
+  can_device_t* dev,
+  const char* name);
+
 /** \brief Initialize CAN device by parsing command line arguments
   * \param[in] dev The CAN device to be initialized.
   * \param[in] parser The initialized configuration parser which will
@@ -162,6 +311,10 @@ int can_device_init_config(
   * \param[in] exit The exit policy of the parser in case of an error
   *   or help request.
   * \return The resulting error code.
+  * 
+  * The parser options are those of the back-end built into this library.
+  * If the parsed back-end parameter selects another back-end, parameters
+  * specific to that back-end assume their default values.
   */
 int can_device_init_config_parse(
   can_device_t* dev,
@@ -178,40 +331,249 @@ void can_device_destroy(
   can_device_t* dev);
 
 /** \brief Open CAN communication
-  * \note This method is implemented by the CAN communication backend.
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
   * \param[in] dev The initialized CAN device to be opened.
   * \return The resulting error code.
+  * 
+  * Each call adds a reference to the device, such that several users,
+  * also in different threads, may share an open device. The back-end is
+  * only opened for the first reference, and the message counters are
+  * then reset.
+  * 
+  * If the CAN_PARAMETER_TIMESTAMPS parameter is enabled, messages will be
+  * timestamped. Received messages then carry the time the back-end
+  * completed their reception. The time each message has been accepted by
+  * the back-end for sending is recorded in the send timestamp of the
+  * device. All times refer to can_get_time(), except for the reception
+  * times of back-ends which take them from their driver, as indicated by
+  * the driver_timestamps flag of the back-end. Such times cannot be
+  * compared to the send timestamp. With timestamps disabled, no clock is
+  * read and the timestamps remain zero.
   */
 int can_device_open(
   can_device_t* dev);
 
 /** \brief Close CAN communication
-  * \note This method is implemented by the CAN communication backend.
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
   * \param[in] dev The opened CAN device to be closed.
   * \return The resulting error code.
+  * 
+  * The back-end is closed when the last reference to the device is
+  * released. Operations in progress in other threads are awaited.
   */
 int can_device_close(
   can_device_t* dev);
 
+/** \brief Retrieve the current time of the message timestamp clock
+  * \return The current time in [s] on the monotonic clock used for
+  *   timestamping messages.
+  */
+double can_get_time(void);
+
+/** \brief Set the message identifier filters of a CAN device
+  * \param[in] dev The initialized CAN device to set the filters for.
+  * \param[in] filters An array of filters, of which a received message
+  *   must pass at least one.
+  * \param[in] num The number of filters in the array. If zero, all
+  *   messages will be received.
+  * \return The resulting error code.
+  * 
+  * The filters are compiled into a bitmap over all standard message
+  * identifiers. Back-ends attached to the bus provide the set_filters
+  * hook, which applies a superset of the filters in the controller or
+  * kernel, such that most unwanted messages never reach the host. Every
+  * message they receive is then checked against the bitmap. Back-ends
+  * without the hook, such as the EPOS gateways, only return responses to
+  * the host's own requests and are not filtered. The filters may be set
+  * before or while the device is open. In the latter case, operations in
+  * progress in other threads are awaited, and concurrent receivers check
+  * each message against either the previous or the new bitmap.
+  */
+int can_device_set_filters(
+  can_device_t* dev,
+  const can_filter_t* filters,
+  size_t num);
+
+/** \brief Check a message identifier against the filters of a CAN device
+  * \param[in] dev The CAN device to check the identifier against.
+  * \param[in] id The CAN message identifier to be checked.
+  * \return Non-zero if the identifier passes the filters.
+  */
+int can_device_accepts(
+  const can_device_t* dev,
+  int id);
+
 /** \brief Send a CANopen SDO message
-  * \note This method is implemented by the CAN communication backend.
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
   * \param[in] dev The CAN device to be used for sending the message.
   * \param[in] message The CANopen SDO message to be sent.
-  * \return The resulting error code.
+  * \return The resulting error code, which is also reported in the send
+  *   error of the device.
   */
 int can_device_send_message(
   can_device_t* dev,
   const can_message_t* message);
 
 /** \brief Synchronously receive a CANopen SDO message
-  * \note This method is implemented by the CAN communication backend.
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
   * \param[in] dev The CAN device to be used for receiving the message.
   * \param[in,out] message The sent CAN message that will be transformed
   *   into the CANopen SDO message received.
-  * \return The resulting error code.
+  * \return The resulting error code, which is also reported in the
+  *   receive error of the device.
+  * 
+  * If identifier filters have been set and the back-end supports them,
+  * messages which do not pass the filters are discarded and the back-end
+  * is asked for the next message.
   */
 int can_device_receive_message(
   can_device_t* dev,
   can_message_t* message);
 
+/** \brief Send a CANopen SDO request and receive its response
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
+  * \param[in] dev The CAN device to be used for the transaction.
+  * \param[in] request The CANopen SDO request to be sent.
+  * \param[out] response The CANopen SDO response received, which may
+  *   refer to the same message as the request.
+  * \return The resulting error code, which is also reported in the send
+  *   or receive error of the device, respectively.
+  * 
+  * The device is locked for sending and receiving from the request until
+  * the response has been received. Separate calls of
+  * can_device_send_message() and can_device_receive_message() release
+  * the device in between, such that on lock-step back-ends, another
+  * thread may receive the response derived from the request. Threads
+  * sharing a device of a lock-step back-end must therefore perform their
+  * transactions through this function.
+  */
+int can_device_transfer_message(
+  can_device_t* dev,
+  const can_message_t* request,
+  can_message_t* response);
+
+/** \brief Send an array of CANopen SDO messages
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
+  * \param[in] dev The CAN device to be used for sending the messages.
+  * \param[in] messages An array of CANopen SDO messages to be sent.
+  * \param[in] num The number of messages in the array.
+  * \return The number of messages sent or the negative error code. If
+  *   an error occurs after some messages have been sent, their number is
+  *   returned and the send error of the device is set.
+  * 
+  * With fewer messages sent than requested, the error refers to the
+  * first message not sent. Back-ends which queue messages may however
+  * detect the failure of a message accepted by an earlier call. All
+  * messages are then reported as sent, while the send error is set.
+  * 
+  * Back-ends providing the send_messages hook pass several messages to
+  * their device at once. For all other back-ends, the messages are sent
+  * one by one. A back-end may also accept fewer messages than requested
+  * without an error, e.g., a gateway which handles a single request at a
+  * time. The caller is then expected to receive the responses before
+  * sending the remaining messages.
+  */
+int can_device_send_messages(
+  can_device_t* dev,
+  const can_message_t* messages,
+  size_t num);
+
+/** \brief Receive an array of CANopen SDO messages
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
+  * \param[in] dev The CAN device to be used for receiving the messages.
+  * \param[in,out] messages An array of sent CAN messages that will be
+  *   transformed into the CANopen SDO messages received.
+  * \param[in] num The maximum number of messages to be received.
+  * \return The number of messages received or the negative error code.
+  *   If an error occurs after some messages have been received, their
+  *   number is returned and the receive error of the device is set.
+  * 
+  * Back-ends providing the receive_messages hook return as soon as at
+  * least one message is available, with as many messages as they have
+  * at hand. All other back-ends, e.g. the EPOS gateways, receive the
+  * responses to the sent messages one by one until the array is full.
+  */
+int can_device_receive_messages(
+  can_device_t* dev,
+  can_message_t* messages,
+  size_t num);
+
+/** \brief Retrieve a pollable file descriptor of a CAN device
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
+  * \param[in] dev The open CAN device to retrieve the descriptor of.
+  * \return The file descriptor or the negative error code.
+  * 
+  * The descriptor becomes readable when can_device_try_receive_message()
+  * may return a message. It allows for multiplexing several devices in a
+  * single event loop. Since back-ends buffer messages beyond what the
+  * descriptor reports, the try function should be called until it fails
+  * with CAN_ERROR_WOULD_BLOCK before waiting for the descriptor, also
+  * after sending. The descriptor is owned by the device and must not be
+  * closed.
+  */
+int can_device_get_fd(
+  can_device_t* dev);
+
+/** \brief Send a CANopen SDO message without blocking
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
+  * \param[in] dev The CAN device to be used for sending the message.
+  * \param[in] message The CANopen SDO message to be sent.
+  * \return The resulting error code, CAN_ERROR_WOULD_BLOCK if the device
+  *   cannot accept the message at the moment. The error is also reported
+  *   in the send error of the device.
+  * 
+  * Back-ends without the try_send_message hook send the message by
+  * can_device_send_message().
+  */
+int can_device_try_send_message(
+  can_device_t* dev,
+  const can_message_t* message);
+
+/** \brief Receive a CANopen SDO message without blocking
+  * \note This method dispatches to the selected CAN communication
+  *   back-end.
+  * \param[in] dev The CAN device to be used for receiving the message.
+  * \param[in,out] message The sent CAN message that will be transformed
+  *   into the CANopen SDO message received.
+  * \return The resulting error code, CAN_ERROR_WOULD_BLOCK if no message
+  *   is available at the moment. The error is also reported in the
+  *   receive error of the device.
+  * 
+  * Back-ends without the try_receive_message hook receive the message by
+  * can_device_receive_message(). Messages which do not pass the filters
+  * of the device are discarded as by can_device_receive_message().
+  */
+int can_device_try_receive_message(
+  can_device_t* dev,
+  can_message_t* message);
+
+/** \brief Retrieve the number of messages sent over a CAN device
+  * \param[in] dev The CAN device to retrieve the number of messages for.
+  * \return The number of messages sent since the device has been opened.
+  * 
+  * The counter may be read by any thread while messages are being sent.
+  */
+ssize_t can_device_get_num_sent(
+  const can_device_t* dev);
+
+/** \brief Retrieve the number of messages received on a CAN device
+  * \param[in] dev The CAN device to retrieve the number of messages for.
+  * \return The number of messages received since the device has been
+  *   opened.
+  * 
+  * The counter may be read by any thread while messages are being
+  * received.
+  */
+ssize_t can_device_get_num_received(
+  const can_device_t* dev);
+
 #endif
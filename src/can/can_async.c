@@ -0,0 +1,406 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <string.h>
+
+#include "can_async.h"
+
+const char* can_async_errors[] = {
+  "Success",
+  "CAN transfer queue full",
+  "Failed to send CAN transfer request",
+  "Failed to receive CAN transfer response",
+  "CAN transfer cancelled",
+  "CAN transfer timed out",
+  "Invalid CAN transfer node",
+};
+
+int can_async_send(can_async_t* async);
+int can_async_receive(can_async_t* async);
+int can_async_receive_lock_step(can_async_t* async);
+int can_async_expire(can_async_t* async);
+void can_async_dispatch(can_dispatch_t* dispatch, const can_message_t*
+  message, void* user_data);
+int can_async_match(const can_message_t* request, const can_message_t*
+  response);
+void can_async_complete(can_async_t* async, can_async_transfer_t* transfer,
+  const can_message_t* response, int error);
+
+void can_async_init(can_async_t* async, can_device_t* dev, double timeout) {
+  async->dev = dev;
+
+  async->head = 0;
+  async->next = 0;
+  async->tail = 0;
+  async->num_unmatched = 0;
+
+  memset(async->nodes, 0, sizeof(async->nodes));
+  async->num_in_flight = 0;
+  async->timeout = timeout;
+  async->dispatch = 0;
+
+  error_init(&async->error, can_async_errors);
+}
+
+void can_async_destroy(can_async_t* async) {
+  can_async_set_dispatch(async, 0);
+  can_async_cancel(async);
+  error_destroy(&async->error);
+}
+
+int can_async_set_dispatch(can_async_t* async, can_dispatch_t* dispatch) {
+  int node;
+  
+  error_clear(&async->error);
+
+  if (dispatch && async->dev->backend->lock_step) {
+    error_setf(&async->error, CAN_ASYNC_ERROR_RECEIVE,
+      "%s device is lock-step", async->dev->backend->device_name);
+    return async->error.code;
+  }
+
+  if (async->dispatch)
+    for (node = CAN_NODE_ID_BROADCAST+1; node <= CAN_NODE_ID_MAX; ++node)
+      can_dispatch_set_handler(async->dispatch, CAN_COB_ID_SDO_RECEIVE+node,
+        0, 0);
+  if (dispatch)
+    for (node = CAN_NODE_ID_BROADCAST+1; node <= CAN_NODE_ID_MAX; ++node)
+      can_dispatch_set_handler(dispatch, CAN_COB_ID_SDO_RECEIVE+node,
+        can_async_dispatch, async);
+  async->dispatch = dispatch;
+
+  return async->error.code;
+}
+
+int can_async_submit(can_async_t* async, const can_message_t* request,
+    can_async_callback_t callback, void* user_data) {
+  can_async_transfer_t* transfer;
+  
+  error_clear(&async->error);
+
+  if ((request->id <= CAN_COB_ID_SDO_SEND+CAN_NODE_ID_BROADCAST) ||
+      (request->id > CAN_COB_ID_SDO_SEND+CAN_NODE_ID_MAX)) {
+    error_setf(&async->error, CAN_ASYNC_ERROR_NODE,
+      "Invalid SDO request identifier: 0x%03x", request->id);
+    return async->error.code;
+  }
+  
+  if (async->tail-async->head >= CAN_ASYNC_QUEUE_SIZE) {
+    error_set(&async->error, CAN_ASYNC_ERROR_QUEUE);
+    return async->error.code;
+  }
+
+  transfer = &async->transfers[async->tail & (CAN_ASYNC_QUEUE_SIZE-1)];
+  transfer->request = *request;
+  transfer->callback = callback;
+  transfer->user_data = user_data;
+  transfer->sent = 0;
+  transfer->deadline = 0.0;
+  transfer->done = 0;
+  ++async->tail;
+
+  return async->error.code;
+}
+
+int can_async_progress(can_async_t* async) {
+  int num_completed;
+  
+  error_clear(&async->error);
+
+  num_completed = can_async_send(async);
+  if (async->dispatch) {
+    if (async->timeout > 0.0)
+      num_completed += can_async_expire(async);
+  }
+  else if (async->dev->backend->lock_step)
+    num_completed += can_async_receive_lock_step(async);
+  else
+    num_completed += can_async_receive(async);
+
+  return (num_completed || !async->error.code) ? num_completed :
+    -async->error.code;
+}
+
+int can_async_cancel(can_async_t* async) {
+  can_message_t responses[CAN_ASYNC_QUEUE_SIZE];
+  can_async_transfer_t transfer;
+  size_t i, num = 0, tail = async->tail;
+  int result, num_cancelled = 0;
+
+  if (async->dev->backend->lock_step) {
+    for (i = async->head; i != async->next; ++i) {
+      transfer = async->transfers[i & (CAN_ASYNC_QUEUE_SIZE-1)];
+      if (transfer.sent && !transfer.done)
+        responses[num++] = transfer.request;
+    }
+    
+    for (i = 0; i < num; i += result)
+      if ((result = can_device_receive_messages(async->dev, &responses[i],
+          num-i)) <= 0)
+        break;
+  }
+  
+  memset(async->nodes, 0, sizeof(async->nodes));
+  async->num_in_flight = 0;
+  
+  while (async->head != tail) {
+    transfer = async->transfers[async->head & (CAN_ASYNC_QUEUE_SIZE-1)];
+    ++async->head;
+    if (async->next < async->head)
+      async->next = async->head;
+
+    if (!transfer.done) {
+      ++num_cancelled;
+      if (transfer.callback)
+        transfer.callback(async, &transfer.request, 0,
+          CAN_ASYNC_ERROR_CANCEL, transfer.user_data);
+    }
+  }
+
+  return num_cancelled;
+}
+
+size_t can_async_get_num_pending(const can_async_t* async) {
+  size_t i, num_pending = 0;
+
+  for (i = async->head; i != async->tail; ++i)
+    if (!async->transfers[i & (CAN_ASYNC_QUEUE_SIZE-1)].done)
+      ++num_pending;
+
+  return num_pending;
+}
+
+int can_async_send(can_async_t* async) {
+  can_message_t requests[CAN_ASYNC_QUEUE_SIZE];
+  can_async_transfer_t* transfers[CAN_ASYNC_QUEUE_SIZE];
+  can_async_transfer_t* transfer;
+  int lock_step = async->dev->backend->lock_step;
+  size_t i, num = 0;
+  double deadline = 0.0;
+  int node, result;
+
+  if (lock_step && (async->head != async->next))
+    return 0;
+
+  for (i = async->next; i != async->tail; ++i) {
+    transfer = &async->transfers[i & (CAN_ASYNC_QUEUE_SIZE-1)];
+    if (transfer->sent || transfer->done)
+      continue;
+    
+    if (!lock_step) {
+      node = transfer->request.id-CAN_COB_ID_SDO_SEND;
+      if (async->nodes[node])
+        continue;
+      async->nodes[node] = transfer;
+    }
+    
+    requests[num] = transfer->request;
+    transfers[num] = transfer;
+    ++num;
+  }
+  
+  if (!num)
+    return 0;
+
+  result = can_device_send_messages(async->dev, requests, num);
+  if (async->timeout > 0.0)
+    deadline = can_get_time()+async->timeout;
+  
+  for (i = 0; i < num; ++i) {
+    if ((int)i < result) {
+      transfers[i]->sent = 1;
+      transfers[i]->deadline = deadline;
+      ++async->num_in_flight;
+    }
+    else if (!lock_step)
+      async->nodes[transfers[i]->request.id-CAN_COB_ID_SDO_SEND] = 0;
+  }
+  
+  while ((async->next != async->tail) && async->transfers[async->next &
+      (CAN_ASYNC_QUEUE_SIZE-1)].sent)
+    ++async->next;
+  
+  if (async->dev->send_error.code) {
+    error_blame(&async->error, &async->dev->send_error,
+      CAN_ASYNC_ERROR_SEND);
+    
+    /* With all requests sent, a request sent earlier has failed, and the
+     * oldest one still awaiting its response is the first to be sent. */
+    if (result < 0)
+      result = 0;
+    if (result < num)
+      transfer = transfers[result];
+    else for (i = async->head; i != async->tail; ++i) {
+      transfer = &async->transfers[i & (CAN_ASYNC_QUEUE_SIZE-1)];
+      if (transfer->sent && !transfer->done)
+        break;
+    }
+    can_async_complete(async, transfer, 0, CAN_ASYNC_ERROR_SEND);
+    
+    return 1;
+  }
+
+  return 0;
+}
+
+int can_async_receive(can_async_t* async) {
+  can_message_t responses[CAN_ASYNC_QUEUE_SIZE];
+  can_async_transfer_t* transfer;
+  size_t i, num = 1;
+  int result, num_completed = 0;
+
+  if (!async->num_in_flight)
+    return 0;
+
+  if (async->dev->backend->receive_messages)
+    num = CAN_ASYNC_QUEUE_SIZE;
+  if ((result = can_device_receive_messages(async->dev, responses,
+      num)) <= 0) {
+    error_blame(&async->error, &async->dev->receive_error,
+      CAN_ASYNC_ERROR_RECEIVE);
+    
+    if (async->timeout > 0.0)
+      return can_async_expire(async);
+    
+    for (i = async->head; i != async->tail; ++i) {
+      transfer = &async->transfers[i & (CAN_ASYNC_QUEUE_SIZE-1)];
+      if (transfer->sent && !transfer->done)
+        break;
+    }
+    can_async_complete(async, transfer, 0, CAN_ASYNC_ERROR_RECEIVE);
+    
+    return 1;
+  }
+
+  for (i = 0; i < result; ++i)
+    num_completed += can_async_handle(async, &responses[i]);
+
+  if (async->timeout > 0.0)
+    num_completed += can_async_expire(async);
+  
+  return num_completed;
+}
+
+int can_async_handle(can_async_t* async, const can_message_t* response) {
+  can_async_transfer_t* transfer;
+  unsigned int node = response->id-CAN_COB_ID_SDO_RECEIVE;
+  
+  if ((node <= CAN_NODE_ID_MAX) && (transfer = async->nodes[node]) &&
+      can_async_match(&transfer->request, response)) {
+    can_async_complete(async, transfer, response, 0);
+    return 1;
+  }
+  
+  ++async->num_unmatched;
+  return 0;
+}
+
+int can_async_receive_lock_step(can_async_t* async) {
+  can_message_t responses[CAN_ASYNC_QUEUE_SIZE];
+  can_async_transfer_t* transfers[CAN_ASYNC_QUEUE_SIZE];
+  size_t i, num = 0;
+  int result;
+
+  for (i = async->head; i != async->next; ++i)
+    if (!async->transfers[i & (CAN_ASYNC_QUEUE_SIZE-1)].done) {
+      transfers[num] = &async->transfers[i & (CAN_ASYNC_QUEUE_SIZE-1)];
+      responses[num] = transfers[num]->request;
+      ++num;
+    }
+  
+  if (!num)
+    return 0;
+
+  if ((result = can_device_receive_messages(async->dev, responses, num)) < 0)
+    result = 0;
+  for (i = 0; i < result; ++i)
+    can_async_complete(async, transfers[i], &responses[i], 0);
+
+  if (result < num) {
+    error_blame(&async->error, &async->dev->receive_error,
+      CAN_ASYNC_ERROR_RECEIVE);
+    for (i = result; i < num; ++i)
+      can_async_complete(async, transfers[i], 0, CAN_ASYNC_ERROR_RECEIVE);
+  }
+  
+  return num;
+}
+
+int can_async_expire(can_async_t* async) {
+  can_async_transfer_t* transfer;
+  size_t i, tail = async->tail;
+  double time = can_get_time();
+  int num_expired = 0;
+
+  for (i = async->head; i != tail; ++i) {
+    transfer = &async->transfers[i & (CAN_ASYNC_QUEUE_SIZE-1)];
+    if (transfer->sent && !transfer->done && (transfer->deadline <= time)) {
+      can_async_complete(async, transfer, 0, CAN_ASYNC_ERROR_TIMEOUT);
+      ++num_expired;
+    }
+  }
+
+  return num_expired;
+}
+
+void can_async_dispatch(can_dispatch_t* dispatch, const can_message_t*
+    message, void* user_data) {
+  can_async_handle((can_async_t*)user_data, message);
+}
+
+int can_async_match(const can_message_t* request, const can_message_t*
+    response) {
+  /* Segment responses carry no object. All others, including aborts,
+   * repeat the index and subindex of the request. */
+  if (!(request->content[0] & 0xE0) || ((request->content[0] & 0xE0) ==
+      CAN_CMD_SDO_READ_RECEIVE_N_BYTE_SEGMENT))
+    return 1;
+  
+  return (response->length >= 4) &&
+    (response->content[1] == request->content[1]) &&
+    (response->content[2] == request->content[2]) &&
+    (response->content[3] == request->content[3]);
+}
+
+void can_async_complete(can_async_t* async, can_async_transfer_t* transfer,
+    const can_message_t* response, int error) {
+  can_async_transfer_t completed = *transfer;
+  int node = completed.request.id-CAN_COB_ID_SDO_SEND;
+
+  transfer->done = 1;
+  if (completed.sent)
+    --async->num_in_flight;
+  if (async->nodes[node] == transfer)
+    async->nodes[node] = 0;
+  
+  while ((async->head != async->tail) && async->transfers[async->head &
+      (CAN_ASYNC_QUEUE_SIZE-1)].done)
+    ++async->head;
+  while ((async->next != async->tail) && (async->transfers[async->next &
+      (CAN_ASYNC_QUEUE_SIZE-1)].sent || async->transfers[async->next &
+      (CAN_ASYNC_QUEUE_SIZE-1)].done))
+    ++async->next;
+  if (async->next < async->head)
+    async->next = async->head;
+
+  if (completed.callback)
+    completed.callback(async, &completed.request, response, error,
+      completed.user_data);
+}
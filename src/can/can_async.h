@@ -0,0 +1,249 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef CAN_ASYNC_H
+#define CAN_ASYNC_H
+
+/** \file can_async.h
+  * \brief Asynchronous CANopen SDO transfers
+  * 
+  * Submission of CANopen SDO requests with completion callbacks. Requests
+  * are queued by can_async_submit() and handed to the CAN device by
+  * can_async_progress(), which also receives the responses and invokes
+  * the callbacks. Several requests may thus be in flight at once, and the
+  * caller regains control between progress calls.
+  * 
+  * On back-ends attached to a CAN bus, one transfer per node may be in
+  * flight. All queued requests to nodes without a transfer in flight are
+  * sent at once, such that many nodes are served within a single round
+  * trip. Responses are matched to the transfers in flight by the node
+  * identifier in their SDO communication object identifier, using a
+  * table indexed by the node. Each transfer may time out independently
+  * of the others. Lock-step back-ends, i.e.
+  * the EPOS gateways, derive each response from its request. Their
+  * requests are sent as a batch once all responses to the previous batch
+  * have been received, and responses complete the requests in order.
+  * 
+  * On bus back-ends, the responses may alternatively be received by a CAN
+  * dispatcher, such that the SDO responses reach the transfers while
+  * emergency messages and heartbeats reach their own consumers.
+  */
+
+#include "can_dispatch.h"
+
+/** \name Error Codes
+  * \brief Predefined asynchronous CAN transfer error codes
+  */
+//@{
+#define CAN_ASYNC_ERROR_NONE                      0
+//!< Success
+#define CAN_ASYNC_ERROR_QUEUE                     1
+//!< CAN transfer queue full
+#define CAN_ASYNC_ERROR_SEND                      2
+//!< Failed to send CAN transfer request
+#define CAN_ASYNC_ERROR_RECEIVE                   3
+//!< Failed to receive CAN transfer response
+#define CAN_ASYNC_ERROR_CANCEL                    4
+//!< CAN transfer cancelled
+#define CAN_ASYNC_ERROR_TIMEOUT                   5
+//!< CAN transfer timed out
+#define CAN_ASYNC_ERROR_NODE                      6
+//!< Invalid CAN transfer node
+//@}
+
+/** \brief Number of transfers held by the asynchronous transfer queue
+  * \note The size must be a power of two. It allows for a transfer in
+  *   flight to each node.
+  */
+#define CAN_ASYNC_QUEUE_SIZE                      128
+
+/** \brief Predefined asynchronous CAN transfer error descriptions
+  */
+extern const char* can_async_errors[];
+
+/** \brief Forward declaration of the asynchronous CAN transfer context
+  */
+typedef struct can_async_t can_async_t;
+
+/** \brief Completion callback of an asynchronous CAN transfer
+  * \param[in] async The asynchronous context which completed the transfer.
+  * \param[in] request The CANopen SDO request of the transfer.
+  * \param[in] response The CANopen SDO response received, or null if the
+  *   transfer failed.
+  * \param[in] error The error code of the transfer, or zero on success.
+  * \param[in] user_data The user data passed on submission.
+  * 
+  * The callback may submit further transfers to the context.
+  */
+typedef void (*can_async_callback_t)(
+  can_async_t* async,
+  const can_message_t* request,
+  const can_message_t* response,
+  int error,
+  void* user_data);
+
+/** \brief Structure defining an asynchronous CAN transfer
+  */
+typedef struct can_async_transfer_t {
+  can_message_t request;          //!< The CANopen SDO request.
+  can_async_callback_t callback;  //!< The completion callback, or null.
+  void* user_data;                //!< The user data passed to the callback.
+  int sent;                       //!< Flag indicating the request was sent.
+  double deadline;                //!< The time the transfer expires in [s].
+  int done;                       //!< Flag indicating completion.
+} can_async_transfer_t;
+
+/** \brief Structure defining an asynchronous CAN transfer context
+  */
+struct can_async_t {
+  can_device_t* dev;              //!< The open CAN device used.
+
+  can_async_transfer_t transfers[CAN_ASYNC_QUEUE_SIZE];
+  //!< Queue of submitted transfers.
+  size_t head;                    //!< Queue position of the oldest transfer.
+  size_t next;                    //!< Queue position of the next request.
+  size_t tail;                    //!< Queue position past the last transfer.
+  size_t num_unmatched;           //!< Number of responses left unmatched.
+
+  can_async_transfer_t* nodes[CAN_NODE_ID_MAX+1];
+  //!< Transfers in flight indexed by their node identifier.
+  size_t num_in_flight;           //!< Number of transfers in flight.
+  double timeout;                 //!< The transfer timeout in [s].
+  can_dispatch_t* dispatch;       //!< The dispatcher receiving, or null.
+
+  error_t error;                  //!< The most recent asynchronous error.
+};
+
+/** \brief Initialize an asynchronous CAN transfer context
+  * \param[in] async The asynchronous context to be initialized.
+  * \param[in] dev The open CAN device to be used for the transfers.
+  * \param[in] timeout The time in [s] after which a transfer in flight on
+  *   a bus back-end fails with CAN_ASYNC_ERROR_TIMEOUT. If zero, transfers
+  *   do not expire, and a receive error fails the oldest transfer in
+  *   flight instead.
+  */
+void can_async_init(
+  can_async_t* async,
+  can_device_t* dev,
+  double timeout);
+
+/** \brief Destroy an asynchronous CAN transfer context
+  * \param[in] async The asynchronous context to be destroyed.
+  * 
+  * Transfers still pending are cancelled, and the context is unregistered
+  * from its dispatcher.
+  */
+void can_async_destroy(
+  can_async_t* async);
+
+/** \brief Receive the responses of asynchronous CAN transfers by dispatcher
+  * \param[in] async The asynchronous context to receive the responses for.
+  * \param[in] dispatch The dispatcher to receive the responses with, or
+  *   null to have can_async_progress() receive them from the device.
+  * \return The resulting error code, CAN_ASYNC_ERROR_RECEIVE if the
+  *   back-end is lock-step.
+  * 
+  * The context is registered as the handler of the SDO responses of all
+  * nodes, replacing any consumer, e.g., a node queue, registered for them
+  * before. can_async_progress() then only sends the queued requests and
+  * expires transfers, whereas can_dispatch_progress() completes them.
+  * Both must thus be called from the same thread. Without a transfer
+  * timeout, transfers in flight do not fail upon dispatcher errors.
+  */
+int can_async_set_dispatch(
+  can_async_t* async,
+  can_dispatch_t* dispatch);
+
+/** \brief Submit an asynchronous CAN transfer
+  * \param[in] async The asynchronous context to submit the transfer to.
+  * \param[in] request The CANopen SDO request to be sent.
+  * \param[in] callback The callback to be invoked upon completion, or
+  *   null.
+  * \param[in] user_data Arbitrary user data passed to the callback.
+  * \return The resulting error code, CAN_ASYNC_ERROR_NODE if the request
+  *   is not addressed to the SDO server of a valid node.
+  * 
+  * The request is only queued. It will be sent by a subsequent call to
+  * can_async_progress(), as soon as no other transfer to the same node is
+  * in flight.
+  */
+int can_async_submit(
+  can_async_t* async,
+  const can_message_t* request,
+  can_async_callback_t callback,
+  void* user_data);
+
+/** \brief Make progress on the submitted asynchronous CAN transfers
+  * \param[in] async The asynchronous context to make progress on.
+  * \return The number of transfers completed or the negative error code.
+  * 
+  * Queued requests are sent as far as the back-end allows. If transfers
+  * are in flight, the function then blocks until the back-end receives
+  * responses or times out, and invokes the callbacks of the completed
+  * transfers. On bus back-ends, a response completes the transfer in
+  * flight to its node only if it refers to the same object, such that
+  * late responses to expired transfers remain unmatched. With a transfer
+  * timeout, transfers in flight past their deadline then fail, and
+  * receive errors alone fail no transfer. The deadlines are thus checked
+  * with the granularity of the receive timeout of the back-end. Without
+  * a transfer timeout, the oldest transfer in flight fails upon a receive
+  * error. On lock-step back-ends, all transfers in flight fail upon a
+  * receive error. Failed transfers count as completed.
+  */
+int can_async_progress(
+  can_async_t* async);
+
+/** \brief Handle the response of an asynchronous CAN transfer
+  * \param[in] async The asynchronous context to handle the response with.
+  * \param[in] response The CANopen SDO response received from a CAN bus.
+  * \return One if the response completed a transfer, zero if it remained
+  *   unmatched.
+  * 
+  * The response completes the transfer in flight to its node if it
+  * refers to the same object, and the callback of the transfer is invoked.
+  * This allows for receiving responses elsewhere, e.g., by a dispatcher
+  * handler. It must not be called concurrently with can_async_progress().
+  */
+int can_async_handle(
+  can_async_t* async,
+  const can_message_t* response);
+
+/** \brief Cancel all pending asynchronous CAN transfers
+  * \param[in] async The asynchronous context to cancel the transfers of.
+  * \return The number of transfers cancelled.
+  * 
+  * The callbacks of the cancelled transfers are invoked with the error
+  * code CAN_ASYNC_ERROR_CANCEL. Responses to requests which have already
+  * been sent may still be received and will then remain unmatched. On
+  * lock-step back-ends, which derive each response from its request, the
+  * responses to requests already sent are received and discarded before
+  * cancelling, such that they do not complete later transfers.
+  */
+int can_async_cancel(
+  can_async_t* async);
+
+/** \brief Retrieve the number of pending asynchronous CAN transfers
+  * \param[in] async The asynchronous context to be queried.
+  * \return The number of transfers submitted and not yet completed.
+  */
+size_t can_async_get_num_pending(
+  const can_async_t* async);
+
+#endif
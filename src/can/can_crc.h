@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef CAN_CRC_H
+#define CAN_CRC_H
+
+/** \file can_crc.h
+  * \brief CRC-CCITT checksum calculation
+  * 
+  * Common 16-bit CRC-CCITT implementation (polynomial 0x1021, most
+  * significant bit first) used by the EPOS gateway protocols. A sliced
+  * table-driven implementation serves short frames and platforms without
+  * carry-less multiplication. On x86 processors supporting PCLMULQDQ,
+  * long buffers are folded 16 bytes at a time and reduced by Barrett
+  * reduction, where the instruction set is detected at runtime.
+  */
+
+#include <stddef.h>
+
+/** \brief Minimum buffer size in [byte] for the carry-less multiplication
+  *   implementation to be selected
+  */
+#define CAN_CRC_CLMUL_MIN_SIZE            32
+
+/** \brief Update a CRC-CCITT checksum
+  * \param[in] crc The CRC-CCITT checksum of any preceding data, or zero.
+  * \param[in] data An array of bytes over which to update the checksum.
+  * \param[in] num The number of bytes in the array.
+  * \return The updated CRC-CCITT checksum.
+  * 
+  * This function dispatches to the fastest implementation available on
+  * the running processor.
+  */
+unsigned short can_crc_ccitt(
+  unsigned short crc,
+  const unsigned char* data,
+  size_t num);
+
+/** \brief Update a CRC-CCITT checksum using lookup tables
+  * \param[in] crc The CRC-CCITT checksum of any preceding data, or zero.
+  * \param[in] data An array of bytes over which to update the checksum.
+  * \param[in] num The number of bytes in the array.
+  * \return The updated CRC-CCITT checksum.
+  * 
+  * This implementation processes four bytes per iteration using a set
+  * of four lookup tables (slicing-by-4).
+  */
+unsigned short can_crc_ccitt_table(
+  unsigned short crc,
+  const unsigned char* data,
+  size_t num);
+
+/** \brief Update a CRC-CCITT checksum using carry-less multiplication
+  * \param[in] crc The CRC-CCITT checksum of any preceding data, or zero.
+  * \param[in] data An array of bytes over which to update the checksum.
+  * \param[in] num The number of bytes in the array.
+  * \return The updated CRC-CCITT checksum.
+  * 
+  * This implementation requires a processor supporting the PCLMULQDQ and
+  * SSSE3 instruction sets. Where not available at compile time, it falls
+  * back to can_crc_ccitt_table().
+  */
+unsigned short can_crc_ccitt_clmul(
+  unsigned short crc,
+  const unsigned char* data,
+  size_t num);
+
+#endif
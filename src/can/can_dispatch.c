@@ -0,0 +1,233 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "can_dispatch.h"
+
+const char* can_dispatch_errors[] = {
+  "Success",
+  "Invalid CAN message identifier",
+  "CAN back-end does not support dispatching",
+  "Failed to receive CAN messages",
+  "Failed to set CAN message filters",
+};
+
+void can_dispatch_queue_init(can_dispatch_queue_t* queue) {
+  queue->head = 0;
+  queue->tail = 0;
+  queue->num_dropped = 0;
+  queue->event_fd = -1;
+}
+
+void can_dispatch_queue_destroy(can_dispatch_queue_t* queue) {
+  if (queue->event_fd >= 0) {
+    close(queue->event_fd);
+    queue->event_fd = -1;
+  }
+}
+
+int can_dispatch_queue_open_event(can_dispatch_queue_t* queue) {
+  if (queue->event_fd < 0)
+    queue->event_fd = eventfd(can_dispatch_queue_get_num_messages(queue),
+      EFD_NONBLOCK | EFD_SEMAPHORE);
+  
+  return queue->event_fd;
+}
+
+int can_dispatch_queue_get(can_dispatch_queue_t* queue, can_message_t*
+    message) {
+  size_t head = queue->head;
+  eventfd_t value;
+
+  if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  *message = queue->messages[head & (CAN_DISPATCH_QUEUE_SIZE-1)];
+  __atomic_store_n(&queue->head, head+1, __ATOMIC_RELEASE);
+  if (queue->event_fd >= 0)
+    eventfd_read(queue->event_fd, &value);
+
+  return 1;
+}
+
+size_t can_dispatch_queue_get_num_messages(const can_dispatch_queue_t*
+    queue) {
+  return __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)-
+    __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+}
+
+void can_dispatch_init(can_dispatch_t* dispatch, can_device_t* dev) {
+  dispatch->dev = dev;
+
+  memset(dispatch->entries, 0, sizeof(dispatch->entries));
+  dispatch->num_unhandled = 0;
+
+  error_init(&dispatch->error, can_dispatch_errors);
+}
+
+void can_dispatch_destroy(can_dispatch_t* dispatch) {
+  error_destroy(&dispatch->error);
+}
+
+int can_dispatch_set_handler(can_dispatch_t* dispatch, int id,
+    can_dispatch_handler_t handler, void* user_data) {
+  error_clear(&dispatch->error);
+
+  if ((id < 0) || (id > CAN_ID_MAX)) {
+    error_setf(&dispatch->error, CAN_DISPATCH_ERROR_ID,
+      "Invalid message identifier: 0x%x", id);
+    return dispatch->error.code;
+  }
+
+  dispatch->entries[id].handler = handler;
+  dispatch->entries[id].user_data = user_data;
+  dispatch->entries[id].queue = 0;
+
+  return dispatch->error.code;
+}
+
+int can_dispatch_set_queue(can_dispatch_t* dispatch, int id,
+    can_dispatch_queue_t* queue) {
+  error_clear(&dispatch->error);
+
+  if ((id < 0) || (id > CAN_ID_MAX)) {
+    error_setf(&dispatch->error, CAN_DISPATCH_ERROR_ID,
+      "Invalid message identifier: 0x%x", id);
+    return dispatch->error.code;
+  }
+
+  dispatch->entries[id].handler = 0;
+  dispatch->entries[id].user_data = 0;
+  dispatch->entries[id].queue = queue;
+
+  return dispatch->error.code;
+}
+
+int can_dispatch_set_node_queue(can_dispatch_t* dispatch, int node_id,
+    can_dispatch_queue_t* queue) {
+  error_clear(&dispatch->error);
+
+  if ((node_id <= CAN_NODE_ID_BROADCAST) || (node_id > CAN_NODE_ID_MAX)) {
+    error_setf(&dispatch->error, CAN_DISPATCH_ERROR_ID,
+      "Invalid node identifier: %d", node_id);
+    return dispatch->error.code;
+  }
+
+  can_dispatch_set_queue(dispatch, CAN_COB_ID_SDO_RECEIVE+node_id, queue);
+  can_dispatch_set_queue(dispatch, CAN_COB_ID_SDO_EMERGENCY+node_id, queue);
+  can_dispatch_set_queue(dispatch, CAN_COB_ID_NMT_HEARTBEAT+node_id, queue);
+
+  return dispatch->error.code;
+}
+
+int can_dispatch_set_filters(can_dispatch_t* dispatch) {
+  can_filter_t* filters;
+  size_t num = 0;
+  int id;
+
+  error_clear(&dispatch->error);
+
+  filters = malloc((CAN_ID_MAX+1)*sizeof(can_filter_t));
+  for (id = 0; id <= CAN_ID_MAX; ++id)
+    if (dispatch->entries[id].handler || dispatch->entries[id].queue) {
+      filters[num].id = id;
+      filters[num].mask = CAN_ID_MAX;
+      ++num;
+    }
+
+  if (!num)
+    error_setf(&dispatch->error, CAN_DISPATCH_ERROR_FILTER,
+      "No consumers registered");
+  else if (can_device_set_filters(dispatch->dev, filters, num))
+    error_blame(&dispatch->error, &dispatch->dev->error,
+      CAN_DISPATCH_ERROR_FILTER);
+
+  free(filters);
+
+  return dispatch->error.code;
+}
+
+int can_dispatch_message(can_dispatch_t* dispatch, const can_message_t*
+    message) {
+  can_dispatch_entry_t* entry;
+  can_dispatch_queue_t* queue;
+  size_t tail;
+
+  if ((message->id < 0) || (message->id > CAN_ID_MAX)) {
+    ++dispatch->num_unhandled;
+    return 0;
+  }
+  entry = &dispatch->entries[message->id];
+
+  if (entry->handler) {
+    entry->handler(dispatch, message, entry->user_data);
+    return 1;
+  }
+  else if ((queue = entry->queue)) {
+    tail = queue->tail;
+    if (tail-__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) >=
+        CAN_DISPATCH_QUEUE_SIZE) {
+      ++queue->num_dropped;
+      return 0;
+    }
+
+    /* The event is counted before the message is published, such that
+     * the consumer never takes a message it has not been woken for. */
+    queue->messages[tail & (CAN_DISPATCH_QUEUE_SIZE-1)] = *message;
+    if (queue->event_fd >= 0)
+      eventfd_write(queue->event_fd, 1);
+    __atomic_store_n(&queue->tail, tail+1, __ATOMIC_RELEASE);
+
+    return 1;
+  }
+
+  ++dispatch->num_unhandled;
+  return 0;
+}
+
+int can_dispatch_progress(can_dispatch_t* dispatch) {
+  can_message_t messages[CAN_DISPATCH_BATCH_SIZE];
+  int i, result;
+
+  error_clear(&dispatch->error);
+
+  if (dispatch->dev->backend->lock_step) {
+    error_setf(&dispatch->error, CAN_DISPATCH_ERROR_BACKEND,
+      "%s device is lock-step", dispatch->dev->backend->device_name);
+    return -dispatch->error.code;
+  }
+
+  if ((result = can_device_receive_messages(dispatch->dev, messages,
+      CAN_DISPATCH_BATCH_SIZE)) < 0) {
+    error_blame(&dispatch->error, &dispatch->dev->receive_error,
+      CAN_DISPATCH_ERROR_RECEIVE);
+    return -dispatch->error.code;
+  }
+
+  for (i = 0; i < result; ++i)
+    can_dispatch_message(dispatch, &messages[i]);
+
+  return result;
+}
@@ -0,0 +1,259 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef CAN_DISPATCH_H
+#define CAN_DISPATCH_H
+
+/** \file can_dispatch.h
+  * \brief CAN message dispatching by identifier
+  * 
+  * A dispatcher receives messages from a CAN device and routes each of
+  * them to the consumer registered for its message identifier. All
+  * standard identifiers are indexed by a flat table, such that a message
+  * reaches its consumer without any search. Consumers are either handlers
+  * invoked with the received message in place, or queues from which the
+  * messages are taken later on. A queue may collect the messages of
+  * several identifiers, e.g., the SDO responses, emergency messages, and
+  * heartbeats of a node. Consumer threads may wait for queued messages
+  * by polling the event descriptor of their queue instead of the queue
+  * itself.
+  * 
+  * Since responses of lock-step back-ends are derived from requests, only
+  * back-ends attached to a CAN bus may be used for dispatching.
+  */
+
+#include "can.h"
+
+/** \name Error Codes
+  * \brief Predefined CAN dispatcher error codes
+  */
+//@{
+#define CAN_DISPATCH_ERROR_NONE                   0
+//!< Success
+#define CAN_DISPATCH_ERROR_ID                     1
+//!< Invalid CAN message identifier
+#define CAN_DISPATCH_ERROR_BACKEND                2
+//!< CAN back-end does not support dispatching
+#define CAN_DISPATCH_ERROR_RECEIVE                3
+//!< Failed to receive CAN messages
+#define CAN_DISPATCH_ERROR_FILTER                 4
+//!< Failed to set CAN message filters
+//@}
+
+/** \brief Number of messages held by a CAN dispatcher queue
+  * \note The size must be a power of two.
+  */
+#define CAN_DISPATCH_QUEUE_SIZE                   16
+
+/** \brief Number of messages received by the dispatcher at once
+  */
+#define CAN_DISPATCH_BATCH_SIZE                   32
+
+/** \brief Predefined CAN dispatcher error descriptions
+  */
+extern const char* can_dispatch_errors[];
+
+/** \brief Forward declaration of the CAN dispatcher
+  */
+typedef struct can_dispatch_t can_dispatch_t;
+
+/** \brief Handler of messages routed by a CAN dispatcher
+  * \param[in] dispatch The dispatcher which received the message.
+  * \param[in] message The message received, which is only valid during
+  *   the call.
+  * \param[in] user_data The user data passed on registration.
+  */
+typedef void (*can_dispatch_handler_t)(
+  can_dispatch_t* dispatch,
+  const can_message_t* message,
+  void* user_data);
+
+/** \brief Structure defining a CAN dispatcher queue
+  * 
+  * The queue is filled by the dispatcher and may be drained by another
+  * thread without locking, with a single producer and a single consumer.
+  * Messages arriving at a full queue are dropped. Once opened, the event
+  * descriptor counts the queued messages.
+  */
+typedef struct can_dispatch_queue_t {
+  can_message_t messages[CAN_DISPATCH_QUEUE_SIZE];
+  //!< Ring of the queued messages.
+  size_t head;                    //!< Ring position of the oldest message.
+  size_t tail;                    //!< Ring position past the last message.
+  size_t num_dropped;             //!< Number of messages dropped.
+  int event_fd;                   //!< The event descriptor, or negative.
+} can_dispatch_queue_t;
+
+/** \brief Structure defining the consumer of a CAN message identifier
+  */
+typedef struct can_dispatch_entry_t {
+  can_dispatch_handler_t handler; //!< The message handler, or null.
+  void* user_data;                //!< The user data passed to the handler.
+  can_dispatch_queue_t* queue;    //!< The message queue, or null.
+} can_dispatch_entry_t;
+
+/** \brief Structure defining a CAN dispatcher
+  */
+struct can_dispatch_t {
+  can_device_t* dev;              //!< The open CAN device used.
+
+  can_dispatch_entry_t entries[CAN_ID_MAX+1];
+  //!< Consumers indexed by message identifier.
+  size_t num_unhandled;           //!< Number of messages without consumer.
+
+  error_t error;                  //!< The most recent dispatcher error.
+};
+
+/** \brief Initialize a CAN dispatcher queue
+  * \param[in] queue The dispatcher queue to be initialized.
+  */
+void can_dispatch_queue_init(
+  can_dispatch_queue_t* queue);
+
+/** \brief Destroy a CAN dispatcher queue
+  * \param[in] queue The dispatcher queue to be destroyed.
+  * 
+  * The event descriptor of the queue is closed if open.
+  */
+void can_dispatch_queue_destroy(
+  can_dispatch_queue_t* queue);
+
+/** \brief Open the event descriptor of a CAN dispatcher queue
+  * \param[in] queue The dispatcher queue to open the descriptor for.
+  * \return The event descriptor or -1 on failure, with errno set.
+  * 
+  * The descriptor is an eventfd semaphore which counts the messages in
+  * the queue. It becomes readable as soon as a message is queued, such
+  * that a consumer thread may wait for messages by means of poll() or
+  * select(). It is only maintained once opened, and must be opened before
+  * the queue is registered with a dispatcher in progress.
+  */
+int can_dispatch_queue_open_event(
+  can_dispatch_queue_t* queue);
+
+/** \brief Take the oldest message from a CAN dispatcher queue
+  * \param[in] queue The dispatcher queue to take the message from.
+  * \param[out] message The message taken from the queue.
+  * \return One if a message has been taken, zero if the queue is empty.
+  */
+int can_dispatch_queue_get(
+  can_dispatch_queue_t* queue,
+  can_message_t* message);
+
+/** \brief Retrieve the number of messages in a CAN dispatcher queue
+  * \param[in] queue The dispatcher queue to be queried.
+  * \return The number of messages which may be taken from the queue.
+  */
+size_t can_dispatch_queue_get_num_messages(
+  const can_dispatch_queue_t* queue);
+
+/** \brief Initialize a CAN dispatcher
+  * \param[in] dispatch The dispatcher to be initialized.
+  * \param[in] dev The open CAN device to receive the messages from.
+  * 
+  * Initially, no consumers are registered.
+  */
+void can_dispatch_init(
+  can_dispatch_t* dispatch,
+  can_device_t* dev);
+
+/** \brief Destroy a CAN dispatcher
+  * \param[in] dispatch The dispatcher to be destroyed.
+  */
+void can_dispatch_destroy(
+  can_dispatch_t* dispatch);
+
+/** \brief Register a handler for a CAN message identifier
+  * \param[in] dispatch The dispatcher to register the handler with.
+  * \param[in] id The message identifier to be handled.
+  * \param[in] handler The handler to be invoked for each message with
+  *   this identifier, or null to unregister any consumer.
+  * \param[in] user_data Arbitrary user data passed to the handler.
+  * \return The resulting error code.
+  * 
+  * The handler replaces any consumer registered for the identifier.
+  */
+int can_dispatch_set_handler(
+  can_dispatch_t* dispatch,
+  int id,
+  can_dispatch_handler_t handler,
+  void* user_data);
+
+/** \brief Register a queue for a CAN message identifier
+  * \param[in] dispatch The dispatcher to register the queue with.
+  * \param[in] id The message identifier to be queued.
+  * \param[in] queue The initialized queue to receive each message with
+  *   this identifier, or null to unregister any consumer.
+  * \return The resulting error code.
+  * 
+  * The queue replaces any consumer registered for the identifier.
+  */
+int can_dispatch_set_queue(
+  can_dispatch_t* dispatch,
+  int id,
+  can_dispatch_queue_t* queue);
+
+/** \brief Register a queue for the messages of a CANopen node
+  * \param[in] dispatch The dispatcher to register the queue with.
+  * \param[in] node_id The identifier of the node.
+  * \param[in] queue The initialized queue to receive the SDO responses,
+  *   emergency messages, and heartbeats of the node, or null to unregister
+  *   any consumers.
+  * \return The resulting error code.
+  */
+int can_dispatch_set_node_queue(
+  can_dispatch_t* dispatch,
+  int node_id,
+  can_dispatch_queue_t* queue);
+
+/** \brief Restrict the messages received to the registered identifiers
+  * \param[in] dispatch The dispatcher to restrict the messages for.
+  * \return The resulting error code.
+  * 
+  * The identifiers of all registered consumers are set as the identifier
+  * filters of the CAN device, such that back-ends supporting filters do
+  * not deliver messages without consumer. Messages discarded by the
+  * hardware thus cause no wakeup of the dispatcher.
+  */
+int can_dispatch_set_filters(
+  can_dispatch_t* dispatch);
+
+/** \brief Route a CAN message to its consumer
+  * \param[in] dispatch The dispatcher to route the message with.
+  * \param[in] message The message to be routed.
+  * \return One if the message has been handled or queued, zero if no
+  *   consumer is registered or its queue is full.
+  */
+int can_dispatch_message(
+  can_dispatch_t* dispatch,
+  const can_message_t* message);
+
+/** \brief Receive CAN messages and route them to their consumers
+  * \param[in] dispatch The dispatcher to receive the messages with.
+  * \return The number of messages received or the negative error code.
+  * 
+  * The function blocks until the back-end receives messages or times
+  * out, and routes each message received to its consumer. Up to
+  * CAN_DISPATCH_BATCH_SIZE messages are received at once.
+  */
+int can_dispatch_progress(
+  can_dispatch_t* dispatch);
+
+#endif
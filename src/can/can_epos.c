@@ -0,0 +1,66 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "can_epos.h"
+
+int can_epos_reply(const unsigned char* data, can_message_t* message) {
+  if ((data[2] == 0) && (data[3] == 0) && (data[4] == 0) && (data[5] == 0)) {
+    switch (message->content[0]) {
+      case CAN_CMD_SDO_WRITE_SEND_1_BYTE:
+        message->content[0] = CAN_CMD_SDO_WRITE_RECEIVE;
+        break;
+      case CAN_CMD_SDO_WRITE_SEND_2_BYTE:
+        message->content[0] = CAN_CMD_SDO_WRITE_RECEIVE;
+        break;
+      case CAN_CMD_SDO_WRITE_SEND_4_BYTE:
+        message->content[0] = CAN_CMD_SDO_WRITE_RECEIVE;
+        break;
+      case CAN_CMD_SDO_READ_SEND:
+        message->content[0] = CAN_CMD_SDO_READ_RECEIVE_UNDEFINED;
+        break;
+      default:
+        return -1;
+    }
+
+    message->content[1] = message->content[2];
+    message->content[2] = message->content[3];
+    message->content[3] = message->content[4];
+    message->content[7] = data[6];
+    message->content[6] = data[7];
+    message->content[5] = data[8];
+    message->content[4] = data[9];
+  }
+  else {
+    message->id -= CAN_COB_ID_SDO_SEND;
+    message->id += CAN_COB_ID_SDO_RECEIVE;
+
+    message->content[0] = CAN_CMD_SDO_ABORT;
+    message->content[1] = message->content[2];
+    message->content[2] = message->content[3];
+    message->content[3] = message->content[4];
+    message->content[7] = data[2];
+    message->content[6] = data[3];
+    message->content[5] = data[4];
+    message->content[4] = data[5];
+  }
+  message->length = 8;
+
+  return 0;
+}
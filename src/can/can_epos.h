@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef CAN_EPOS_H
+#define CAN_EPOS_H
+
+/** \file can_epos.h
+  * \brief EPOS response conversion
+  * 
+  * Common conversion of EPOS responses into CANopen SDO messages. This
+  * mapping is shared by all CAN communication back-ends which talk to EPOS
+  * controllers through a gateway protocol rather than a CAN bus.
+  */
+
+#include "can.h"
+
+/** \brief Convert an EPOS response into a CANopen SDO message
+  * \param[in] data The EPOS response data frame in host byte and word
+  *   order, i.e., with the 32-bit error code in bytes 2 to 5 and the
+  *   32-bit object value in bytes 6 to 9, most significant byte first.
+  * \param[in,out] message The sent CANopen SDO message that will be
+  *   transformed into the CANopen SDO message received.
+  * \return Zero on success or a negative value if the sent message does
+  *   not contain a valid SDO command.
+  * 
+  * If the response carries an error code, the message will be converted
+  * into an SDO abort message.
+  */
+int can_epos_reply(
+  const unsigned char* data,
+  can_message_t* message);
+
+#endif
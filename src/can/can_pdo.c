@@ -0,0 +1,241 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "can_pdo.h"
+
+#define CAN_PDO_OP_BITS                           0
+#define CAN_PDO_OP_UINT8                          1
+#define CAN_PDO_OP_UINT16                         2
+#define CAN_PDO_OP_UINT32                         3
+
+const char* can_pdo_errors[] = {
+  "Success",
+  "Invalid CAN PDO mapping",
+  "CAN message does not match the PDO",
+};
+
+void can_pdo_write(can_message_t* request, int node_id, int index, int
+  subindex, unsigned int value, size_t size);
+
+void can_pdo_init(can_pdo_t* pdo, int node_id, int number, int type) {
+  pdo->node_id = node_id;
+  pdo->number = number;
+  pdo->type = type;
+  pdo->cob_id = ((type == CAN_PDO_TRANSMIT) ? CAN_COB_ID_PDO_TRANSMIT_1 :
+    CAN_COB_ID_PDO_RECEIVE_1)+(number-1)*0x0100+node_id;
+
+  pdo->num_entries = 0;
+  pdo->length = 0;
+
+  error_init(&pdo->error, can_pdo_errors);
+}
+
+void can_pdo_destroy(can_pdo_t* pdo) {
+  error_destroy(&pdo->error);
+}
+
+int can_pdo_set_mapping(can_pdo_t* pdo, const can_pdo_entry_t* entries,
+    size_t num) {
+  can_pdo_op_t ops[CAN_PDO_MAX_ENTRIES];
+  can_pdo_op_t* op;
+  size_t i, bit_offset = 0;
+
+  error_clear(&pdo->error);
+
+  if (num > CAN_PDO_MAX_ENTRIES) {
+    error_setf(&pdo->error, CAN_PDO_ERROR_MAPPING,
+      "More than %d entries", CAN_PDO_MAX_ENTRIES);
+    return pdo->error.code;
+  }
+
+  for (i = 0; i < num; ++i) {
+    if (!entries[i].bit_length || (entries[i].bit_length > 32)) {
+      error_setf(&pdo->error, CAN_PDO_ERROR_MAPPING,
+        "Invalid bit length of object 0x%04x:%d: %d", entries[i].index,
+        entries[i].subindex, (int)entries[i].bit_length);
+      return pdo->error.code;
+    }
+    if (bit_offset+entries[i].bit_length > 64) {
+      error_setf(&pdo->error, CAN_PDO_ERROR_MAPPING,
+        "Mapping exceeds 64 bits");
+      return pdo->error.code;
+    }
+
+    op = &ops[i];
+    op->bit_offset = bit_offset;
+    op->bit_length = entries[i].bit_length;
+    op->mask = (op->bit_length < 32) ? (1U << op->bit_length)-1 : ~0U;
+    op->offset = entries[i].offset;
+    op->size = (op->bit_length > 16) ? 4 : ((op->bit_length > 8) ? 2 : 1);
+    op->sign = entries[i].sign;
+
+    if (!(op->bit_offset % 8) && (op->bit_length == 8*op->size))
+      op->type = (op->size == 4) ? CAN_PDO_OP_UINT32 :
+        ((op->size == 2) ? CAN_PDO_OP_UINT16 : CAN_PDO_OP_UINT8);
+    else
+      op->type = CAN_PDO_OP_BITS;
+
+    bit_offset += entries[i].bit_length;
+  }
+
+  /* The mapping is only replaced once all entries have been compiled,
+   * such that an invalid entry leaves the previous mapping intact. */
+  memcpy(pdo->entries, entries, num*sizeof(can_pdo_entry_t));
+  memcpy(pdo->ops, ops, num*sizeof(can_pdo_op_t));
+  pdo->num_entries = num;
+  pdo->length = (bit_offset+7)/8;
+
+  return pdo->error.code;
+}
+
+size_t can_pdo_configure(const can_pdo_t* pdo, int transmission_type,
+    can_message_t* requests) {
+  int communication = ((pdo->type == CAN_PDO_TRANSMIT) ?
+    CAN_PDO_INDEX_TRANSMIT_COMMUNICATION :
+    CAN_PDO_INDEX_RECEIVE_COMMUNICATION)+pdo->number-1;
+  int mapping = ((pdo->type == CAN_PDO_TRANSMIT) ?
+    CAN_PDO_INDEX_TRANSMIT_MAPPING :
+    CAN_PDO_INDEX_RECEIVE_MAPPING)+pdo->number-1;
+  const can_pdo_entry_t* entry;
+  size_t i, num = 0;
+
+  can_pdo_write(&requests[num++], pdo->node_id, communication,
+    CAN_PDO_SUBINDEX_COB_ID, pdo->cob_id | CAN_PDO_COB_ID_INVALID, 4);
+  can_pdo_write(&requests[num++], pdo->node_id, communication,
+    CAN_PDO_SUBINDEX_TRANSMISSION_TYPE, transmission_type, 1);
+  can_pdo_write(&requests[num++], pdo->node_id, mapping, 0, 0, 1);
+
+  for (i = 0; i < pdo->num_entries; ++i) {
+    entry = &pdo->entries[i];
+    can_pdo_write(&requests[num++], pdo->node_id, mapping, i+1,
+      (entry->index << 16) | (entry->subindex << 8) | entry->bit_length, 4);
+  }
+
+  can_pdo_write(&requests[num++], pdo->node_id, mapping, 0,
+    pdo->num_entries, 1);
+  can_pdo_write(&requests[num++], pdo->node_id, communication,
+    CAN_PDO_SUBINDEX_COB_ID, pdo->cob_id, 4);
+
+  return num;
+}
+
+int can_pdo_unpack(can_pdo_t* pdo, const can_message_t* message, void*
+    data) {
+  const unsigned char* content = message->content;
+  const can_pdo_op_t* op;
+  uint64_t bits = 0;
+  uint32_t value;
+  size_t i, j;
+
+  error_clear(&pdo->error);
+
+  if ((message->id != pdo->cob_id) || (message->length < pdo->length)) {
+    error_setf(&pdo->error, CAN_PDO_ERROR_MESSAGE,
+      "Message identifier 0x%03x, length %d", message->id,
+      (int)message->length);
+    return pdo->error.code;
+  }
+
+  for (i = 0; i < pdo->num_entries; ++i) {
+    op = &pdo->ops[i];
+
+    switch (op->type) {
+      case CAN_PDO_OP_UINT8:
+        *(uint8_t*)((char*)data+op->offset) = content[op->bit_offset/8];
+        continue;
+      case CAN_PDO_OP_UINT16:
+        *(uint16_t*)((char*)data+op->offset) = content[op->bit_offset/8] |
+          (content[op->bit_offset/8+1] << 8);
+        continue;
+      case CAN_PDO_OP_UINT32:
+        *(uint32_t*)((char*)data+op->offset) = content[op->bit_offset/8] |
+          (content[op->bit_offset/8+1] << 8) |
+          (content[op->bit_offset/8+2] << 16) |
+          ((uint32_t)content[op->bit_offset/8+3] << 24);
+        continue;
+    }
+
+    if (!bits)
+      for (j = 0; j < pdo->length; ++j)
+        bits |= (uint64_t)content[j] << (8*j);
+    
+    value = (bits >> op->bit_offset) & op->mask;
+    if (op->sign && (value & (1U << (op->bit_length-1))))
+      value |= ~op->mask;
+
+    if (op->size == 4)
+      *(uint32_t*)((char*)data+op->offset) = value;
+    else if (op->size == 2)
+      *(uint16_t*)((char*)data+op->offset) = value;
+    else
+      *(uint8_t*)((char*)data+op->offset) = value;
+  }
+
+  return pdo->error.code;
+}
+
+void can_pdo_pack(const can_pdo_t* pdo, const void* data, can_message_t*
+    message) {
+  unsigned char* content = message->content;
+  const can_pdo_op_t* op;
+  uint64_t bits = 0;
+  uint32_t value;
+  size_t i;
+
+  for (i = 0; i < pdo->num_entries; ++i) {
+    op = &pdo->ops[i];
+
+    if (op->size == 4)
+      value = *(const uint32_t*)((const char*)data+op->offset);
+    else if (op->size == 2)
+      value = *(const uint16_t*)((const char*)data+op->offset);
+    else
+      value = *(const uint8_t*)((const char*)data+op->offset);
+
+    bits |= (uint64_t)(value & op->mask) << op->bit_offset;
+  }
+
+  for (i = 0; i < pdo->length; ++i)
+    content[i] = bits >> (8*i);
+  
+  message->id = pdo->cob_id;
+  message->length = pdo->length;
+  message->timestamp = 0.0;
+}
+
+void can_pdo_write(can_message_t* request, int node_id, int index, int
+    subindex, unsigned int value, size_t size) {
+  request->id = CAN_COB_ID_SDO_SEND+node_id;
+  request->content[0] = (size == 4) ? CAN_CMD_SDO_WRITE_SEND_4_BYTE :
+    ((size == 2) ? CAN_CMD_SDO_WRITE_SEND_2_BYTE :
+    CAN_CMD_SDO_WRITE_SEND_1_BYTE);
+  request->content[1] = index;
+  request->content[2] = index >> 8;
+  request->content[3] = subindex;
+  request->content[4] = value;
+  request->content[5] = value >> 8;
+  request->content[6] = value >> 16;
+  request->content[7] = value >> 24;
+  request->length = 8;
+  request->timestamp = 0.0;
+}
@@ -0,0 +1,233 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef CAN_PDO_H
+#define CAN_PDO_H
+
+/** \file can_pdo.h
+  * \brief CANopen process data objects
+  * 
+  * Configuration, packing, and unpacking of CANopen PDOs. The mapping of
+  * a PDO, i.e., the objects it carries, is compiled once into a list of
+  * operations which transfer each mapped value between the PDO and a
+  * member of a user structure. Values aligned to bytes are transferred by
+  * dedicated operations, such that packing and unpacking a PDO takes no
+  * per-bit work for common mappings.
+  * 
+  * The configuration of a PDO is written to the object dictionary of its
+  * node by a sequence of SDO requests. Transmit PDOs of a node may then be
+  * received through a dispatcher handler registered for their
+  * communication object identifier, which unpacks them into the user
+  * structure.
+  */
+
+#include "can.h"
+
+/** \name Error Codes
+  * \brief Predefined CAN PDO error codes
+  */
+//@{
+#define CAN_PDO_ERROR_NONE                        0
+//!< Success
+#define CAN_PDO_ERROR_MAPPING                     1
+//!< Invalid CAN PDO mapping
+#define CAN_PDO_ERROR_MESSAGE                     2
+//!< CAN message does not match the PDO
+//@}
+
+/** \name Types
+  * \brief Predefined CAN PDO types as seen from the node
+  */
+//@{
+#define CAN_PDO_TRANSMIT                          0
+//!< PDO transmitted by the node
+#define CAN_PDO_RECEIVE                           1
+//!< PDO received by the node
+//@}
+
+/** \name Object Indices
+  * \brief Predefined PDO object indices as specified by CANopen
+  */
+//@{
+#define CAN_PDO_INDEX_RECEIVE_COMMUNICATION       0x1400
+#define CAN_PDO_INDEX_RECEIVE_MAPPING             0x1600
+#define CAN_PDO_INDEX_TRANSMIT_COMMUNICATION      0x1800
+#define CAN_PDO_INDEX_TRANSMIT_MAPPING            0x1A00
+//@}
+
+/** \name Object Subindices
+  * \brief Predefined PDO communication object subindices
+  */
+//@{
+#define CAN_PDO_SUBINDEX_COB_ID                   0x01
+#define CAN_PDO_SUBINDEX_TRANSMISSION_TYPE        0x02
+//@}
+
+/** \name Transmission Types
+  * \brief Predefined PDO transmission types as specified by CANopen
+  */
+//@{
+#define CAN_PDO_TRANSMISSION_SYNC                 0x01
+#define CAN_PDO_TRANSMISSION_ASYNC                0xFF
+//@}
+
+/** \brief Flag marking an invalid PDO communication object identifier
+  */
+#define CAN_PDO_COB_ID_INVALID                    0x80000000
+
+/** \brief Number of PDOs of each type per node
+  */
+#define CAN_PDO_NUM_PDOS                          4
+
+/** \brief Maximum number of entries of a PDO mapping
+  */
+#define CAN_PDO_MAX_ENTRIES                       8
+
+/** \brief Maximum number of SDO requests configuring a PDO
+  */
+#define CAN_PDO_MAX_REQUESTS                      (CAN_PDO_MAX_ENTRIES+5)
+
+/** \brief Predefined CAN PDO error descriptions
+  */
+extern const char* can_pdo_errors[];
+
+/** \brief Structure defining a CAN PDO mapping entry
+  * 
+  * The entry maps an object of up to 32 bits to a member of a user
+  * structure. The member is an 8-bit, 16-bit, or 32-bit integer, whichever
+  * is the smallest to hold the object.
+  */
+typedef struct can_pdo_entry_t {
+  int index;                  //!< The index of the mapped object.
+  int subindex;               //!< The subindex of the mapped object.
+  size_t bit_length;          //!< The length of the mapped object in bits.
+
+  size_t offset;              //!< The offset of the structure member.
+  int sign;                   //!< Flag indicating a signed object.
+} can_pdo_entry_t;
+
+/** \brief Structure defining a compiled CAN PDO mapping operation
+  */
+typedef struct can_pdo_op_t {
+  int type;                   //!< The type of the operation.
+
+  size_t bit_offset;          //!< The offset of the value in the PDO.
+  size_t bit_length;          //!< The length of the value in bits.
+  unsigned int mask;          //!< The mask of the value bits.
+
+  size_t offset;              //!< The offset of the structure member.
+  size_t size;                //!< The size of the structure member.
+  int sign;                   //!< Flag indicating a signed value.
+} can_pdo_op_t;
+
+/** \brief Structure defining a CAN PDO
+  */
+typedef struct can_pdo_t {
+  int node_id;                //!< The identifier of the node.
+  int number;                 //!< The number of the PDO, starting at one.
+  int type;                   //!< The type of the PDO.
+  int cob_id;                 //!< The communication object identifier.
+
+  can_pdo_entry_t entries[CAN_PDO_MAX_ENTRIES];
+  //!< The entries of the PDO mapping.
+  size_t num_entries;         //!< The number of mapping entries.
+  can_pdo_op_t ops[CAN_PDO_MAX_ENTRIES];
+  //!< The operations compiled from the mapping.
+  size_t length;              //!< The length of the PDO in bytes.
+
+  error_t error;              //!< The most recent PDO error.
+} can_pdo_t;
+
+/** \brief Initialize a CAN PDO
+  * \param[in] pdo The PDO to be initialized.
+  * \param[in] node_id The identifier of the node.
+  * \param[in] number The number of the PDO, from one to CAN_PDO_NUM_PDOS.
+  * \param[in] type The type of the PDO as seen from the node.
+  * 
+  * The PDO uses the default communication object identifier of its node,
+  * number, and type. Its mapping is initially empty.
+  */
+void can_pdo_init(
+  can_pdo_t* pdo,
+  int node_id,
+  int number,
+  int type);
+
+/** \brief Destroy a CAN PDO
+  * \param[in] pdo The PDO to be destroyed.
+  */
+void can_pdo_destroy(
+  can_pdo_t* pdo);
+
+/** \brief Set and compile the mapping of a CAN PDO
+  * \param[in] pdo The PDO to set the mapping for.
+  * \param[in] entries The mapping entries in the order of their values in
+  *   the PDO.
+  * \param[in] num The number of mapping entries.
+  * \return The resulting error code.
+  * 
+  * The values of all entries must fit into the eight bytes of a CAN
+  * message. Values which start at a byte boundary and have a length of 8,
+  * 16, or 32 bits are compiled into operations copying whole bytes. If
+  * any entry is invalid, the previous mapping of the PDO remains set.
+  */
+int can_pdo_set_mapping(
+  can_pdo_t* pdo,
+  const can_pdo_entry_t* entries,
+  size_t num);
+
+/** \brief Build the SDO requests configuring a CAN PDO on its node
+  * \param[in] pdo The PDO to be configured.
+  * \param[in] transmission_type The transmission type of the PDO.
+  * \param[out] requests An array of at least CAN_PDO_MAX_REQUESTS SDO
+  *   requests to be built.
+  * \return The number of SDO requests built.
+  * 
+  * The requests invalidate the PDO, set its transmission type, write its
+  * mapping, and validate it again. They must be sent to the node in order,
+  * e.g., by can_device_send_message() and can_device_receive_message().
+  */
+size_t can_pdo_configure(
+  const can_pdo_t* pdo,
+  int transmission_type,
+  can_message_t* requests);
+
+/** \brief Unpack a received CAN PDO into a user structure
+  * \param[in] pdo The PDO to be unpacked.
+  * \param[in] message The CAN message carrying the PDO.
+  * \param[out] data The user structure receiving the mapped values.
+  * \return The resulting error code.
+  */
+int can_pdo_unpack(
+  can_pdo_t* pdo,
+  const can_message_t* message,
+  void* data);
+
+/** \brief Pack a user structure into a CAN PDO to be sent
+  * \param[in] pdo The PDO to be packed.
+  * \param[in] data The user structure providing the mapped values.
+  * \param[out] message The CAN message carrying the PDO.
+  */
+void can_pdo_pack(
+  const can_pdo_t* pdo,
+  const void* data,
+  can_message_t* message);
+
+#endif
@@ -19,17 +19,20 @@
  ***************************************************************************/
 
 #define _ISOC99_SOURCE
+#define _POSIX_C_SOURCE 200112L
 
 #include <sys/types.h>
 #include <sys/dir.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <ctype.h>
 #include <sys/file.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <termios.h>
+#include <time.h>
 #include <math.h>
 
 #include <libcpc/cpc.h>
@@ -49,10 +52,9 @@ const char* can_cpc_errors[] = {
   "CAN-CPC device timeout",
   "Failed to send to CAN-CPC device",
   "Failed to receive from CAN-CPC device",
+  "CAN-CPC transmit queue full",
 };
 
-const char* can_device_name = "CAN-CPC";
-
 config_param_t can_cpc_default_parameters[] = {
   {CAN_CPC_PARAMETER_DEVICE,
     config_param_type_string,
@@ -81,34 +83,89 @@ config_param_t can_cpc_default_parameters[] = {
     "0.01",
     "",
     "The CAN bus communication timeout in [s]"},
+  {CAN_CPC_PARAMETER_QUEUE_SIZE,
+    config_param_type_int,
+    "16",
+    "[1, 4096]",
+    "The number of messages held by the CAN-CPC software transmit queue"},
+  {CAN_CPC_PARAMETER_QUEUE_TIMEOUT,
+    config_param_type_float,
+    "0.01",
+    "",
+    "The time in [s] a sender blocks on a full transmit queue, zero "
+    "returns immediately"},
 };
 
-const config_default_t can_default_config = {
+const config_default_t can_cpc_default_config = {
   can_cpc_default_parameters,
   sizeof(can_cpc_default_parameters)/sizeof(config_param_t),
 };
 
+int can_cpc_open(can_device_t* dev);
+int can_cpc_close(can_device_t* dev);
+int can_cpc_send_message(can_device_t* dev, const can_message_t* message);
+int can_cpc_receive_message(can_device_t* dev, can_message_t* message);
+int can_cpc_set_filters(can_device_t* dev);
+int can_cpc_send_messages(can_device_t* dev, const can_message_t* messages,
+  size_t num);
+int can_cpc_receive_messages(can_device_t* dev, can_message_t* messages,
+  size_t num);
+int can_cpc_get_fd(can_device_t* dev);
+int can_cpc_try_send_message(can_device_t* dev, const can_message_t*
+  message);
+int can_cpc_try_receive_message(can_device_t* dev, can_message_t* message);
+
+const can_backend_t can_backend = {
+  "cpc",
+  "CAN-CPC",
+  &can_cpc_default_config,
+  can_cpc_open,
+  can_cpc_close,
+  can_cpc_send_message,
+  can_cpc_receive_message,
+  can_cpc_set_filters,
+  can_cpc_send_messages,
+  can_cpc_receive_messages,
+  0,
+  can_cpc_get_fd,
+  can_cpc_try_send_message,
+  can_cpc_try_receive_message,
+  1,
+};
+
 void can_cpc_device_init(can_cpc_device_t* dev);
 void can_cpc_device_destroy(can_cpc_device_t* dev);
 void can_cpc_device_handle(int handle, const CPC_MSG_T* msg, void* custom);
-
-int can_device_open(can_device_t* dev) {
+int can_cpc_device_enqueue(can_cpc_device_t* dev, const can_message_t*
+  messages, size_t num, double timeout);
+int can_cpc_device_dequeue(can_cpc_device_t* dev, can_message_t* messages,
+  size_t num, double timeout);
+int can_cpc_device_drain(can_cpc_device_t* dev, error_t* error);
+int can_cpc_device_try_drain(can_cpc_device_t* dev);
+int can_cpc_device_wait(can_cpc_device_t* dev, const struct timespec* start,
+  double timeout, error_t* error);
+void can_cpc_device_merge_filters(const can_filter_t* filters, size_t num,
+  size_t group, int* code, int* mask);
+
+int can_cpc_open(can_device_t* dev) {
   error_clear(&dev->error);
   
   if (!dev->num_references) {
     dev->comm_dev = malloc(sizeof(can_cpc_device_t));
     can_cpc_device_init(dev->comm_dev);
-
-    dev->num_sent = 0;
-    dev->num_received = 0;
+    ((can_cpc_device_t*)dev->comm_dev)->timestamps = dev->timestamps;
     
     if (can_cpc_device_open(dev->comm_dev,
         config_get_string(&dev->config, CAN_CPC_PARAMETER_DEVICE)) ||
+      can_cpc_device_set_filters(dev->comm_dev, dev->filters,
+        dev->num_filters) ||
       can_cpc_device_setup(dev->comm_dev,
         config_get_int(&dev->config, CAN_CPC_PARAMETER_BIT_RATE),
         config_get_int(&dev->config, CAN_CPC_PARAMETER_QUANTA_PER_BIT),
         config_get_float(&dev->config, CAN_CPC_PARAMETER_SAMPLING_POINT),
-        config_get_float(&dev->config, CAN_CPC_PARAMETER_TIMEOUT))) {
+        config_get_float(&dev->config, CAN_CPC_PARAMETER_TIMEOUT),
+        config_get_int(&dev->config, CAN_CPC_PARAMETER_QUEUE_SIZE),
+        config_get_float(&dev->config, CAN_CPC_PARAMETER_QUEUE_TIMEOUT))) {
       error_blame(&dev->error, &((can_cpc_device_t*)dev->comm_dev)->error,
         CAN_ERROR_OPEN);
       
@@ -125,7 +182,7 @@ int can_device_open(can_device_t* dev) {
   return dev->error.code;
 }
 
-int can_device_close(can_device_t* dev) {
+int can_cpc_close(can_device_t* dev) {
   error_clear(&dev->error);
   
   if (dev->num_references) {
@@ -149,38 +206,141 @@ int can_device_close(can_device_t* dev) {
   return dev->error.code;  
 }
 
-int can_device_send_message(can_device_t* dev, const can_message_t* message) {
-  error_clear(&dev->error);
+int can_cpc_send_message(can_device_t* dev, const can_message_t* message) {
+  error_clear(&dev->send_error);
   
   if (dev->comm_dev) {
     if (can_cpc_device_send(dev->comm_dev, message))
-      error_blame(&dev->error, &((can_cpc_device_t*)dev->comm_dev)->error,
-        CAN_ERROR_SEND);
-    else
-      ++dev->num_sent;
+      error_blame(&dev->send_error,
+        &((can_cpc_device_t*)dev->comm_dev)->send_error, CAN_ERROR_SEND);
   }
   else
-    error_setf(&dev->error, CAN_ERROR_SEND,
+    error_setf(&dev->send_error, CAN_ERROR_SEND,
       "Communication device unavailable");
   
-  return dev->error.code;
+  return dev->send_error.code;
 }
 
-int can_device_receive_message(can_device_t* dev, can_message_t* message) {
-  error_clear(&dev->error);
+int can_cpc_receive_message(can_device_t* dev, can_message_t* message) {
+  error_clear(&dev->receive_error);
 
   if (dev->comm_dev) {
     if (can_cpc_device_receive(dev->comm_dev, message))
+      error_blame(&dev->receive_error,
+        &((can_cpc_device_t*)dev->comm_dev)->receive_error,
+        CAN_ERROR_RECEIVE);
+  }
+  else
+    error_setf(&dev->receive_error, CAN_ERROR_RECEIVE,
+      "Communication device unavailable");
+
+  return dev->receive_error.code;  
+}
+
+int can_cpc_set_filters(can_device_t* dev) {
+  error_clear(&dev->error);
+
+  if (dev->comm_dev) {
+    if (can_cpc_device_set_filters(dev->comm_dev, dev->filters,
+        dev->num_filters))
       error_blame(&dev->error, &((can_cpc_device_t*)dev->comm_dev)->error,
+        CAN_ERROR_SETUP);
+  }
+  else
+    error_setf(&dev->error, CAN_ERROR_SETUP,
+      "Communication device unavailable");
+
+  return dev->error.code;
+}
+
+int can_cpc_send_messages(can_device_t* dev, const can_message_t* messages,
+    size_t num) {
+  int result = -CAN_ERROR_SEND;
+  
+  error_clear(&dev->send_error);
+  
+  if (dev->comm_dev) {
+    result = can_cpc_device_send_messages(dev->comm_dev, messages, num);
+    if (((can_cpc_device_t*)dev->comm_dev)->send_error.code)
+      error_blame(&dev->send_error,
+        &((can_cpc_device_t*)dev->comm_dev)->send_error, CAN_ERROR_SEND);
+  }
+  else
+    error_setf(&dev->send_error, CAN_ERROR_SEND,
+      "Communication device unavailable");
+  
+  return (result < 0) ? -dev->send_error.code : result;
+}
+
+int can_cpc_receive_messages(can_device_t* dev, can_message_t* messages,
+    size_t num) {
+  int result = -CAN_ERROR_RECEIVE;
+  
+  error_clear(&dev->receive_error);
+
+  if (dev->comm_dev) {
+    if ((result = can_cpc_device_receive_messages(dev->comm_dev, messages,
+        num)) < 0)
+      error_blame(&dev->receive_error,
+        &((can_cpc_device_t*)dev->comm_dev)->receive_error,
         CAN_ERROR_RECEIVE);
-    else
-      ++dev->num_received;
   }
   else
-    error_setf(&dev->error, CAN_ERROR_RECEIVE,
+    error_setf(&dev->receive_error, CAN_ERROR_RECEIVE,
       "Communication device unavailable");
 
-  return dev->error.code;  
+  return (result < 0) ? -dev->receive_error.code : result;
+}
+
+int can_cpc_get_fd(can_device_t* dev) {
+  error_clear(&dev->error);
+
+  if (!dev->comm_dev) {
+    error_setf(&dev->error, CAN_ERROR_SETUP,
+      "Communication device unavailable");
+    return -dev->error.code;
+  }
+
+  return ((can_cpc_device_t*)dev->comm_dev)->fd;
+}
+
+int can_cpc_try_send_message(can_device_t* dev, const can_message_t*
+    message) {
+  can_cpc_device_t* cpc_dev = dev->comm_dev;
+  
+  error_clear(&dev->send_error);
+  
+  if (cpc_dev) {
+    if (can_cpc_device_try_send(cpc_dev, message) == CAN_CPC_ERROR_QUEUE)
+      error_set(&dev->send_error, CAN_ERROR_WOULD_BLOCK);
+    else if (cpc_dev->send_error.code)
+      error_blame(&dev->send_error, &cpc_dev->send_error, CAN_ERROR_SEND);
+  }
+  else
+    error_setf(&dev->send_error, CAN_ERROR_SEND,
+      "Communication device unavailable");
+  
+  return dev->send_error.code;
+}
+
+int can_cpc_try_receive_message(can_device_t* dev, can_message_t* message) {
+  can_cpc_device_t* cpc_dev = dev->comm_dev;
+  
+  error_clear(&dev->receive_error);
+
+  if (cpc_dev) {
+    if (can_cpc_device_try_receive(cpc_dev, message) ==
+        CAN_CPC_ERROR_TIMEOUT)
+      error_set(&dev->receive_error, CAN_ERROR_WOULD_BLOCK);
+    else if (cpc_dev->receive_error.code)
+      error_blame(&dev->receive_error, &cpc_dev->receive_error,
+        CAN_ERROR_RECEIVE);
+  }
+  else
+    error_setf(&dev->receive_error, CAN_ERROR_RECEIVE,
+      "Communication device unavailable");
+
+  return dev->receive_error.code;
 }
 
 void can_cpc_device_init(can_cpc_device_t* dev) {
@@ -193,14 +353,38 @@ void can_cpc_device_init(can_cpc_device_t* dev) {
   dev->sampling_point = 0.0;
   dev->timeout = 0.0;
 
-  memset(&dev->msg_received, 0, sizeof(can_message_t));
+  memset(dev->acc_code, 0x00, sizeof(dev->acc_code));
+  memset(dev->acc_mask, 0xff, sizeof(dev->acc_mask));
+
+  dev->queue = 0;
+  dev->queue_size = 0;
+  dev->queue_head = 0;
+  dev->queue_tail = 0;
+  dev->queue_failed = 0;
+  dev->queue_first = (size_t)-1;
+  dev->queue_timeout = 0.0;
+  pthread_mutex_init(&dev->queue_mutex, 0);
+
+  dev->ring_head = 0;
+  dev->ring_tail = 0;
+  dev->num_overruns = 0;
+  dev->timestamps = 0;
   
   error_init(&dev->error, can_cpc_errors);
+  error_init(&dev->send_error, can_cpc_errors);
+  error_init(&dev->receive_error, can_cpc_errors);
 }
 
 void can_cpc_device_destroy(can_cpc_device_t* dev) {
+  free(dev->queue);
+  dev->queue = 0;
+  
+  pthread_mutex_destroy(&dev->queue_mutex);
+  
   string_destroy(&dev->name);
   error_destroy(&dev->error);
+  error_destroy(&dev->send_error);
+  error_destroy(&dev->receive_error);
 }
 
 int can_cpc_device_open(can_cpc_device_t* dev, const char* name) {
@@ -224,6 +408,7 @@ int can_cpc_device_open(can_cpc_device_t* dev, const char* name) {
 int can_cpc_device_close(can_cpc_device_t* dev) {
   int result;
   
+  can_cpc_device_flush(dev, dev->timeout);
   error_clear(&dev->error);
   
   if (!(result = CPC_CANExit(dev->handle, 0)) &&
@@ -238,7 +423,8 @@ int can_cpc_device_close(can_cpc_device_t* dev) {
 }
 
 int can_cpc_device_setup(can_cpc_device_t* dev, int bitrate, int
-  quanta_per_bit, double sampling_point, double timeout) {
+  quanta_per_bit, double sampling_point, double timeout, size_t queue_size,
+  double queue_timeout) {
   int result;
   CPC_INIT_PARAMS_T* parameters;
 
@@ -257,13 +443,14 @@ int can_cpc_device_setup(can_cpc_device_t* dev, int bitrate, int
     (CAN_CPC_TRIPLE_SAMPLING << 7)+((tseg2-1) << 4)+(tseg1-2);
   parameters->canparams.cc_params.sja1000.outp_contr = 0xda;
   
-  parameters->canparams.cc_params.sja1000.acc_code1 = 0xff;
-  parameters->canparams.cc_params.sja1000.acc_code2 = 0xff;
-  parameters->canparams.cc_params.sja1000.acc_code3 = 0xff;
-  parameters->canparams.cc_params.sja1000.acc_mask0 = 0xff;
-  parameters->canparams.cc_params.sja1000.acc_mask1 = 0xff;
-  parameters->canparams.cc_params.sja1000.acc_mask2 = 0xff;
-  parameters->canparams.cc_params.sja1000.acc_mask3 = 0xff;
+  parameters->canparams.cc_params.sja1000.acc_code0 = dev->acc_code[0];
+  parameters->canparams.cc_params.sja1000.acc_code1 = dev->acc_code[1];
+  parameters->canparams.cc_params.sja1000.acc_code2 = dev->acc_code[2];
+  parameters->canparams.cc_params.sja1000.acc_code3 = dev->acc_code[3];
+  parameters->canparams.cc_params.sja1000.acc_mask0 = dev->acc_mask[0];
+  parameters->canparams.cc_params.sja1000.acc_mask1 = dev->acc_mask[1];
+  parameters->canparams.cc_params.sja1000.acc_mask2 = dev->acc_mask[2];
+  parameters->canparams.cc_params.sja1000.acc_mask3 = dev->acc_mask[3];
   parameters->canparams.cc_params.sja1000.mode = 0;
   
   if (!(result = CPC_CANInit(dev->handle, 0))) {
@@ -274,6 +461,14 @@ int can_cpc_device_setup(can_cpc_device_t* dev, int bitrate, int
     dev->sampling_point = sampling_point;
     dev->timeout = timeout;
 
+    free(dev->queue);
+    dev->queue = malloc(queue_size*sizeof(CPC_CAN_MSG_T));
+    dev->queue_size = queue_size;
+    dev->queue_head = 0;
+    dev->queue_tail = 0;
+    dev->queue_failed = 0;
+    dev->queue_timeout = queue_timeout;
+
     if ((result = CPC_Control(dev->handle, CONTR_CAN_Message |
         CONTR_CONT_ON)))
     error_setf(&dev->error, CAN_CPC_ERROR_SETUP, CPC_DecodeErrorMsg(result));
@@ -284,71 +479,363 @@ int can_cpc_device_setup(can_cpc_device_t* dev, int bitrate, int
   return dev->error.code;
 }
 
-int can_cpc_device_send(can_cpc_device_t* dev, const can_message_t* message) {
-  CPC_CAN_MSG_T msg = {0x00L, 0, {0, 0, 0, 0, 0, 0, 0, 0}};
-  struct timeval time;
-  fd_set set;
+int can_cpc_device_set_filters(can_cpc_device_t* dev, const can_filter_t*
+    filters, size_t num) {
+  CPC_INIT_PARAMS_T* parameters;
+  int code[2] = {0, 0}, mask[2] = {0, 0};
+  int group_code[2], group_mask[2];
+  size_t group, all, num_ids, min_num_ids = 0;
   int result;
 
   error_clear(&dev->error);
 
-  msg.id = message->id;
-  msg.length = message->length;
-  memcpy(msg.msg, message->content, message->length);
+  if (num && (num <= CAN_CPC_FILTER_SEARCH_MAX)) {
+    all = ((size_t)1 << num)-1;
+    
+    for (group = 1; group <= all; group += 2) {
+      can_cpc_device_merge_filters(filters, num, group, &group_code[0],
+        &group_mask[0]);
+      num_ids = (size_t)1 << (11-__builtin_popcount(group_mask[0]));
+      
+      if (group != all) {
+        can_cpc_device_merge_filters(filters, num, all & ~group,
+          &group_code[1], &group_mask[1]);
+        num_ids += (size_t)1 << (11-__builtin_popcount(group_mask[1]));
+      }
+      else {
+        group_code[1] = group_code[0];
+        group_mask[1] = group_mask[0];
+      }
+      
+      if (!min_num_ids || (num_ids < min_num_ids)) {
+        min_num_ids = num_ids;
+        memcpy(code, group_code, sizeof(code));
+        memcpy(mask, group_mask, sizeof(mask));
+      }
+    }
+  }
+  else if (num) {
+    can_cpc_device_merge_filters(filters, num, ~(size_t)0, &code[0],
+      &mask[0]);
+    code[1] = code[0];
+    mask[1] = mask[0];
+  }
+
+  dev->acc_code[0] = code[0] >> 3;
+  dev->acc_code[1] = (code[0] & 0x07) << 5;
+  dev->acc_code[2] = code[1] >> 3;
+  dev->acc_code[3] = (code[1] & 0x07) << 5;
+  dev->acc_mask[0] = ~(mask[0] >> 3);
+  dev->acc_mask[1] = (~(mask[0] & 0x07) << 5) | 0x1f;
+  dev->acc_mask[2] = ~(mask[1] >> 3);
+  dev->acc_mask[3] = (~(mask[1] & 0x07) << 5) | 0x1f;
+
+  if (dev->fd) {
+    parameters = CPC_GetInitParamsPtr(dev->handle);
+    parameters->canparams.cc_params.sja1000.acc_code0 = dev->acc_code[0];
+    parameters->canparams.cc_params.sja1000.acc_code1 = dev->acc_code[1];
+    parameters->canparams.cc_params.sja1000.acc_code2 = dev->acc_code[2];
+    parameters->canparams.cc_params.sja1000.acc_code3 = dev->acc_code[3];
+    parameters->canparams.cc_params.sja1000.acc_mask0 = dev->acc_mask[0];
+    parameters->canparams.cc_params.sja1000.acc_mask1 = dev->acc_mask[1];
+    parameters->canparams.cc_params.sja1000.acc_mask2 = dev->acc_mask[2];
+    parameters->canparams.cc_params.sja1000.acc_mask3 = dev->acc_mask[3];
+    
+    if ((result = CPC_CANInit(dev->handle, 0)) ||
+        (result = CPC_Control(dev->handle, CONTR_CAN_Message |
+          CONTR_CONT_ON)))
+      error_setf(&dev->error, CAN_CPC_ERROR_SETUP, "%s",
+        CPC_DecodeErrorMsg(result));
+  }
 
-  time.tv_sec = 0;
-  time.tv_usec = dev->timeout*1e6;
+  return dev->error.code;
+}
 
-  FD_ZERO(&set);
-  FD_SET(dev->fd, &set);
+int can_cpc_device_send(can_cpc_device_t* dev, const can_message_t* message) {
+  can_cpc_device_send_messages(dev, message, 1);
+  return dev->send_error.code;
+}
 
-  result = select(dev->fd+1, NULL, &set, NULL, &time);
-  if (result == 0) {
-    error_set(&dev->error, CAN_CPC_ERROR_TIMEOUT);
-    return dev->error.code;
+int can_cpc_device_send_messages(can_cpc_device_t* dev, const can_message_t*
+    messages, size_t num) {
+  return can_cpc_device_enqueue(dev, messages, num, dev->queue_timeout);
+}
+
+int can_cpc_device_try_send(can_cpc_device_t* dev, const can_message_t*
+    message) {
+  can_cpc_device_enqueue(dev, message, 1, 0.0);
+  return dev->send_error.code;
+}
+
+int can_cpc_device_enqueue(can_cpc_device_t* dev, const can_message_t*
+    messages, size_t num, double timeout) {
+  struct timespec start;
+  CPC_CAN_MSG_T* msg;
+  error_t drain_error;
+  size_t first, num_queued = 0;
+
+  error_init(&drain_error, can_cpc_errors);
+  
+  pthread_mutex_lock(&dev->queue_mutex);
+  error_clear(&dev->send_error);
+  first = dev->queue_tail;
+  dev->queue_first = first;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  can_cpc_device_drain(dev, &drain_error);
+  while ((num_queued < num) && (dev->queue_failed <= first)) {
+    while ((num_queued < num) &&
+        (dev->queue_tail-dev->queue_head < dev->queue_size)) {
+      msg = &dev->queue[dev->queue_tail % dev->queue_size];
+      msg->id = messages[num_queued].id;
+      msg->length = messages[num_queued].length;
+      memcpy(msg->msg, messages[num_queued].content, msg->length);
+      ++dev->queue_tail;
+      ++num_queued;
+    }
+  
+    if (can_cpc_device_drain(dev, &drain_error) &&
+        (dev->queue_failed > first))
+      break;
+  
+    if ((num_queued < num) &&
+        (dev->queue_tail-dev->queue_head >= dev->queue_size) &&
+        can_cpc_device_wait(dev, &start, timeout, &drain_error)) {
+      if (dev->send_error.code == CAN_CPC_ERROR_TIMEOUT)
+        error_set(&dev->send_error, CAN_CPC_ERROR_QUEUE);
+      break;
+    }
   }
+  
+  /* The drain has discarded the messages queued behind a failed one of
+   * this call, such that the failed message follows those reported as
+   * queued. The failure of a message queued by an earlier call is only
+   * reported. */
+  if (dev->queue_failed > first)
+    num_queued = dev->queue_failed-1-first;
+  dev->queue_first = (size_t)-1;
+  if (drain_error.code && !dev->send_error.code)
+    error_blame(&dev->send_error, &drain_error, CAN_CPC_ERROR_SEND);
+  pthread_mutex_unlock(&dev->queue_mutex);
+  
+  error_destroy(&drain_error);
 
-  while ((result = CPC_SendMsg(dev->handle, 0, &msg)) ==
-      CPC_ERR_CAN_NO_TRANSMIT_BUF)
-    timer_sleep(1e-5);
-  if (result)
-    error_setf(&dev->error, CAN_CPC_ERROR_SEND, CPC_DecodeErrorMsg(result));
+  return (num_queued || !dev->send_error.code) ? num_queued :
+    -dev->send_error.code;
+}
 
-  return dev->error.code;
+int can_cpc_device_flush(can_cpc_device_t* dev, double timeout) {
+  struct timespec start;
+
+  pthread_mutex_lock(&dev->queue_mutex);
+  error_clear(&dev->send_error);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (!can_cpc_device_drain(dev, &dev->send_error) &&
+      (dev->queue_head != dev->queue_tail))
+    if (can_cpc_device_wait(dev, &start, timeout, &dev->send_error))
+      break;
+  pthread_mutex_unlock(&dev->queue_mutex);
+
+  return dev->send_error.code;
 }
 
 int can_cpc_device_receive(can_cpc_device_t* dev, can_message_t* message) {
-  struct timeval time;
+  can_cpc_device_receive_messages(dev, message, 1);
+  return dev->receive_error.code;
+}
+
+int can_cpc_device_receive_messages(can_cpc_device_t* dev, can_message_t*
+    messages, size_t num) {
+  return can_cpc_device_dequeue(dev, messages, num, dev->timeout);
+}
+
+int can_cpc_device_try_receive(can_cpc_device_t* dev, can_message_t*
+    message) {
+  can_cpc_device_dequeue(dev, message, 1, 0.0);
+  return dev->receive_error.code;
+}
+
+int can_cpc_device_dequeue(can_cpc_device_t* dev, can_message_t* messages,
+    size_t num, double timeout) {
+  struct timespec start, time;
+  struct timeval select_time;
   fd_set set;
+  size_t i, head, tail;
+  double frame_time = CAN_CPC_FRAME_BITS/(dev->bitrate*1e3);
+  int pending, result;
+
+  pending = can_cpc_device_try_drain(dev);
+  error_clear(&dev->receive_error);
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  
+  head = dev->ring_head;
+  tail = __atomic_load_n(&dev->ring_tail, __ATOMIC_ACQUIRE);
+  
+  while (head == tail) {
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    double remaining = timeout-(time.tv_sec-start.tv_sec)-
+      (time.tv_nsec-start.tv_nsec)*1e-9;
+    double wait;
+    
+    if (remaining < 0.0)
+      remaining = 0.0;
+    wait = (pending && (frame_time < remaining)) ? frame_time : remaining;
+    select_time.tv_sec = wait;
+    select_time.tv_usec = (wait-select_time.tv_sec)*1e6;
+
+    FD_ZERO(&set);
+    FD_SET(dev->fd, &set);
+
+    result = select(dev->fd+1, &set, NULL, NULL, &select_time);
+    if ((result == 0) && (wait >= remaining)) {
+      error_set(&dev->receive_error, CAN_CPC_ERROR_TIMEOUT);
+      return -dev->receive_error.code;
+    }
+    else if (result > 0) {
+      while ((tail-head < CAN_CPC_RING_SIZE) && !CPC_Handle(dev->handle))
+        tail = __atomic_load_n(&dev->ring_tail, __ATOMIC_ACQUIRE);
+    }
+    else if ((result < 0) && (errno != EINTR)) {
+      error_setf(&dev->receive_error, CAN_CPC_ERROR_RECEIVE, "%s",
+        strerror(errno));
+      return -dev->receive_error.code;
+    }
+    
+    if (pending)
+      pending = can_cpc_device_try_drain(dev);
+  }
+
+  for (i = 0; (i < num) && (head != tail); ++i, ++head)
+    messages[i] = dev->ring[head & (CAN_CPC_RING_SIZE-1)];
+  __atomic_store_n(&dev->ring_head, head, __ATOMIC_RELEASE);
+
+  return i;
+}
+
+void can_cpc_device_handle(int handle, const CPC_MSG_T* msg, void* custom) {
+  can_cpc_device_t* dev = custom;
+  size_t tail = dev->ring_tail;
+  can_message_t* message;
+  
+  /* Status, error, and parameter replies share the handler. */
+  if (msg->type != CPC_MSG_T_CAN)
+    return;
+  
+  if (tail-__atomic_load_n(&dev->ring_head, __ATOMIC_ACQUIRE) >=
+      CAN_CPC_RING_SIZE) {
+    ++dev->num_overruns;
+    return;
+  }
+  
+  message = &dev->ring[tail & (CAN_CPC_RING_SIZE-1)];
+  message->id = msg->msg.canmsg.id;
+  message->length = (msg->msg.canmsg.length < sizeof(message->content)) ?
+    msg->msg.canmsg.length : sizeof(message->content);
+  memcpy(message->content, msg->msg.canmsg.msg, message->length);
+  message->timestamp = dev->timestamps ?
+    msg->ts_sec+msg->ts_nsec*1e-9 : 0.0;
+  
+  __atomic_store_n(&dev->ring_tail, tail+1, __ATOMIC_RELEASE);
+}
+
+int can_cpc_device_drain(can_cpc_device_t* dev, error_t* error) {
   int result;
 
-  error_clear(&dev->error);
+  while (dev->queue_head != dev->queue_tail) {
+    if ((result = CPC_SendMsg(dev->handle, 0,
+        &dev->queue[dev->queue_head % dev->queue_size])) ==
+        CPC_ERR_CAN_NO_TRANSMIT_BUF)
+      break;
+    
+    ++dev->queue_head;
+    if (result) {
+      dev->queue_failed = dev->queue_head;
+      if (dev->queue_head > dev->queue_first)
+        dev->queue_tail = dev->queue_head;
+      if (error)
+        error_setf(error, CAN_CPC_ERROR_SEND, "%s",
+          CPC_DecodeErrorMsg(result));
+      return CAN_CPC_ERROR_SEND;
+    }
+  }
+
+  return CAN_CPC_ERROR_NONE;
+}
+
+int can_cpc_device_try_drain(can_cpc_device_t* dev) {
+  int pending = 0;
   
-  time.tv_sec = 0;
-  time.tv_usec = dev->timeout*1e6;
+  if (!pthread_mutex_trylock(&dev->queue_mutex)) {
+    can_cpc_device_drain(dev, 0);
+    pending = (dev->queue_head != dev->queue_tail);
+    pthread_mutex_unlock(&dev->queue_mutex);
+  }
+  
+  return pending;
+}
+
+int can_cpc_device_wait(can_cpc_device_t* dev, const struct timespec* start,
+    double timeout, error_t* error) {
+  struct timespec time;
+  struct timeval select_time;
+  fd_set set;
+  size_t head = dev->queue_head;
+  int result;
+  
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  double remaining = timeout-(time.tv_sec-start->tv_sec)-
+    (time.tv_nsec-start->tv_nsec)*1e-9;
+  
+  if (remaining <= 0.0) {
+    error_set(&dev->send_error, CAN_CPC_ERROR_TIMEOUT);
+    return dev->send_error.code;
+  }
+  select_time.tv_sec = remaining;
+  select_time.tv_usec = (remaining-select_time.tv_sec)*1e6;
 
   FD_ZERO(&set);
   FD_SET(dev->fd, &set);
 
-  result = select(dev->fd+1, &set, NULL, NULL, &time);
-  if (result == 0) {
-    error_set(&dev->error, CAN_CPC_ERROR_TIMEOUT);
-    return dev->error.code;
+  /* The receiver may drain the queue meanwhile. */
+  pthread_mutex_unlock(&dev->queue_mutex);
+  result = select(dev->fd+1, NULL, &set, NULL, &select_time);
+  pthread_mutex_lock(&dev->queue_mutex);
+  
+  if (result == 0)
+    error_set(&dev->send_error, CAN_CPC_ERROR_TIMEOUT);
+  else if (result > 0) {
+    if (!can_cpc_device_drain(dev, error) && (dev->queue_head == head)) {
+      double frame_time = CAN_CPC_FRAME_BITS/(dev->bitrate*1e3);
+      
+      pthread_mutex_unlock(&dev->queue_mutex);
+      timer_sleep((frame_time < remaining) ? frame_time : remaining);
+      pthread_mutex_lock(&dev->queue_mutex);
+    }
   }
+  else if (errno != EINTR)
+    error_setf(&dev->send_error, CAN_CPC_ERROR_SEND, "%s", strerror(errno));
 
-  while (CPC_Handle(dev->handle))
-    timer_sleep(1e-5);
-  *message = dev->msg_received;
-
-  return dev->error.code;
+  return dev->send_error.code;
 }
 
-void can_cpc_device_handle(int handle, const CPC_MSG_T* msg, void* custom) {
-  can_cpc_device_t* dev = custom;
-
-  dev->msg_received.id = msg->msg.canmsg.id;
+void can_cpc_device_merge_filters(const can_filter_t* filters, size_t num,
+    size_t group, int* code, int* mask) {
+  size_t i;
+  int first = 1;
 
-  memcpy(dev->msg_received.content, msg->msg.canmsg.msg,
-    msg->msg.canmsg.length);
-  dev->msg_received.length = msg->msg.canmsg.length;
+  *code = 0;
+  *mask = CAN_ID_MAX;
+  
+  for (i = 0; i < num; ++i)
+    if (group & ((size_t)1 << i)) {
+      if (first) {
+        *code = filters[i].id & CAN_ID_MAX;
+        first = 0;
+      }
+      *mask &= filters[i].mask & ~(filters[i].id ^ *code);
+    }
+  
+  *code &= *mask;
 }
@@ -30,6 +30,10 @@
   *  CAN-CPC hardware.
   */
 
+#include <pthread.h>
+
+#include <libcpc/cpc.h>
+
 #include "can.h"
 
 /** \name Parameters
@@ -41,6 +45,8 @@
 #define CAN_CPC_PARAMETER_QUANTA_PER_BIT   "cpc-quanta-per-bit"
 #define CAN_CPC_PARAMETER_SAMPLING_POINT   "cpc-sampling-point"
 #define CAN_CPC_PARAMETER_TIMEOUT          "cpc-timeout"
+#define CAN_CPC_PARAMETER_QUEUE_SIZE       "cpc-queue-size"
+#define CAN_CPC_PARAMETER_QUEUE_TIMEOUT    "cpc-queue-timeout"
 //@}
 
 /** \name Constants
@@ -50,8 +56,15 @@
 #define CAN_CPC_CLOCK_FREQUENCY            16e6
 #define CAN_CPC_SYNC_JUMP_WIDTH            1
 #define CAN_CPC_TRIPLE_SAMPLING            0
+#define CAN_CPC_FRAME_BITS                 135
+#define CAN_CPC_FILTER_SEARCH_MAX          10
 //@}
 
+/** \brief Number of messages held by the CAN-CPC receive ring
+  * \note The size must be a power of two.
+  */
+#define CAN_CPC_RING_SIZE                  64
+
 /** \name Error Codes
   * \brief Predefined CAN-CPC error codes
   */
@@ -70,6 +83,8 @@
 //!< Failed to send to CAN-CPC device
 #define CAN_CPC_ERROR_RECEIVE              6
 //!< Failed to receive from CAN-CPC device
+#define CAN_CPC_ERROR_QUEUE                7
+//!< CAN-CPC transmit queue full
 //@}
 
 /** \brief Predefined CAN-CPC error descriptions
@@ -77,6 +92,10 @@
 extern const char* can_cpc_errors[];
 
 /** \brief CAN-CPC device structure
+  * 
+  * One sender and one receiver may operate the device concurrently. The
+  * send functions report errors in the send error of the device and the
+  * receive functions in its receive error.
   */
 typedef struct can_cpc_device_t {
   int handle;                   //!< Device handle.
@@ -88,9 +107,28 @@ typedef struct can_cpc_device_t {
   double sampling_point;        //!< Sampling point in the range [0, 1].
   double timeout;               //!< Device select timeout in [s].
 
-  can_message_t msg_received;   //!< The most recent message received.
+  unsigned char acc_code[4];    //!< Acceptance code registers.
+  unsigned char acc_mask[4];    //!< Acceptance mask registers.
+
+  CPC_CAN_MSG_T* queue;         //!< Software transmit queue of frames.
+  size_t queue_size;            //!< Capacity of the transmit queue.
+  size_t queue_head;            //!< Queue position of the next message.
+  size_t queue_tail;            //!< Queue position past the last message.
+  size_t queue_failed;          //!< Queue position past the last failure.
+  size_t queue_first;           //!< Queue position of the send in progress.
+  double queue_timeout;         //!< Transmit queue timeout in [s].
+  pthread_mutex_t queue_mutex;  //!< Mutex protecting the transmit queue.
+
+  can_message_t ring[CAN_CPC_RING_SIZE];
+  //!< Receive ring filled by the message handler.
+  size_t ring_head;             //!< Ring position of the next message.
+  size_t ring_tail;             //!< Ring position past the last message.
+  size_t num_overruns;          //!< Number of messages dropped on overflow.
+  int timestamps;               //!< Flag enabling message timestamps.
   
   error_t error;                //!< The most recent device error.
+  error_t send_error;           //!< The most recent send error.
+  error_t receive_error;        //!< The most recent receive error.
 } can_cpc_device_t;
 
 /** \brief Open the CAN-CPC device with the specified name
@@ -115,6 +153,10 @@ int can_cpc_device_close(
   * \param[in] quanta_per_bit The device's number of quanta per bit.
   * \param[in] sampling_point The sampling point in the range [0, 1].
   * \param[in] timeout The device select timeout to be set in [s].
+  * \param[in] queue_size The number of messages to be held by the software
+  *   transmit queue.
+  * \param[in] queue_timeout The time in [s] a sender blocks on a full
+  *   transmit queue. If zero, senders return immediately.
   * \return The resulting error code.
   */
 int can_cpc_device_setup(
@@ -122,24 +164,151 @@ int can_cpc_device_setup(
   int bitrate,
   int quanta_per_bit,
   double sampling_point,
-  double timeout);
+  double timeout,
+  size_t queue_size,
+  double queue_timeout);
+
+/** \brief Set the message identifier filters of a CAN-CPC device
+  * \param[in] dev The open CAN-CPC device to set the filters for.
+  * \param[in] filters An array of filters, of which a received message
+  *   must pass at least one.
+  * \param[in] num The number of filters in the array. If zero, all
+  *   messages will be received.
+  * \return The resulting error code.
+  * 
+  * The filters are compiled into the acceptance code and mask registers
+  * of the SJA1000 controller in dual filter mode. Each of the two
+  * hardware filters accepts the tightest identifier mask covering a group
+  * of filters. For up to CAN_CPC_FILTER_SEARCH_MAX filters, all ways of
+  * splitting them into two groups are evaluated, choosing the split which
+  * accepts the fewest identifiers. Larger sets of filters are covered by
+  * a single mask. As the hardware filters may accept more identifiers
+  * than requested, the exact filters must still be applied in software.
+  * If the device has already been set up, the controller is
+  * re-initialized with the new acceptance filters.
+  */
+int can_cpc_device_set_filters(
+  can_cpc_device_t* dev,
+  const can_filter_t* filters,
+  size_t num);
 
 /** \brief Send a CANopen SDO message over an open CAN-CPC device
   * \param[in] dev The open CAN-CPC device to send the message over.
   * \param[in] message The CANopen SDO message to be sent over the device.
   * \return The resulting error code.
+  * 
+  * The message is appended to the software transmit queue of the device,
+  * which is drained into the controller as long as it provides transmit
+  * buffers. If the queue is full, the sender blocks until the queue
+  * timeout expires, waiting on the device file descriptor and, while the
+  * controller has no transmit buffer, for the duration of a frame between
+  * attempts. The queue is released while waiting, such that the
+  * receiver may drain it meanwhile. The function returns as soon as the
+  * message has been queued. Frames remaining in the queue are drained by
+  * subsequent send and receive calls. A sender which does not receive
+  * should thus call can_cpc_device_flush() to hand them to the
+  * controller.
   */
 int can_cpc_device_send(
   can_cpc_device_t* dev,
   const can_message_t* message);
 
+/** \brief Send CANopen SDO messages over an open CAN-CPC device
+  * \param[in] dev The open CAN-CPC device to send the messages over.
+  * \param[in] messages An array of CANopen SDO messages to be sent over
+  *   the device.
+  * \param[in] num The number of messages in the array.
+  * \return The number of messages queued on the CAN-CPC device or the
+  *   negative error code. If an error occurs after some messages have
+  *   been queued, their number is returned and the send error is set.
+  * 
+  * As many messages as the transmit queue has room for are appended at
+  * once, and the queue is drained into the controller after each such
+  * round rather than after each message. The queue timeout applies to
+  * the entire array. Should the controller reject one of the messages,
+  * those queued behind it are discarded, and the number of messages
+  * preceding it is returned. If a message queued by an earlier call is
+  * rejected instead, all messages are reported as queued along with the
+  * send error.
+  */
+int can_cpc_device_send_messages(
+  can_cpc_device_t* dev,
+  const can_message_t* messages,
+  size_t num);
+
+/** \brief Flush the transmit queue of an open CAN-CPC device
+  * \param[in] dev The open CAN-CPC device to be flushed.
+  * \param[in] timeout The time in [s] to wait for the queue to drain.
+  * \return The resulting error code.
+  */
+int can_cpc_device_flush(
+  can_cpc_device_t* dev,
+  double timeout);
+
 /** \brief Receive a CANopen SDO message on an open CAN-CPC device
   * \param[in] dev The open CAN-CPC device to receive the message on.
   * \param[out] message The CANopen SDO message received on the device.
   * \return The resulting error code.
+  * 
+  * Before waiting for a message, the transmit queue is drained into the
+  * controller as far as possible, unless a sender currently holds the
+  * queue and drains it itself. While frames remain queued, the wait is
+  * interrupted once per frame duration to drain the queue again. Messages
+  * are taken from the receive ring of the device. The ring is filled by
+  * the message handler and drained by this function without locking,
+  * with a single producer and a single consumer. If the ring is empty,
+  * the function blocks on the device file descriptor until the
+  * driver reports a message or the timeout expires, and then dispatches
+  * as many pending messages to the handler as the ring has room for.
+  * Messages handled while the ring is full are counted and dropped.
+  * If timestamps are enabled, messages carry the reception time reported
+  * by the driver, which refers to the driver's clock.
   */
 int can_cpc_device_receive(
   can_cpc_device_t* dev,
   can_message_t* message);
 
+/** \brief Receive CANopen SDO messages on an open CAN-CPC device
+  * \param[in] dev The open CAN-CPC device to receive the messages on.
+  * \param[out] messages An array of CANopen SDO messages received on the
+  *   device.
+  * \param[in] num The maximum number of messages to be received.
+  * \return The number of messages received on the CAN-CPC device or the
+  *   negative error code.
+  * 
+  * The function blocks like can_cpc_device_receive() until the receive
+  * ring holds at least one message, and then takes as many messages from
+  * the ring as are available, up to the requested number.
+  */
+int can_cpc_device_receive_messages(
+  can_cpc_device_t* dev,
+  can_message_t* messages,
+  size_t num);
+
+/** \brief Send a CANopen SDO message over a CAN-CPC device without
+  *   blocking
+  * \param[in] dev The open CAN-CPC device to send the message over.
+  * \param[in] message The CANopen SDO message to be sent over the device.
+  * \return The resulting error code, CAN_CPC_ERROR_QUEUE if the transmit
+  *   queue is full.
+  */
+int can_cpc_device_try_send(
+  can_cpc_device_t* dev,
+  const can_message_t* message);
+
+/** \brief Receive a CANopen SDO message on a CAN-CPC device without
+  *   blocking
+  * \param[in] dev The open CAN-CPC device to receive the message on.
+  * \param[out] message The CANopen SDO message received on the device.
+  * \return The resulting error code, CAN_CPC_ERROR_TIMEOUT if neither the
+  *   receive ring nor the driver hold a message.
+  * 
+  * The transmit queue is drained and messages pending at the driver are
+  * dispatched to the handler as by can_cpc_device_receive(), but the
+  * device file descriptor is only polled.
+  */
+int can_cpc_device_try_receive(
+  can_cpc_device_t* dev,
+  can_message_t* message);
+
 #endif
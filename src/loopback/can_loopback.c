@@ -0,0 +1,399 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "can_epos.h"
+
+#include "can_loopback.h"
+
+#define CAN_LOOPBACK_OBJECT_USED              0x80000000
+
+const char* can_loopback_errors[] = {
+  "Success",
+  "CAN-Loopback conversion error",
+  "Failed to send to CAN-Loopback device",
+  "Failed to receive from CAN-Loopback device",
+  "Failed to create CAN-Loopback event descriptor",
+};
+
+config_param_t can_loopback_default_params[] = {
+  {CAN_LOOPBACK_PARAMETER_NUM_OBJECTS,
+    config_param_type_int,
+    "1024",
+    "[1, 1048576]",
+    "The number of objects which can be stored in the emulated object "
+    "dictionary of the CAN-Loopback device"},
+  {CAN_LOOPBACK_PARAMETER_QUEUE_SIZE,
+    config_param_type_int,
+    "1",
+    "[1, 1024]",
+    "The maximum number of pending responses of the CAN-Loopback device"},
+};
+
+const config_default_t can_loopback_default_config = {
+  can_loopback_default_params,
+  sizeof(can_loopback_default_params)/sizeof(config_param_t),
+};
+
+int can_loopback_open(can_device_t* dev);
+int can_loopback_close(can_device_t* dev);
+int can_loopback_send_message(can_device_t* dev, const can_message_t* message);
+int can_loopback_receive_message(can_device_t* dev, can_message_t* message);
+int can_loopback_get_fd(can_device_t* dev);
+int can_loopback_try_receive_message(can_device_t* dev, can_message_t*
+  message);
+
+const can_backend_t can_backend = {
+  "loopback",
+  "CAN-Loopback",
+  &can_loopback_default_config,
+  can_loopback_open,
+  can_loopback_close,
+  can_loopback_send_message,
+  can_loopback_receive_message,
+  0,
+  0,
+  0,
+  1,
+  can_loopback_get_fd,
+  0,
+  can_loopback_try_receive_message,
+};
+
+void can_loopback_device_init(can_loopback_device_t* dev);
+void can_loopback_device_destroy(can_loopback_device_t* dev);
+can_loopback_object_t* can_loopback_device_lookup(can_loopback_device_t*
+  dev, unsigned int key, int insert);
+
+int can_loopback_open(can_device_t* dev) {
+  error_clear(&dev->error);
+  
+  if (!dev->num_references) {
+    dev->comm_dev = malloc(sizeof(can_loopback_device_t));
+    can_loopback_device_init(dev->comm_dev);
+
+    if (can_loopback_device_setup(dev->comm_dev,
+        config_get_int(&dev->config, CAN_LOOPBACK_PARAMETER_NUM_OBJECTS),
+        config_get_int(&dev->config, CAN_LOOPBACK_PARAMETER_QUEUE_SIZE))) {
+      error_blame(&dev->error,
+        &((can_loopback_device_t*)dev->comm_dev)->error, CAN_ERROR_OPEN);
+
+      can_loopback_device_destroy(dev->comm_dev);
+    
+      free(dev->comm_dev);
+      dev->comm_dev = 0;
+      
+      return dev->error.code;
+    }
+  }
+  ++dev->num_references;
+
+  return dev->error.code;
+}
+
+int can_loopback_close(can_device_t* dev) {
+  error_clear(&dev->error);
+  
+  if (dev->num_references) {
+    --dev->num_references;
+
+    if (!dev->num_references) {
+      can_loopback_device_destroy(dev->comm_dev);
+        
+      free(dev->comm_dev);
+      dev->comm_dev = 0;
+    }
+  }
+  else
+    error_setf(&dev->error, CAN_ERROR_CLOSE, "Non-zero reference count");
+  
+  return dev->error.code;
+}
+
+int can_loopback_send_message(can_device_t* dev, const can_message_t* message) {
+  unsigned char data[CAN_LOOPBACK_FRAME_SIZE];
+  
+  error_clear(&dev->send_error);
+
+  if ((can_loopback_device_from_epos(dev->comm_dev, message, data) < 0) ||
+      can_loopback_device_send(dev->comm_dev, data))
+    error_blame(&dev->send_error,
+      &((can_loopback_device_t*)dev->comm_dev)->error, CAN_ERROR_SEND);
+
+  return dev->send_error.code;
+}
+
+int can_loopback_receive_message(can_device_t* dev, can_message_t* message) {
+  unsigned char data[CAN_LOOPBACK_FRAME_SIZE];
+  can_loopback_device_t* loopback_dev = dev->comm_dev;
+
+  error_clear(&dev->receive_error);
+  
+  if (can_loopback_device_receive(loopback_dev, data))
+    error_blame(&dev->receive_error, &loopback_dev->error, CAN_ERROR_RECEIVE);
+  else if (can_epos_reply(data, message))
+    error_setf(&dev->receive_error, CAN_ERROR_RECEIVE,
+      "Invalid SDO command: 0x%02x", message->content[0]);
+  
+  return dev->receive_error.code;
+}
+
+int can_loopback_get_fd(can_device_t* dev) {
+  can_loopback_device_t* loopback_dev = dev->comm_dev;
+  
+  error_clear(&dev->error);
+
+  if (!loopback_dev) {
+    error_setf(&dev->error, CAN_ERROR_SETUP,
+      "Communication device unavailable");
+    return -dev->error.code;
+  }
+  
+  if ((loopback_dev->event_fd < 0) &&
+      can_loopback_device_open_event(loopback_dev)) {
+    error_blame(&dev->error, &loopback_dev->error, CAN_ERROR_SETUP);
+    return -dev->error.code;
+  }
+
+  return loopback_dev->event_fd;
+}
+
+int can_loopback_try_receive_message(can_device_t* dev, can_message_t*
+    message) {
+  if (dev->comm_dev &&
+      !((can_loopback_device_t*)dev->comm_dev)->num_responses) {
+    error_set(&dev->receive_error, CAN_ERROR_WOULD_BLOCK);
+    return dev->receive_error.code;
+  }
+  
+  return can_loopback_receive_message(dev, message);
+}
+
+void can_loopback_device_init(can_loopback_device_t* dev) {
+  dev->objects = 0;
+  dev->num_objects = 0;
+
+  dev->responses = 0;
+  dev->queue_size = 0;
+  dev->queue_first = 0;
+  dev->num_responses = 0;
+  dev->event_fd = -1;
+
+  error_init(&dev->error, can_loopback_errors);
+}
+
+void can_loopback_device_destroy(can_loopback_device_t* dev) {
+  if (dev->objects) {
+    free(dev->objects);
+    dev->objects = 0;
+  }
+  if (dev->responses) {
+    free(dev->responses);
+    dev->responses = 0;
+  }
+  if (dev->event_fd >= 0) {
+    close(dev->event_fd);
+    dev->event_fd = -1;
+  }
+
+  error_destroy(&dev->error);
+}
+
+int can_loopback_device_setup(can_loopback_device_t* dev, size_t
+    num_objects, size_t queue_size) {
+  error_clear(&dev->error);
+
+  dev->num_objects = 1;
+  while (dev->num_objects < num_objects)
+    dev->num_objects <<= 1;
+  dev->objects = realloc(dev->objects,
+    dev->num_objects*sizeof(can_loopback_object_t));
+  memset(dev->objects, 0, dev->num_objects*sizeof(can_loopback_object_t));
+
+  dev->queue_size = queue_size;
+  dev->queue_first = 0;
+  dev->num_responses = 0;
+  dev->responses = realloc(dev->responses,
+    dev->queue_size*CAN_LOOPBACK_FRAME_SIZE);
+
+  return dev->error.code;
+}
+
+int can_loopback_device_from_epos(can_loopback_device_t* dev, const
+    can_message_t* message, unsigned char* data) {
+  error_clear(&dev->error);
+  
+  switch (message->content[0]) {
+    case CAN_CMD_SDO_WRITE_SEND_1_BYTE:
+    case CAN_CMD_SDO_WRITE_SEND_2_BYTE:
+    case CAN_CMD_SDO_WRITE_SEND_4_BYTE:
+      data[0] = CAN_LOOPBACK_OPCODE_WRITE;
+      data[1] = 0x03;
+      data[2] = message->content[2];
+      data[3] = message->content[1];
+      data[4] = message->id;
+      data[5] = message->content[3];
+      data[6] = message->content[5];
+      data[7] = message->content[4];
+      data[8] = (message->content[0] == CAN_CMD_SDO_WRITE_SEND_4_BYTE) ?
+        message->content[7] : 0x00;
+      data[9] = (message->content[0] == CAN_CMD_SDO_WRITE_SEND_4_BYTE) ?
+        message->content[6] : 0x00;
+      data[10] = 0x00;
+      data[11] = 0x00;
+      return 12;
+    case CAN_CMD_SDO_READ_SEND:
+      data[0] = CAN_LOOPBACK_OPCODE_READ;
+      data[1] = 0x01;
+      data[2] = message->content[2];
+      data[3] = message->content[1];
+      data[4] = message->id;
+      data[5] = message->content[3];
+      data[6] = 0x00;
+      data[7] = 0x00;
+      return 8;
+  }
+
+  error_setf(&dev->error, CAN_LOOPBACK_ERROR_CONVERT,
+    "Invalid SDO command: 0x%02x", message->content[0]);
+  return -dev->error.code;
+}
+
+int can_loopback_device_send(can_loopback_device_t* dev, const unsigned
+    char* data) {
+  can_loopback_object_t* object;
+  unsigned char* response;
+  unsigned int key, value = 0, abort = 0;
+
+  error_clear(&dev->error);
+
+  if (dev->num_responses >= dev->queue_size) {
+    error_setf(&dev->error, CAN_LOOPBACK_ERROR_SEND,
+      "Response queue overflow");
+    return dev->error.code;
+  }
+
+  key = (data[4] << 24) | (data[2] << 16) | (data[3] << 8) | data[5];
+  
+  switch (data[0]) {
+    case CAN_LOOPBACK_OPCODE_WRITE:
+      if ((object = can_loopback_device_lookup(dev, key, 1)))
+        object->value = (data[8] << 24) | (data[9] << 16) |
+          (data[6] << 8) | data[7];
+      else
+        abort = CAN_LOOPBACK_ABORT_MEMORY;
+      break;
+    case CAN_LOOPBACK_OPCODE_READ:
+      if ((object = can_loopback_device_lookup(dev, key, 0)))
+        value = object->value;
+      break;
+    default:
+      error_setf(&dev->error, CAN_LOOPBACK_ERROR_SEND,
+        "Invalid operation code: 0x%02x", data[0]);
+      return dev->error.code;
+  }
+
+  response = &dev->responses[((dev->queue_first+dev->num_responses) %
+    dev->queue_size)*CAN_LOOPBACK_FRAME_SIZE];
+  ++dev->num_responses;
+  if (dev->event_fd >= 0)
+    eventfd_write(dev->event_fd, 1);
+  
+  response[0] = CAN_LOOPBACK_OPCODE_RESPONSE;
+  response[1] = 0x03;
+  response[2] = abort >> 24;
+  response[3] = abort >> 16;
+  response[4] = abort >> 8;
+  response[5] = abort;
+  response[6] = value >> 24;
+  response[7] = value >> 16;
+  response[8] = value >> 8;
+  response[9] = value;
+  response[10] = 0x00;
+  response[11] = 0x00;
+
+  return dev->error.code;
+}
+
+int can_loopback_device_receive(can_loopback_device_t* dev, unsigned char*
+    data) {
+  eventfd_t value;
+  
+  error_clear(&dev->error);
+
+  if (dev->num_responses) {
+    memcpy(data, &dev->responses[dev->queue_first*CAN_LOOPBACK_FRAME_SIZE],
+      CAN_LOOPBACK_FRAME_SIZE);
+    
+    dev->queue_first = (dev->queue_first+1) % dev->queue_size;
+    --dev->num_responses;
+    if (dev->event_fd >= 0)
+      eventfd_read(dev->event_fd, &value);
+  }
+  else
+    error_setf(&dev->error, CAN_LOOPBACK_ERROR_RECEIVE, "No pending response");
+  
+  return dev->error.code;
+}
+
+int can_loopback_device_open_event(can_loopback_device_t* dev) {
+  error_clear(&dev->error);
+  
+  if (dev->event_fd < 0) {
+    if ((dev->event_fd = eventfd(dev->num_responses, EFD_NONBLOCK |
+        EFD_SEMAPHORE)) < 0)
+      error_setf(&dev->error, CAN_LOOPBACK_ERROR_EVENT, "%s",
+        strerror(errno));
+  }
+  
+  return dev->error.code;
+}
+
+can_loopback_object_t* can_loopback_device_lookup(can_loopback_device_t*
+    dev, unsigned int key, int insert) {
+  size_t i, mask = dev->num_objects-1;
+  size_t index = ((key ^ (key >> 15))*2654435761U) & mask;
+
+  key |= CAN_LOOPBACK_OBJECT_USED;
+  
+  for (i = 0; i < dev->num_objects; ++i) {
+    can_loopback_object_t* object = &dev->objects[(index+i) & mask];
+    
+    if (object->key == key)
+      return object;
+    else if (!object->key) {
+      if (insert) {
+        object->key = key;
+        object->value = 0;
+        
+        return object;
+      }
+      else
+        return 0;
+    }
+  }
+
+  return 0;
+}
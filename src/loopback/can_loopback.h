@@ -0,0 +1,159 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef CAN_LOOPBACK_H
+#define CAN_LOOPBACK_H
+
+/**
+  *  \file can_loopback.h
+  *  \brief CAN communication with an in-memory EPOS emulation
+  *  \author Ralf Kaestner
+  * 
+  *  This layer implements the CAN communication interface without any
+  *  I/O. Sent CANopen SDO messages are converted into EPOS frames which
+  *  are answered by an emulated object dictionary held in memory. The
+  *  back-end is intended for measuring the overhead of the library itself.
+  */
+
+#include "can.h"
+
+/** \name Parameters
+  * \brief Predefined CAN-Loopback parameters
+  */
+//@{
+#define CAN_LOOPBACK_PARAMETER_NUM_OBJECTS    "loopback-num-objects"
+#define CAN_LOOPBACK_PARAMETER_QUEUE_SIZE     "loopback-queue-size"
+//@}
+
+/** \name Operation Codes
+  * \brief Predefined CAN-Loopback operation codes
+  */
+//@{
+#define CAN_LOOPBACK_OPCODE_RESPONSE          0x00
+#define CAN_LOOPBACK_OPCODE_READ              0x10
+#define CAN_LOOPBACK_OPCODE_WRITE             0x11
+//@}
+
+/** \name Constants
+  * \brief Predefined CAN-Loopback constants
+  */
+//@{
+#define CAN_LOOPBACK_FRAME_SIZE               12
+#define CAN_LOOPBACK_ABORT_MEMORY             0x05040005
+//@}
+
+/** \name Error Codes
+  * \brief Predefined CAN-Loopback error codes
+  */
+//@{
+#define CAN_LOOPBACK_ERROR_NONE               0
+//!< Success
+#define CAN_LOOPBACK_ERROR_CONVERT            1
+//!< CAN-Loopback conversion error
+#define CAN_LOOPBACK_ERROR_SEND               2
+//!< Failed to send to CAN-Loopback device
+#define CAN_LOOPBACK_ERROR_RECEIVE            3
+//!< Failed to receive from CAN-Loopback device
+#define CAN_LOOPBACK_ERROR_EVENT              4
+//!< Failed to create CAN-Loopback event descriptor
+//@}
+
+/** \brief Predefined CAN-Loopback error descriptions
+  */
+extern const char* can_loopback_errors[];
+
+/** \brief CAN-Loopback object dictionary entry
+  */
+typedef struct can_loopback_object_t {
+  unsigned int key;             //!< Node, index, and subindex of the object.
+  unsigned int value;           //!< The value of the object.
+} can_loopback_object_t;
+
+/** \brief CAN-Loopback device structure
+  */
+typedef struct can_loopback_device_t {
+  can_loopback_object_t* objects; //!< The emulated object dictionary.
+  size_t num_objects;           //!< The capacity of the object dictionary.
+
+  unsigned char* responses;     //!< The queue of pending response frames.
+  size_t queue_size;            //!< The capacity of the response queue.
+  size_t queue_first;           //!< The index of the first pending response.
+  size_t num_responses;         //!< The number of pending responses.
+  int event_fd;                 //!< Event descriptor counting responses.
+
+  error_t error;                //!< The most recent device error.
+} can_loopback_device_t;
+
+/** \brief Setup a CAN-Loopback device
+  * \param[in] dev The CAN-Loopback device to be set up.
+  * \param[in] num_objects The capacity of the emulated object dictionary.
+  * \param[in] queue_size The maximum number of pending responses.
+  * \return The resulting error code.
+  */
+int can_loopback_device_setup(
+  can_loopback_device_t* dev,
+  size_t num_objects,
+  size_t queue_size);
+
+/** \brief Convert a CANopen SDO message into an EPOS frame
+  * \param[in] dev The sending CAN device for which to convert the message.
+  * \param[in] message The CANopen SDO message to be converted.
+  * \param[out] data An array to store the converted EPOS frame.
+  * \return The number of bytes in the EPOS frame or the negative error
+  *   code.
+  */
+int can_loopback_device_from_epos(
+  can_loopback_device_t* dev,
+  const can_message_t* message,
+  unsigned char* data);
+
+/** \brief Process an EPOS frame in the emulated object dictionary
+  * \param[in] dev The CAN-Loopback device which processes the frame.
+  * \param[in] data An array containing the EPOS frame to be processed.
+  * \return The resulting error code.
+  * 
+  * The EPOS response to the processed frame is appended to the queue of
+  * pending responses.
+  */
+int can_loopback_device_send(
+  can_loopback_device_t* dev,
+  const unsigned char* data);
+
+/** \brief Retrieve the next pending EPOS response frame
+  * \param[in] dev The CAN-Loopback device to retrieve the response from.
+  * \param[out] data An array representing the EPOS response frame.
+  * \return The resulting error code.
+  */
+int can_loopback_device_receive(
+  can_loopback_device_t* dev,
+  unsigned char* data);
+
+/** \brief Open the event descriptor of a CAN-Loopback device
+  * \param[in] dev The CAN-Loopback device to open the descriptor for.
+  * \return The resulting error code.
+  * 
+  * The descriptor is an eventfd semaphore which counts the pending
+  * responses of the device. It is only maintained once opened, such that
+  * the device performs no I/O unless it is polled.
+  */
+int can_loopback_device_open_event(
+  can_loopback_device_t* dev);
+
+#endif
@@ -22,6 +22,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+
+#include "can_crc.h"
+#include "can_epos.h"
 
 #include "can_serial.h"
 
@@ -31,10 +37,10 @@ const char* can_serial_errors[] = {
   "Failed to send to CAN-Serial device",
   "Failed to receive from CAN-Serial device",
   "CAN-Serial checksum error",
+  "CAN-Serial device timeout",
+  "CAN-Serial transfer aborted",
 };
 
-const char* can_device_name = "CAN-Serial";
-
 config_param_t can_serial_default_params[] = {
   {CAN_SERIAL_PARAMETER_DEVICE,
     config_param_type_string,
@@ -73,24 +79,53 @@ config_param_t can_serial_default_params[] = {
     "The CAN-Serial communication timeout in [s]"},
 };
 
-const config_default_t can_default_config = {
+const config_default_t can_serial_default_config = {
   can_serial_default_params,
   sizeof(can_serial_default_params)/sizeof(config_param_t),
 };
 
+int can_serial_open(can_device_t* dev);
+int can_serial_close(can_device_t* dev);
+int can_serial_send_message(can_device_t* dev, const can_message_t* message);
+int can_serial_receive_message(can_device_t* dev, can_message_t* message);
+int can_serial_send_messages(can_device_t* dev, const can_message_t*
+  messages, size_t num);
+int can_serial_get_fd(can_device_t* dev);
+int can_serial_try_receive_message(can_device_t* dev, can_message_t*
+  message);
+
+const can_backend_t can_backend = {
+  "serial",
+  "CAN-Serial",
+  &can_serial_default_config,
+  can_serial_open,
+  can_serial_close,
+  can_serial_send_message,
+  can_serial_receive_message,
+  0,
+  can_serial_send_messages,
+  0,
+  1,
+  can_serial_get_fd,
+  0,
+  can_serial_try_receive_message,
+};
+
 void can_serial_device_init(can_serial_device_t* dev, const char* name);
 void can_serial_device_destroy(can_serial_device_t* dev);
+int can_serial_device_read(can_serial_device_t* dev, unsigned char* data,
+  size_t num, double timeout);
+int can_serial_device_read_ack(can_serial_device_t* dev, double timeout);
+int can_serial_device_request(can_serial_device_t* dev, unsigned char* data,
+  size_t num, unsigned char* response);
 
-int can_device_open(can_device_t* dev) {
+int can_serial_open(can_device_t* dev) {
   error_clear(&dev->error);
   
   if (!dev->num_references) {
     dev->comm_dev = malloc(sizeof(can_serial_device_t));
     can_serial_device_init(dev->comm_dev,
       config_get_string(&dev->config, CAN_SERIAL_PARAMETER_DEVICE));
-    
-    dev->num_sent = 0;
-    dev->num_received = 0;
 
     serial_device_t* serial_dev = 
       &((can_serial_device_t*)dev->comm_dev)->serial_dev;
@@ -111,13 +146,20 @@ int can_device_open(can_device_t* dev) {
       
       return dev->error.code;
     }
+
+    ((can_serial_device_t*)dev->comm_dev)->byte_time =
+      (1+config_get_int(&dev->config, CAN_SERIAL_PARAMETER_DATA_BITS)+
+      (config_get_int(&dev->config, CAN_SERIAL_PARAMETER_PARITY) ? 1 : 0)+
+      config_get_int(&dev->config, CAN_SERIAL_PARAMETER_STOP_BITS))/
+      (double)config_get_int(&dev->config, CAN_SERIAL_PARAMETER_BAUD_RATE);
+    ((can_serial_device_t*)dev->comm_dev)->timestamps = dev->timestamps;
   }
   ++dev->num_references;
 
   return dev->error.code;
 }
 
-int can_device_close(can_device_t* dev) {
+int can_serial_close(can_device_t* dev) {
   error_clear(&dev->error);
   
   if (dev->num_references) {
@@ -143,36 +185,75 @@ int can_device_close(can_device_t* dev) {
   return dev->error.code;
 }
 
-int can_device_send_message(can_device_t* dev, const can_message_t* message) {
-  unsigned char data[64];
+int can_serial_send_message(can_device_t* dev, const can_message_t* message) {
+  unsigned char data[CAN_SERIAL_FRAME_SIZE];
   
-  error_clear(&dev->error);
+  error_clear(&dev->send_error);
 
   int result;
   if (((result = can_serial_device_from_epos(dev->comm_dev,
         message, data)) < 0) ||
       (can_serial_device_send(dev->comm_dev, data, result) < 0))
-    error_blame(&dev->error, &((can_serial_device_t*)dev->comm_dev)->error,
-      CAN_ERROR_SEND);
-  else
-    ++dev->num_sent;
+    error_blame(&dev->send_error,
+      &((can_serial_device_t*)dev->comm_dev)->error, CAN_ERROR_SEND);
 
-  return dev->error.code;
+  return dev->send_error.code;
 }
 
-int can_device_receive_message(can_device_t* dev, can_message_t* message) {
-  unsigned char data[64];
+int can_serial_send_messages(can_device_t* dev, const can_message_t*
+    messages, size_t num) {
+  if (!num) {
+    error_clear(&dev->send_error);
+    return 0;
+  }
+  
+  return can_serial_send_message(dev, messages) ? -dev->send_error.code : 1;
+}
 
-  error_clear(&dev->error);
+int can_serial_receive_message(can_device_t* dev, can_message_t* message) {
+  unsigned char data[CAN_SERIAL_FRAME_SIZE];
+
+  error_clear(&dev->receive_error);
   
   if ((can_serial_device_receive(dev->comm_dev, data) < 0) ||
       can_serial_device_to_epos(dev->comm_dev, data, message))
-    error_blame(&dev->error, &((can_serial_device_t*)dev->comm_dev)->error,
-      CAN_ERROR_RECEIVE);
-  else
-    ++dev->num_received;
+    error_blame(&dev->receive_error,
+      &((can_serial_device_t*)dev->comm_dev)->error, CAN_ERROR_RECEIVE);
+  else if (dev->timestamps)
+    message->timestamp = ((can_serial_device_t*)dev->comm_dev)->timestamp;
   
-  return dev->error.code;
+  return dev->receive_error.code;
+}
+
+int can_serial_get_fd(can_device_t* dev) {
+  error_clear(&dev->error);
+
+  if (!dev->comm_dev) {
+    error_setf(&dev->error, CAN_ERROR_SETUP,
+      "Communication device unavailable");
+    return -dev->error.code;
+  }
+
+  return ((can_serial_device_t*)dev->comm_dev)->serial_dev.fd;
+}
+
+int can_serial_try_receive_message(can_device_t* dev, can_message_t*
+    message) {
+  can_serial_device_t* serial_dev = dev->comm_dev;
+  unsigned char data[CAN_SERIAL_FRAME_SIZE];
+  int result;
+
+  error_clear(&dev->receive_error);
+  
+  if (((result = can_serial_device_try_receive(serial_dev, data)) < 0) ||
+      ((result > 0) && can_serial_device_to_epos(serial_dev, data, message)))
+    error_blame(&dev->receive_error, &serial_dev->error, CAN_ERROR_RECEIVE);
+  else if (!result)
+    error_set(&dev->receive_error, CAN_ERROR_WOULD_BLOCK);
+  else if (dev->timestamps)
+    message->timestamp = serial_dev->timestamp;
+  
+  return dev->receive_error.code;
 }
 
 int can_serial_device_from_epos(can_serial_device_t* dev, const can_message_t*
@@ -239,57 +320,17 @@ int can_serial_device_to_epos(can_serial_device_t* dev, unsigned char* data,
     can_message_t* message) {
   error_clear(&dev->error);
   
-  if ((data[2] == 0) && (data[3] == 0) && (data[4] == 0) && (data[5] == 0)) {
-    switch (message->content[0]) {
-      case CAN_CMD_SDO_WRITE_SEND_1_BYTE:
-        message->content[0] = CAN_CMD_SDO_WRITE_RECEIVE;
-        break;
-      case CAN_CMD_SDO_WRITE_SEND_2_BYTE:
-        message->content[0] = CAN_CMD_SDO_WRITE_RECEIVE;
-        break;
-      case CAN_CMD_SDO_WRITE_SEND_4_BYTE:
-        message->content[0] = CAN_CMD_SDO_WRITE_RECEIVE;
-        break;
-      case CAN_CMD_SDO_READ_SEND:
-        message->content[0] = CAN_CMD_SDO_READ_RECEIVE_UNDEFINED;
-        break;
-      default:
-        error_setf(&dev->error, CAN_SERIAL_ERROR_CONVERT,
-          "Invalid SDO command: 0x%02x", message->content[0]);
-        return dev->error.code;
-    }
-
-    message->content[1] = message->content[2];
-    message->content[2] = message->content[3];
-    message->content[3] = message->content[4];
-    message->content[7] = data[6];
-    message->content[6] = data[7];
-    message->content[5] = data[8];
-    message->content[4] = data[9];
-  }
-  else {
-    message->id -= CAN_COB_ID_SDO_SEND;
-    message->id += CAN_COB_ID_SDO_RECEIVE;
-
-    message->content[0] = CAN_CMD_SDO_ABORT;
-    message->content[1] = message->content[2];
-    message->content[2] = message->content[3];
-    message->content[3] = message->content[4];
-    message->content[7] = data[2];
-    message->content[6] = data[3];
-    message->content[5] = data[4];
-    message->content[4] = data[5];
-  }
-  message->length = 8;
+  if (can_epos_reply(data, message))
+    error_setf(&dev->error, CAN_SERIAL_ERROR_CONVERT,
+      "Invalid SDO command: 0x%02x", message->content[0]);
 
   return dev->error.code;
 }
 
 int can_serial_device_send(can_serial_device_t* dev, unsigned char* data,
     size_t num) {
-  unsigned char buffer;
   unsigned char crc_value[2];
-  int result = 0;
+  double timeout = dev->serial_dev.timeout;
 
   error_clear(&dev->error);
   
@@ -299,73 +340,65 @@ int can_serial_device_send(can_serial_device_t* dev, unsigned char* data,
 
   can_serial_change_byte_order(data, num);
 
+  dev->buffer_pos = 0;
+  dev->buffer_num = 0;
+
   if (serial_device_write(&dev->serial_dev, data, 1) < 0) {
     error_blame(&dev->error, &dev->serial_dev.error, CAN_SERIAL_ERROR_SEND);
     return -dev->error.code;
   }
-
-  result = serial_device_read(&dev->serial_dev, &buffer, 1);
-  if (result > 0) {
-    if (buffer == CAN_SERIAL_ACK_FAILED) {
-      error_setf(&dev->error, CAN_SERIAL_ERROR_SEND,
-        "Send acknowledge failed");
-      return -dev->error.code;
-    }
-    else if (buffer != CAN_SERIAL_ACK_OKAY) {
-      error_setf(&dev->error, CAN_SERIAL_ERROR_SEND,
-        "Unexpected response: 0x%02x", buffer);
-      return -dev->error.code;
-    }
-  }
-  else {
-    error_blame(&dev->error, &dev->serial_dev.error, CAN_SERIAL_ERROR_SEND);
+  if (can_serial_device_read_ack(dev, timeout+dev->byte_time))
     return -dev->error.code;
-  }
 
   if (serial_device_write(&dev->serial_dev, &data[1], num-1) < 0) {
     error_blame(&dev->error, &dev->serial_dev.error, CAN_SERIAL_ERROR_SEND);
     return -dev->error.code;
   }
+  if (can_serial_device_read_ack(dev, timeout+(num-1)*dev->byte_time))
+    return -dev->error.code;
 
-  result = serial_device_read(&dev->serial_dev, &buffer, 1);
-  if (result > 0) {
-    if (buffer == CAN_SERIAL_ACK_FAILED) {
-      error_setf(&dev->error, CAN_SERIAL_ERROR_SEND,
-        "Send acknowledge failed");
-      return -dev->error.code;
-    }
-    else if (buffer != CAN_SERIAL_ACK_OKAY) {
-      error_setf(&dev->error, CAN_SERIAL_ERROR_SEND,
-        "Unexpected response: 0x%02x", buffer);
+  return num;
+}
+
+int can_serial_device_try_receive(can_serial_device_t* dev, unsigned char*
+    data) {
+  struct timeval select_time = {0, 0};
+  fd_set set;
+  int result;
+  
+  error_clear(&dev->error);
+  
+  if (dev->buffer_pos == dev->buffer_num) {
+    FD_ZERO(&set);
+    FD_SET(dev->serial_dev.fd, &set);
+    
+    if ((result = select(dev->serial_dev.fd+1, &set, 0, 0,
+        &select_time)) == 0)
+      return 0;
+    else if ((result < 0) && (errno != EINTR)) {
+      error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE, "%s",
+        strerror(errno));
       return -dev->error.code;
     }
+    else if (result < 0)
+      return 0;
   }
-  else {
-    error_blame(&dev->error, &dev->serial_dev.error, CAN_SERIAL_ERROR_SEND);
-    return -dev->error.code;
-  }
-
-  return num;
+  
+  return can_serial_device_receive(dev, data);
 }
 
 int can_serial_device_receive(can_serial_device_t* dev, unsigned char* data) {
   unsigned char buffer, crc_value[2];
-  int i, result = 0, num_exp = 0;
+  double timeout = dev->serial_dev.timeout;
+  int result = 0, num_exp = 0;
 
   error_clear(&dev->error);
   
-  result = serial_device_read(&dev->serial_dev, &buffer, 1);
-  if (result > 0) {
-    if (buffer != CAN_SERIAL_OPCODE_RESPONSE) {
-      error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE,
-        "Unexpected response: 0x%02x", buffer);
-      return -dev->error.code;
-    }
-    else
-      data[0] = CAN_SERIAL_OPCODE_RESPONSE;
-  }
-  else {
-    error_blame(&dev->error, &dev->serial_dev.error, CAN_SERIAL_ERROR_RECEIVE);
+  if (can_serial_device_read(dev, data, 1, timeout) < 0)
+    return -dev->error.code;
+  if (data[0] != CAN_SERIAL_OPCODE_RESPONSE) {
+    error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE,
+      "Unexpected response: 0x%02x", data[0]);
     return -dev->error.code;
   }
 
@@ -375,25 +408,17 @@ int can_serial_device_receive(can_serial_device_t* dev, unsigned char* data) {
     return -dev->error.code;
   }
 
-  result = serial_device_read(&dev->serial_dev, &buffer, 1);
-  if (result > 0)
-    data[1] = buffer;
-  else {
-    error_blame(&dev->error, &dev->serial_dev.error, CAN_SERIAL_ERROR_RECEIVE);
+  if (can_serial_device_read(dev, &data[1], 1, timeout+dev->byte_time) < 0)
     return -dev->error.code;
-  }
 
   num_exp = (data[1]+2)*sizeof(unsigned short);
-  for (i = 0; i < num_exp; ++i) {
-    if (serial_device_read(&dev->serial_dev, &buffer, 1) > 0)
-      data[i+2] = buffer;
-    else {
-      error_blame(&dev->error, &dev->serial_dev.error,
-        CAN_SERIAL_ERROR_RECEIVE);
-      return -dev->error.code;
-    }
-  }
-  result = i+2;
+  if (can_serial_device_read(dev, &data[2], num_exp,
+      timeout+num_exp*dev->byte_time) < 0)
+    return -dev->error.code;
+  result = num_exp+2;
+  
+  if (dev->timestamps)
+    dev->timestamp = can_get_time();
 
   can_serial_change_byte_order(data, result);
   
@@ -423,6 +448,131 @@ int can_serial_device_receive(can_serial_device_t* dev, unsigned char* data) {
   return result;
 }
 
+int can_serial_device_read_segmented(can_serial_device_t* dev, unsigned
+    char node_id, unsigned short index, unsigned char subindex, unsigned char*
+    data, size_t num) {
+  unsigned char request[CAN_SERIAL_FRAME_SIZE];
+  unsigned char response[CAN_SERIAL_FRAME_SIZE];
+  unsigned char control, toggle = 0;
+  size_t i = 0, size, length;
+  int result;
+
+  error_clear(&dev->error);
+
+  request[0] = CAN_SERIAL_OPCODE_READ_SEG_INIT;
+  request[1] = 0x01;
+  request[2] = index;
+  request[3] = index >> 8;
+  request[4] = subindex;
+  request[5] = node_id;
+  request[6] = 0x00;
+  request[7] = 0x00;
+  if ((result = can_serial_device_request(dev, request, 8, response)) < 0)
+    return result;
+  else if (result < 12) {
+    error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE,
+      "Invalid response length: %d", result);
+    return -dev->error.code;
+  }
+
+  size = response[6] | (response[7] << 8) | (response[8] << 16) |
+    (response[9] << 24);
+  if (size > num) {
+    error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE,
+      "Object size exceeds buffer size: %u", (unsigned int)size);
+    return -dev->error.code;
+  }
+
+  do {
+    request[0] = CAN_SERIAL_OPCODE_READ_SEG;
+    request[1] = 0x00;
+    request[2] = toggle;
+    request[3] = 0x00;
+    request[4] = 0x00;
+    request[5] = 0x00;
+    if ((result = can_serial_device_request(dev, request, 6, response)) < 0)
+      return result;
+
+    control = response[6];
+    length = control & CAN_SERIAL_SEGMENT_LENGTH;
+    if ((control & CAN_SERIAL_SEGMENT_TOGGLE) != toggle) {
+      error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE,
+        "Toggle bit mismatch");
+      return -dev->error.code;
+    }
+    else if ((length+9 > result) || (i+length > size)) {
+      error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE,
+        "Invalid segment length: %u", (unsigned int)length);
+      return -dev->error.code;
+    }
+
+    memcpy(&data[i], &response[7], length);
+    i += length;
+    toggle ^= CAN_SERIAL_SEGMENT_TOGGLE;
+  }
+  while (control & CAN_SERIAL_SEGMENT_MORE);
+
+  return i;
+}
+
+int can_serial_device_write_segmented(can_serial_device_t* dev, unsigned
+    char node_id, unsigned short index, unsigned char subindex, const
+    unsigned char* data, size_t num) {
+  unsigned char request[CAN_SERIAL_FRAME_SIZE];
+  unsigned char response[CAN_SERIAL_FRAME_SIZE];
+  unsigned char toggle = 0;
+  size_t i = 0, num_words, length;
+  int result;
+
+  error_clear(&dev->error);
+
+  request[0] = CAN_SERIAL_OPCODE_WRITE_SEG_INIT;
+  request[1] = 0x03;
+  request[2] = index;
+  request[3] = index >> 8;
+  request[4] = subindex;
+  request[5] = node_id;
+  request[6] = num;
+  request[7] = num >> 8;
+  request[8] = num >> 16;
+  request[9] = num >> 24;
+  request[10] = 0x00;
+  request[11] = 0x00;
+  if ((result = can_serial_device_request(dev, request, 12, response)) < 0)
+    return result;
+
+  do {
+    length = num-i;
+    if (length > CAN_SERIAL_SEGMENT_SIZE)
+      length = CAN_SERIAL_SEGMENT_SIZE;
+    num_words = (length+2)/2;
+
+    memset(request, 0, 2*num_words+4);
+    request[0] = CAN_SERIAL_OPCODE_WRITE_SEG;
+    request[1] = num_words-1;
+    request[2] = toggle | length;
+    if (i+length < num)
+      request[2] |= CAN_SERIAL_SEGMENT_MORE;
+    memcpy(&request[3], &data[i], length);
+    if ((result = can_serial_device_request(dev, request, 2*num_words+4,
+        response)) < 0)
+      return result;
+
+    if ((result < 10) || ((response[6] & CAN_SERIAL_SEGMENT_TOGGLE) !=
+        toggle)) {
+      error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE,
+        "Toggle bit mismatch");
+      return -dev->error.code;
+    }
+
+    i += length;
+    toggle ^= CAN_SERIAL_SEGMENT_TOGGLE;
+  }
+  while (i < num);
+
+  return i;
+}
+
 size_t can_serial_change_byte_order(unsigned char* data, size_t num) {
   unsigned char tmp;
   int i;
@@ -457,48 +607,136 @@ size_t can_serial_change_word_order(unsigned char* data, size_t num) {
 
 size_t can_serial_calc_crc(unsigned char* data, size_t num, unsigned char*
     crc_value) {
-  unsigned short* word_data = (unsigned short*)data;
-  size_t num_words = num/2;
   unsigned short crc;
 
-  crc = can_serial_crc_alg(word_data, num_words);
+  crc = can_crc_ccitt(0, data, num-2)^((data[num-2] << 8) | data[num-1]);
   crc_value[0] = (crc >> 8);
   crc_value[1] = crc;
 
-  return num_words;
+  return num/2;
 }
 
-unsigned short can_serial_crc_alg(unsigned short* data, size_t num) {
-  unsigned short shift, c, carry, crc = 0;
-  int i;
-
-  for (i = 0; i < num; ++i) {
-    shift = 0x8000;
-    c = (data[i] << 8) | (data[i] >> 8);
-
-    do {
-      carry = crc & 0x8000;
-      crc <<= 1;
+void can_serial_device_init(can_serial_device_t* dev, const char* name) {
+  serial_device_init(&dev->serial_dev, name);
+  dev->byte_time = 0.0;
+  
+  dev->buffer_pos = 0;
+  dev->buffer_num = 0;
+  
+  dev->timestamps = 0;
+  dev->timestamp = 0.0;
+  
+  error_init(&dev->error, can_serial_errors);
+}
 
-      if (c & shift)
-        ++crc;
-      if (carry)
-        crc ^= 0x1021;
+void can_serial_device_destroy(can_serial_device_t* dev) {
+  serial_device_destroy(&dev->serial_dev);
+  error_destroy(&dev->error);
+}
 
-      shift >>= 1;
+int can_serial_device_read(can_serial_device_t* dev, unsigned char* data,
+    size_t num, double timeout) {
+  struct timespec start, time;
+  struct timeval select_time;
+  fd_set set;
+  size_t i = 0, n;
+  ssize_t result;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (i < num) {
+    if (dev->buffer_pos == dev->buffer_num) {
+      clock_gettime(CLOCK_MONOTONIC, &time);
+      double remaining = timeout-(time.tv_sec-start.tv_sec)-
+        (time.tv_nsec-start.tv_nsec)*1e-9;
+      
+      if (remaining < 0.0)
+        remaining = 0.0;
+      select_time.tv_sec = remaining;
+      select_time.tv_usec = (remaining-select_time.tv_sec)*1e6;
+      
+      FD_ZERO(&set);
+      FD_SET(dev->serial_dev.fd, &set);
+      
+      result = select(dev->serial_dev.fd+1, &set, 0, 0, &select_time);
+      if (result == 0) {
+        error_set(&dev->error, CAN_SERIAL_ERROR_TIMEOUT);
+        return -dev->error.code;
+      }
+      else if (result > 0)
+        result = read(dev->serial_dev.fd, dev->buffer,
+          CAN_SERIAL_BUFFER_SIZE);
+      
+      if (result > 0) {
+        dev->buffer_pos = 0;
+        dev->buffer_num = result;
+      }
+      else if (result == 0) {
+        error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE,
+          "End of file");
+        return -dev->error.code;
+      }
+      else if (errno != EINTR) {
+        error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE, "%s",
+          strerror(errno));
+        return -dev->error.code;
+      }
     }
-    while (shift);
+
+    n = dev->buffer_num-dev->buffer_pos;
+    if (n > num-i)
+      n = num-i;
+    memcpy(&data[i], &dev->buffer[dev->buffer_pos], n);
+    
+    dev->buffer_pos += n;
+    i += n;
   }
 
-  return crc;
+  return i;
 }
 
-void can_serial_device_init(can_serial_device_t* dev, const char* name) {
-  serial_device_init(&dev->serial_dev, name);
-  error_init(&dev->error, can_serial_errors);
+int can_serial_device_read_ack(can_serial_device_t* dev, double timeout) {
+  unsigned char buffer;
+  
+  if (can_serial_device_read(dev, &buffer, 1, timeout) < 0)
+    return dev->error.code;
+
+  if (buffer == CAN_SERIAL_ACK_FAILED)
+    error_setf(&dev->error, CAN_SERIAL_ERROR_SEND,
+      "Send acknowledge failed");
+  else if (buffer != CAN_SERIAL_ACK_OKAY)
+    error_setf(&dev->error, CAN_SERIAL_ERROR_SEND,
+      "Unexpected response: 0x%02x", buffer);
+
+  return dev->error.code;
 }
 
-void can_serial_device_destroy(can_serial_device_t* dev) {
-  serial_device_destroy(&dev->serial_dev);
-  error_destroy(&dev->error);
+int can_serial_device_request(can_serial_device_t* dev, unsigned char* data,
+    size_t num, unsigned char* response) {
+  unsigned int abort;
+  int result;
+
+  can_serial_change_byte_order(data, num);
+  if ((can_serial_device_send(dev, data, num) < 0) ||
+      ((result = can_serial_device_receive(dev, response)) < 0))
+    return -dev->error.code;
+
+  can_serial_change_word_order(response, result);
+  can_serial_change_byte_order(response, result);
+
+  if (result < 8) {
+    error_setf(&dev->error, CAN_SERIAL_ERROR_RECEIVE,
+      "Invalid response length: %d", result);
+    return -dev->error.code;
+  }
+
+  abort = response[2] | (response[3] << 8) | (response[4] << 16) |
+    (response[5] << 24);
+  if (abort) {
+    error_setf(&dev->error, CAN_SERIAL_ERROR_ABORT,
+      "Abort code: 0x%08x", abort);
+    return -dev->error.code;
+  }
+
+  return result;
 }
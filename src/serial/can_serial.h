@@ -68,6 +68,15 @@
 #define CAN_SERIAL_ACK_FAILED                   0x46
 //@}
 
+/** \name Segment Control
+  * \brief Predefined CAN-Serial segment control byte masks
+  */
+//@{
+#define CAN_SERIAL_SEGMENT_LENGTH               0x3F
+#define CAN_SERIAL_SEGMENT_TOGGLE               0x40
+#define CAN_SERIAL_SEGMENT_MORE                 0x80
+//@}
+
 /** \name Error Codes
   * \brief Predefined CAN-Serial error codes
   */
@@ -82,8 +91,24 @@
 //!< Failed to receive from CAN-Serial device
 #define CAN_SERIAL_ERROR_CRC                    4
 //!< CAN-Serial checksum error
+#define CAN_SERIAL_ERROR_TIMEOUT                5
+//!< CAN-Serial device timeout
+#define CAN_SERIAL_ERROR_ABORT                  6
+//!< CAN-Serial transfer aborted
 //@}
 
+/** \brief Size of the CAN-Serial read-ahead buffer in [byte]
+  */
+#define CAN_SERIAL_BUFFER_SIZE                  256
+
+/** \brief Maximum size of a CAN-Serial data frame in [byte]
+  */
+#define CAN_SERIAL_FRAME_SIZE                   516
+
+/** \brief Maximum number of data bytes in a CAN-Serial segment
+  */
+#define CAN_SERIAL_SEGMENT_SIZE                 CAN_SERIAL_SEGMENT_LENGTH
+
 /** \brief Predefined CAN-Serial error descriptions
   */
 extern const char* can_serial_errors[];
@@ -92,6 +117,15 @@ extern const char* can_serial_errors[];
   */
 typedef struct can_serial_device_t {
   serial_device_t serial_dev;   //!< Serial device.
+  double byte_time;             //!< Transmission time of a character in [s].
+
+  unsigned char buffer[CAN_SERIAL_BUFFER_SIZE];
+  //!< Read-ahead buffer of the device.
+  size_t buffer_pos;            //!< Position of the next buffered byte.
+  size_t buffer_num;            //!< Number of bytes in the buffer.
+  
+  int timestamps;               //!< Flag enabling frame timestamps.
+  double timestamp;             //!< Completion time of the last frame in [s].
   
   error_t error;                //!< The most recent device error.
 } can_serial_device_t;
@@ -132,6 +166,10 @@ int can_serial_device_to_epos(
   * \param[in] num The size of the serial data frame to be sent.
   * \return The number of bytes sent to the CAN-Serial device or the
   *   negative error code.
+  * 
+  * Any stale data remaining in the read-ahead buffer is discarded before
+  * the frame is sent. Each acknowledge is awaited for the communication
+  * timeout plus the transmission time of the preceding data.
   */
 int can_serial_device_send(
   can_serial_device_t* dev,
@@ -141,14 +179,83 @@ int can_serial_device_send(
 /** \brief Receive serial data from a CAN device
   * \param[in] dev The open CAN-Serial device to reveice data from.
   * \param[out] data An array representing the serial data frame received
-  *   via an EPOS RS232 connection.
+  *   via an EPOS RS232 connection, providing space for at least
+  *   CAN_SERIAL_FRAME_SIZE bytes.
   * \return The number of bytes received from the CAN-Serial device or the
   *   negative error code.
+  * 
+  * The frame is fetched through the read-ahead buffer of the device, such
+  * that its payload is usually transferred by a single read. Rather than
+  * applying the communication timeout to each character, the payload must
+  * arrive within the communication timeout plus its transmission time.
+  * If timestamps are enabled, the time the frame has been completely read
+  * is recorded as the device's timestamp.
   */
 int can_serial_device_receive(
   can_serial_device_t* dev,
   unsigned char* data);
 
+/** \brief Receive serial data from a CAN device without blocking
+  * \param[in] dev The open CAN-Serial device to reveice data from.
+  * \param[out] data An array representing the serial data frame received
+  *   via an EPOS RS232 connection, providing space for at least
+  *   CAN_SERIAL_FRAME_SIZE bytes.
+  * \return The number of bytes received from the CAN-Serial device, zero
+  *   if no frame is pending, or the negative error code.
+  * 
+  * The function returns immediately unless the first character of a
+  * frame has arrived. Then, the frame is completed as by
+  * can_serial_device_receive(), which involves the acknowledge handshake
+  * and blocks until the remaining characters have been transmitted.
+  */
+int can_serial_device_try_receive(
+  can_serial_device_t* dev,
+  unsigned char* data);
+
+/** \brief Read an object from a CAN device using segmented transfer
+  * \param[in] dev The open CAN-Serial device to read the object from.
+  * \param[in] node_id The identifier of the CAN node to read from.
+  * \param[in] index The index of the object to be read.
+  * \param[in] subindex The subindex of the object to be read.
+  * \param[out] data An array to store the object data.
+  * \param[in] num The size of the data array.
+  * \return The number of bytes read from the CAN-Serial device or the
+  *   negative error code.
+  * 
+  * The object is transferred in segments of up to CAN_SERIAL_SEGMENT_SIZE
+  * bytes, each requiring a single request/response cycle. An error is
+  * returned without reading any segments if the object is larger than
+  * the data array.
+  */
+int can_serial_device_read_segmented(
+  can_serial_device_t* dev,
+  unsigned char node_id,
+  unsigned short index,
+  unsigned char subindex,
+  unsigned char* data,
+  size_t num);
+
+/** \brief Write an object to a CAN device using segmented transfer
+  * \param[in] dev The open CAN-Serial device to write the object to.
+  * \param[in] node_id The identifier of the CAN node to write to.
+  * \param[in] index The index of the object to be written.
+  * \param[in] subindex The subindex of the object to be written.
+  * \param[in] data An array containing the object data.
+  * \param[in] num The number of bytes in the data array.
+  * \return The number of bytes written to the CAN-Serial device or the
+  *   negative error code.
+  * 
+  * The object is transferred in segments of up to CAN_SERIAL_SEGMENT_SIZE
+  * bytes, each requiring a single request/response cycle.
+  */
+int can_serial_device_write_segmented(
+  can_serial_device_t* dev,
+  unsigned char node_id,
+  unsigned short index,
+  unsigned char subindex,
+  const unsigned char* data,
+  size_t num);
+
 /** \brief Change the order of bytes in serial data frames
   * \param[in,out] data An array of bytes representing the serial data frame
   *   for which to change the order.
@@ -183,22 +290,14 @@ size_t can_serial_change_word_order(
   * \param[out] crc_value An array of two bytes to store the CRC-word.
   * \return The number of words built from the array.
   * 
-  * Calculation has to include all bytes in the data frame. Internally,
-  * the array is transformed to an array of words in order to calculate the
-  * CRC. The CRC word is then tranformed back to an array of characters.
+  * Calculation has to include all bytes in the data frame, where the
+  * final two bytes hold either the checksum to be verified or zeros. The
+  * frame is passed to can_crc_ccitt() as a stream of bytes. A valid
+  * frame yields a zero checksum.
   */
 size_t can_serial_calc_crc(
   unsigned char* data,
   size_t num,
   unsigned char* crc_value);
 
-/** \brief Implementation of the CRC-CCITT algorithm
-  * \param[in] data An array of words containing the serial data frame.
-  * \param[in] num The number of words in the data frame.
-  * \return The calculated CRC-value.
-  */
-unsigned short can_serial_crc_alg(
-  unsigned short* data,
-  size_t num);
-
 #endif
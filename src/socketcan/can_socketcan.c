@@ -0,0 +1,718 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+
+/* Keep glibc from defining error_t, which is provided by tulibs */
+#define __error_t_defined 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can/raw.h>
+
+#include <string/string.h>
+
+#include "can_socketcan.h"
+
+#define CAN_SOCKETCAN_BATCH_SIZE_MAX       64
+
+const char* can_socketcan_errors[] = {
+  "Success",
+  "Failed to open CAN-SocketCAN device",
+  "Failed to close CAN-SocketCAN device",
+  "Failed to set CAN-SocketCAN device parameters",
+  "CAN-SocketCAN device timeout",
+  "Failed to send to CAN-SocketCAN device",
+  "Failed to receive from CAN-SocketCAN device",
+};
+
+config_param_t can_socketcan_default_parameters[] = {
+  {CAN_SOCKETCAN_PARAMETER_DEVICE,
+    config_param_type_string,
+    "can0",
+    "",
+    "Name of the CAN network interface of the CAN-SocketCAN device"},
+  {CAN_SOCKETCAN_PARAMETER_BATCH_SIZE,
+    config_param_type_int,
+    "16",
+    "[1, 64]",
+    "The maximum number of CAN frames transferred by a single system call"},
+  {CAN_SOCKETCAN_PARAMETER_TIMEOUT,
+    config_param_type_float,
+    "0.01",
+    "",
+    "The CAN bus communication timeout in [s]"},
+};
+
+const config_default_t can_socketcan_default_config = {
+  can_socketcan_default_parameters,
+  sizeof(can_socketcan_default_parameters)/sizeof(config_param_t),
+};
+
+int can_socketcan_open(can_device_t* dev);
+int can_socketcan_close(can_device_t* dev);
+int can_socketcan_send_message(can_device_t* dev, const can_message_t* message);
+int can_socketcan_receive_message(can_device_t* dev, can_message_t* message);
+int can_socketcan_set_filters(can_device_t* dev);
+int can_socketcan_send_messages(can_device_t* dev, const can_message_t*
+  messages, size_t num);
+int can_socketcan_receive_messages(can_device_t* dev, can_message_t*
+  messages, size_t num);
+int can_socketcan_get_fd(can_device_t* dev);
+int can_socketcan_try_send_message(can_device_t* dev, const can_message_t*
+  message);
+int can_socketcan_try_receive_message(can_device_t* dev, can_message_t*
+  message);
+
+const can_backend_t can_backend = {
+  "socketcan",
+  "CAN-SocketCAN",
+  &can_socketcan_default_config,
+  can_socketcan_open,
+  can_socketcan_close,
+  can_socketcan_send_message,
+  can_socketcan_receive_message,
+  can_socketcan_set_filters,
+  can_socketcan_send_messages,
+  can_socketcan_receive_messages,
+  0,
+  can_socketcan_get_fd,
+  can_socketcan_try_send_message,
+  can_socketcan_try_receive_message,
+};
+
+void can_socketcan_device_init(can_socketcan_device_t* dev);
+void can_socketcan_device_destroy(can_socketcan_device_t* dev);
+int can_socketcan_device_transmit(can_socketcan_device_t* dev, const
+  can_message_t* messages, size_t num, double timeout);
+int can_socketcan_device_fetch(can_socketcan_device_t* dev, can_message_t*
+  messages, size_t num, double timeout);
+size_t can_socketcan_device_write(can_socketcan_device_t* dev, size_t num,
+  const struct timespec* deadline);
+int can_socketcan_device_read(can_socketcan_device_t* dev, const struct
+  timespec* deadline);
+void can_socketcan_device_get_deadline(double timeout, struct timespec*
+  deadline);
+int can_socketcan_device_wait(can_socketcan_device_t* dev, short events,
+  const struct timespec* deadline);
+
+int can_socketcan_open(can_device_t* dev) {
+  error_clear(&dev->error);
+
+  if (!dev->num_references) {
+    dev->comm_dev = malloc(sizeof(can_socketcan_device_t));
+    can_socketcan_device_init(dev->comm_dev);
+    ((can_socketcan_device_t*)dev->comm_dev)->timestamps = dev->timestamps;
+
+    if (can_socketcan_device_open(dev->comm_dev,
+        config_get_string(&dev->config, CAN_SOCKETCAN_PARAMETER_DEVICE)) ||
+      can_socketcan_device_set_filters(dev->comm_dev, dev->filters,
+        dev->num_filters) ||
+      can_socketcan_device_setup(dev->comm_dev,
+        config_get_int(&dev->config, CAN_SOCKETCAN_PARAMETER_BATCH_SIZE),
+        config_get_float(&dev->config, CAN_SOCKETCAN_PARAMETER_TIMEOUT))) {
+      error_blame(&dev->error,
+        &((can_socketcan_device_t*)dev->comm_dev)->error, CAN_ERROR_OPEN);
+
+      can_socketcan_device_close(dev->comm_dev);
+      can_socketcan_device_destroy(dev->comm_dev);
+
+      free(dev->comm_dev);
+      dev->comm_dev = 0;
+
+      return dev->error.code;
+    }
+  }
+  ++dev->num_references;
+
+  return dev->error.code;
+}
+
+int can_socketcan_close(can_device_t* dev) {
+  error_clear(&dev->error);
+
+  if (dev->num_references) {
+    --dev->num_references;
+
+    if (!dev->num_references) {
+      if (!can_socketcan_device_close(dev->comm_dev)) {
+        can_socketcan_device_destroy(dev->comm_dev);
+
+        free(dev->comm_dev);
+        dev->comm_dev = 0;
+      }
+      else
+        error_blame(&dev->error,
+          &((can_socketcan_device_t*)dev->comm_dev)->error, CAN_ERROR_CLOSE);
+    }
+  }
+  else
+    error_setf(&dev->error, CAN_ERROR_CLOSE, "Non-zero reference count");
+
+  return dev->error.code;
+}
+
+int can_socketcan_send_message(can_device_t* dev, const can_message_t* message) {
+  error_clear(&dev->send_error);
+
+  if (dev->comm_dev) {
+    if (can_socketcan_device_send(dev->comm_dev, message, 1) < 0)
+      error_blame(&dev->send_error,
+        &((can_socketcan_device_t*)dev->comm_dev)->send_error,
+        CAN_ERROR_SEND);
+  }
+  else
+    error_setf(&dev->send_error, CAN_ERROR_SEND,
+      "Communication device unavailable");
+
+  return dev->send_error.code;
+}
+
+int can_socketcan_receive_message(can_device_t* dev, can_message_t* message) {
+  error_clear(&dev->receive_error);
+
+  if (dev->comm_dev) {
+    if (can_socketcan_device_receive(dev->comm_dev, message, 1) < 0)
+      error_blame(&dev->receive_error,
+        &((can_socketcan_device_t*)dev->comm_dev)->receive_error,
+        CAN_ERROR_RECEIVE);
+  }
+  else
+    error_setf(&dev->receive_error, CAN_ERROR_RECEIVE,
+      "Communication device unavailable");
+
+  return dev->receive_error.code;
+}
+
+int can_socketcan_set_filters(can_device_t* dev) {
+  error_clear(&dev->error);
+
+  if (dev->comm_dev) {
+    if (can_socketcan_device_set_filters(dev->comm_dev, dev->filters,
+        dev->num_filters))
+      error_blame(&dev->error,
+        &((can_socketcan_device_t*)dev->comm_dev)->error, CAN_ERROR_SETUP);
+  }
+  else
+    error_setf(&dev->error, CAN_ERROR_SETUP,
+      "Communication device unavailable");
+
+  return dev->error.code;
+}
+
+int can_socketcan_send_messages(can_device_t* dev, const can_message_t*
+    messages, size_t num) {
+  int result = -CAN_ERROR_SEND;
+  
+  error_clear(&dev->send_error);
+
+  if (dev->comm_dev) {
+    result = can_socketcan_device_send(dev->comm_dev, messages, num);
+    if (((can_socketcan_device_t*)dev->comm_dev)->send_error.code)
+      error_blame(&dev->send_error,
+        &((can_socketcan_device_t*)dev->comm_dev)->send_error,
+        CAN_ERROR_SEND);
+  }
+  else
+    error_setf(&dev->send_error, CAN_ERROR_SEND,
+      "Communication device unavailable");
+
+  return (result < 0) ? -dev->send_error.code : result;
+}
+
+int can_socketcan_receive_messages(can_device_t* dev, can_message_t*
+    messages, size_t num) {
+  int result = -CAN_ERROR_RECEIVE;
+  
+  error_clear(&dev->receive_error);
+
+  if (dev->comm_dev) {
+    if ((result = can_socketcan_device_receive(dev->comm_dev, messages,
+        num)) < 0)
+      error_blame(&dev->receive_error,
+        &((can_socketcan_device_t*)dev->comm_dev)->receive_error,
+        CAN_ERROR_RECEIVE);
+  }
+  else
+    error_setf(&dev->receive_error, CAN_ERROR_RECEIVE,
+      "Communication device unavailable");
+
+  return (result < 0) ? -dev->receive_error.code : result;
+}
+
+int can_socketcan_get_fd(can_device_t* dev) {
+  error_clear(&dev->error);
+
+  if (!dev->comm_dev) {
+    error_setf(&dev->error, CAN_ERROR_SETUP,
+      "Communication device unavailable");
+    return -dev->error.code;
+  }
+
+  return ((can_socketcan_device_t*)dev->comm_dev)->fd;
+}
+
+int can_socketcan_try_send_message(can_device_t* dev, const can_message_t*
+    message) {
+  can_socketcan_device_t* socketcan_dev = dev->comm_dev;
+  
+  error_clear(&dev->send_error);
+
+  if (socketcan_dev) {
+    if (can_socketcan_device_try_send(socketcan_dev, message, 1) < 0) {
+      if (socketcan_dev->send_error.code == CAN_SOCKETCAN_ERROR_TIMEOUT)
+        error_set(&dev->send_error, CAN_ERROR_WOULD_BLOCK);
+      else
+        error_blame(&dev->send_error, &socketcan_dev->send_error,
+          CAN_ERROR_SEND);
+    }
+  }
+  else
+    error_setf(&dev->send_error, CAN_ERROR_SEND,
+      "Communication device unavailable");
+
+  return dev->send_error.code;
+}
+
+int can_socketcan_try_receive_message(can_device_t* dev, can_message_t*
+    message) {
+  can_socketcan_device_t* socketcan_dev = dev->comm_dev;
+  
+  error_clear(&dev->receive_error);
+
+  if (socketcan_dev) {
+    if (can_socketcan_device_try_receive(socketcan_dev, message, 1) < 0) {
+      if (socketcan_dev->receive_error.code == CAN_SOCKETCAN_ERROR_TIMEOUT)
+        error_set(&dev->receive_error, CAN_ERROR_WOULD_BLOCK);
+      else
+        error_blame(&dev->receive_error, &socketcan_dev->receive_error,
+          CAN_ERROR_RECEIVE);
+    }
+  }
+  else
+    error_setf(&dev->receive_error, CAN_ERROR_RECEIVE,
+      "Communication device unavailable");
+
+  return dev->receive_error.code;
+}
+
+void can_socketcan_device_init(can_socketcan_device_t* dev) {
+  dev->fd = -1;
+  dev->name = 0;
+
+  dev->batch_size = 0;
+  dev->timeout = 0.0;
+
+  dev->send_frames = 0;
+  dev->frames = 0;
+  dev->num_frames = 0;
+  dev->next_frame = 0;
+
+  dev->timestamps = 0;
+  dev->batch_time = 0.0;
+
+  error_init(&dev->error, can_socketcan_errors);
+  error_init(&dev->send_error, can_socketcan_errors);
+  error_init(&dev->receive_error, can_socketcan_errors);
+}
+
+void can_socketcan_device_destroy(can_socketcan_device_t* dev) {
+  if (dev->send_frames) {
+    free(dev->send_frames);
+    dev->send_frames = 0;
+  }
+  if (dev->frames) {
+    free(dev->frames);
+    dev->frames = 0;
+  }
+
+  string_destroy(&dev->name);
+  error_destroy(&dev->error);
+  error_destroy(&dev->send_error);
+  error_destroy(&dev->receive_error);
+}
+
+int can_socketcan_device_open(can_socketcan_device_t* dev, const char* name) {
+  struct sockaddr_can address;
+  struct ifreq request;
+
+  error_clear(&dev->error);
+
+  if (strlen(name) >= IFNAMSIZ) {
+    error_setf(&dev->error, CAN_SOCKETCAN_ERROR_OPEN,
+      "Invalid interface name: %s", name);
+    return dev->error.code;
+  }
+
+  if ((dev->fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW)) < 0) {
+    error_setf(&dev->error, CAN_SOCKETCAN_ERROR_OPEN, "%s",
+      strerror(errno));
+    return dev->error.code;
+  }
+
+  memset(&request, 0, sizeof(request));
+  strcpy(request.ifr_name, name);
+
+  memset(&address, 0, sizeof(address));
+  address.can_family = AF_CAN;
+
+  if (ioctl(dev->fd, SIOCGIFINDEX, &request) < 0) {
+    error_setf(&dev->error, CAN_SOCKETCAN_ERROR_OPEN, "%s: %s", name,
+      strerror(errno));
+    return dev->error.code;
+  }
+  address.can_ifindex = request.ifr_ifindex;
+
+  if (bind(dev->fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    error_setf(&dev->error, CAN_SOCKETCAN_ERROR_OPEN, "%s: %s", name,
+      strerror(errno));
+    return dev->error.code;
+  }
+  string_copy(&dev->name, name);
+
+  return dev->error.code;
+}
+
+int can_socketcan_device_set_filters(can_socketcan_device_t* dev, const
+    can_filter_t* filters, size_t num) {
+  struct can_filter all = {0, CAN_EFF_FLAG | CAN_RTR_FLAG};
+  struct can_filter* raw_filters = &all;
+  size_t i;
+
+  error_clear(&dev->error);
+
+  if (num) {
+    raw_filters = malloc(num*sizeof(struct can_filter));
+    for (i = 0; i < num; ++i) {
+      raw_filters[i].can_id = filters[i].id & CAN_SFF_MASK;
+      raw_filters[i].can_mask = (filters[i].mask & CAN_SFF_MASK) |
+        CAN_EFF_FLAG | CAN_RTR_FLAG;
+    }
+  }
+  
+  if (setsockopt(dev->fd, SOL_CAN_RAW, CAN_RAW_FILTER, raw_filters,
+      (num ? num : 1)*sizeof(struct can_filter)) < 0)
+    error_setf(&dev->error, CAN_SOCKETCAN_ERROR_SETUP, "%s",
+      strerror(errno));
+  
+  if (num)
+    free(raw_filters);
+  
+  return dev->error.code;
+}
+
+int can_socketcan_device_close(can_socketcan_device_t* dev) {
+  error_clear(&dev->error);
+
+  if (dev->fd >= 0) {
+    if (!close(dev->fd)) {
+      dev->fd = -1;
+
+      dev->num_frames = 0;
+      dev->next_frame = 0;
+    }
+    else
+      error_setf(&dev->error, CAN_SOCKETCAN_ERROR_CLOSE, "%s",
+        strerror(errno));
+  }
+
+  return dev->error.code;
+}
+
+int can_socketcan_device_setup(can_socketcan_device_t* dev, size_t
+    batch_size, double timeout) {
+  error_clear(&dev->error);
+
+  if (!batch_size || (batch_size > CAN_SOCKETCAN_BATCH_SIZE_MAX)) {
+    error_setf(&dev->error, CAN_SOCKETCAN_ERROR_SETUP,
+      "Invalid batch size: %d", (int)batch_size);
+    return dev->error.code;
+  }
+
+  dev->send_frames = realloc(dev->send_frames,
+    batch_size*sizeof(struct can_frame));
+  dev->frames = realloc(dev->frames, batch_size*sizeof(struct can_frame));
+  dev->num_frames = 0;
+  dev->next_frame = 0;
+
+  dev->batch_size = batch_size;
+  dev->timeout = timeout;
+
+  return dev->error.code;
+}
+
+int can_socketcan_device_send(can_socketcan_device_t* dev, const
+    can_message_t* messages, size_t num) {
+  return can_socketcan_device_transmit(dev, messages, num, dev->timeout);
+}
+
+int can_socketcan_device_try_send(can_socketcan_device_t* dev, const
+    can_message_t* messages, size_t num) {
+  return can_socketcan_device_transmit(dev, messages, num, 0.0);
+}
+
+int can_socketcan_device_receive(can_socketcan_device_t* dev, can_message_t*
+    messages, size_t num) {
+  return can_socketcan_device_fetch(dev, messages, num, dev->timeout);
+}
+
+int can_socketcan_device_try_receive(can_socketcan_device_t* dev,
+    can_message_t* messages, size_t num) {
+  return can_socketcan_device_fetch(dev, messages, num, 0.0);
+}
+
+struct can_frame* can_socketcan_device_lend_frames(can_socketcan_device_t*
+    dev) {
+  return dev->send_frames;
+}
+
+int can_socketcan_device_send_frames(can_socketcan_device_t* dev, size_t
+    num) {
+  struct timespec deadline;
+  size_t num_sent;
+
+  error_clear(&dev->send_error);
+
+  if (num > dev->batch_size) {
+    error_setf(&dev->send_error, CAN_SOCKETCAN_ERROR_SEND,
+      "Number of frames exceeds batch size: %d", (int)num);
+    return -dev->send_error.code;
+  }
+
+  can_socketcan_device_get_deadline(dev->timeout, &deadline);
+  num_sent = can_socketcan_device_write(dev, num, &deadline);
+  
+  if (!num_sent && dev->send_error.code)
+    return -dev->send_error.code;
+
+  return num_sent;
+}
+
+int can_socketcan_device_receive_frames(can_socketcan_device_t* dev, const
+    struct can_frame** frames) {
+  struct timespec deadline;
+  int result;
+
+  error_clear(&dev->receive_error);
+
+  if (dev->next_frame >= dev->num_frames) {
+    can_socketcan_device_get_deadline(dev->timeout, &deadline);
+    if ((result = can_socketcan_device_read(dev, &deadline)) < 0)
+      return result;
+  }
+
+  *frames = &dev->frames[dev->next_frame];
+  result = dev->num_frames-dev->next_frame;
+  dev->next_frame = dev->num_frames;
+
+  return result;
+}
+
+int can_socketcan_device_transmit(can_socketcan_device_t* dev, const
+    can_message_t* messages, size_t num, double timeout) {
+  struct can_frame* frames = dev->send_frames;
+  struct timespec deadline;
+  size_t i, num_batch, num_written, num_sent = 0;
+
+  error_clear(&dev->send_error);
+
+  can_socketcan_device_get_deadline(timeout, &deadline);
+
+  while (num_sent < num) {
+    num_batch = num-num_sent;
+    if (num_batch > dev->batch_size)
+      num_batch = dev->batch_size;
+
+    for (i = 0; i < num_batch; ++i) {
+      const can_message_t* message = &messages[num_sent+i];
+
+      memset(&frames[i], 0, sizeof(struct can_frame));
+      frames[i].can_id = message->id & CAN_SFF_MASK;
+      frames[i].can_dlc = (message->length < CAN_MAX_DLEN) ?
+        message->length : CAN_MAX_DLEN;
+      memcpy(frames[i].data, message->content, frames[i].can_dlc);
+    }
+
+    num_written = can_socketcan_device_write(dev, num_batch, &deadline);
+    num_sent += num_written;
+    if (num_written < num_batch)
+      break;
+  }
+  
+  if (!num_sent && dev->send_error.code)
+    return -dev->send_error.code;
+
+  return num_sent;
+}
+
+int can_socketcan_device_fetch(can_socketcan_device_t* dev, can_message_t*
+    messages, size_t num, double timeout) {
+  struct timespec deadline;
+  size_t num_received = 0;
+  int result;
+
+  error_clear(&dev->receive_error);
+
+  can_socketcan_device_get_deadline(timeout, &deadline);
+
+  /* Batches holding only dropped frames are followed by the next batch. */
+  while (num && !num_received) {
+    if ((dev->next_frame >= dev->num_frames) &&
+        ((result = can_socketcan_device_read(dev, &deadline)) < 0))
+      return result;
+
+    while ((num_received < num) && (dev->next_frame < dev->num_frames)) {
+      struct can_frame* frame = &dev->frames[dev->next_frame++];
+      can_message_t* message = &messages[num_received];
+
+      /* Extended, remote, and error frames would alias standard ones. */
+      if (frame->can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG))
+        continue;
+      
+      message->id = frame->can_id & CAN_SFF_MASK;
+      message->length = (frame->can_dlc < CAN_MAX_DLEN) ?
+        frame->can_dlc : CAN_MAX_DLEN;
+      memcpy(message->content, frame->data, message->length);
+      message->timestamp = dev->timestamps ? dev->batch_time : 0.0;
+
+      ++num_received;
+    }
+  }
+
+  return num_received;
+}
+
+size_t can_socketcan_device_write(can_socketcan_device_t* dev, size_t num,
+    const struct timespec* deadline) {
+  struct iovec iov[CAN_SOCKETCAN_BATCH_SIZE_MAX];
+  struct mmsghdr headers[CAN_SOCKETCAN_BATCH_SIZE_MAX];
+  size_t i, num_sent = 0;
+  int result;
+
+  memset(headers, 0, sizeof(headers));
+  for (i = 0; i < num; ++i) {
+    iov[i].iov_base = &dev->send_frames[i];
+    iov[i].iov_len = sizeof(struct can_frame);
+    headers[i].msg_hdr.msg_iov = &iov[i];
+    headers[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (num_sent < num) {
+    if ((result = sendmmsg(dev->fd, &headers[num_sent], num-num_sent,
+        0)) > 0)
+      num_sent += result;
+    else if ((errno == EAGAIN) || (errno == ENOBUFS)) {
+      if (can_socketcan_device_wait(dev, POLLOUT, deadline))
+        break;
+    }
+    else {
+      error_setf(&dev->send_error, CAN_SOCKETCAN_ERROR_SEND, "%s",
+        strerror(errno));
+      break;
+    }
+  }
+
+  return num_sent;
+}
+
+int can_socketcan_device_read(can_socketcan_device_t* dev, const struct
+    timespec* deadline) {
+  struct iovec iov[CAN_SOCKETCAN_BATCH_SIZE_MAX];
+  struct mmsghdr headers[CAN_SOCKETCAN_BATCH_SIZE_MAX];
+  size_t i;
+  int result;
+
+  memset(headers, 0, sizeof(headers));
+  for (i = 0; i < dev->batch_size; ++i) {
+    iov[i].iov_base = &dev->frames[i];
+    iov[i].iov_len = sizeof(struct can_frame);
+    headers[i].msg_hdr.msg_iov = &iov[i];
+    headers[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while ((result = recvmmsg(dev->fd, headers, dev->batch_size,
+      MSG_DONTWAIT, 0)) <= 0) {
+    if ((result < 0) && (errno != EAGAIN)) {
+      error_setf(&dev->receive_error, CAN_SOCKETCAN_ERROR_RECEIVE, "%s",
+        strerror(errno));
+      return -dev->receive_error.code;
+    }
+    else if (can_socketcan_device_wait(dev, POLLIN, deadline))
+      return -dev->receive_error.code;
+  }
+
+  dev->num_frames = result;
+  dev->next_frame = 0;
+  
+  if (dev->timestamps)
+    dev->batch_time = can_get_time();
+
+  return result;
+}
+
+void can_socketcan_device_get_deadline(double timeout, struct timespec*
+    deadline) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += (time_t)timeout;
+  deadline->tv_nsec += (timeout-(time_t)timeout)*1e9;
+}
+
+int can_socketcan_device_wait(can_socketcan_device_t* dev, short events,
+    const struct timespec* deadline) {
+  error_t* error = (events & POLLIN) ? &dev->receive_error :
+    &dev->send_error;
+  struct pollfd set;
+  struct timespec time;
+  double timeout;
+  int result;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  timeout = (deadline->tv_sec-time.tv_sec)+
+    (deadline->tv_nsec-time.tv_nsec)*1e-9;
+
+  if (timeout <= 0.0) {
+    error_set(error, CAN_SOCKETCAN_ERROR_TIMEOUT);
+    return error->code;
+  }
+
+  time.tv_sec = timeout;
+  time.tv_nsec = (timeout-time.tv_sec)*1e9;
+
+  set.fd = dev->fd;
+  set.events = events;
+  set.revents = 0;
+
+  if ((result = ppoll(&set, 1, &time, 0)) == 0)
+    error_set(error, CAN_SOCKETCAN_ERROR_TIMEOUT);
+  else if ((result < 0) && (errno != EINTR))
+    error_setf(error, (events & POLLIN) ?
+      CAN_SOCKETCAN_ERROR_RECEIVE : CAN_SOCKETCAN_ERROR_SEND, "%s",
+      strerror(errno));
+
+  return error->code;
+}
@@ -0,0 +1,261 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef CAN_SOCKETCAN_H
+#define CAN_SOCKETCAN_H
+
+/**
+  *  \file can_socketcan.h
+  *  \brief CAN communication over Linux SocketCAN
+  *  \author Ralf Kaestner
+  *
+  *  This layer provides low-level mechanisms for CANopen communication via
+  *  raw PF_CAN sockets bound to in-kernel CAN network interfaces. Frames
+  *  are moved in batches using sendmmsg() and recvmmsg(), such that a
+  *  single system call may transfer many frames.
+  *
+  *  For testing without CAN hardware, a virtual CAN interface may be
+  *  created using
+  *  \code
+  *  ip link add dev vcan0 type vcan
+  *  ip link set up vcan0
+  *  \endcode
+  */
+
+#include <linux/can.h>
+
+#include "can.h"
+
+/** \name Parameters
+  * \brief Predefined CAN-SocketCAN parameters
+  */
+//@{
+#define CAN_SOCKETCAN_PARAMETER_DEVICE     "socketcan-dev"
+#define CAN_SOCKETCAN_PARAMETER_BATCH_SIZE "socketcan-batch-size"
+#define CAN_SOCKETCAN_PARAMETER_TIMEOUT    "socketcan-timeout"
+//@}
+
+/** \name Error Codes
+  * \brief Predefined CAN-SocketCAN error codes
+  */
+//@{
+#define CAN_SOCKETCAN_ERROR_NONE           0
+//!< Success
+#define CAN_SOCKETCAN_ERROR_OPEN           1
+//!< Failed to open CAN-SocketCAN device
+#define CAN_SOCKETCAN_ERROR_CLOSE          2
+//!< Failed to close CAN-SocketCAN device
+#define CAN_SOCKETCAN_ERROR_SETUP          3
+//!< Failed to set CAN-SocketCAN device parameters
+#define CAN_SOCKETCAN_ERROR_TIMEOUT        4
+//!< CAN-SocketCAN device timeout
+#define CAN_SOCKETCAN_ERROR_SEND           5
+//!< Failed to send to CAN-SocketCAN device
+#define CAN_SOCKETCAN_ERROR_RECEIVE        6
+//!< Failed to receive from CAN-SocketCAN device
+//@}
+
+/** \brief Predefined CAN-SocketCAN error descriptions
+  */
+extern const char* can_socketcan_errors[];
+
+/** \brief CAN-SocketCAN device structure
+  *
+  * The socket may be sent to and received from concurrently. Send and
+  * receive functions therefore report their errors separately, through
+  * the send and the receive error of the device, respectively. Other
+  * functions set the device error.
+  */
+typedef struct can_socketcan_device_t {
+  int fd;                       //!< Socket file descriptor.
+  char* name;                   //!< Network interface name.
+
+  size_t batch_size;            //!< Maximum number of frames per batch.
+  double timeout;               //!< Device poll timeout in [s].
+
+  struct can_frame* send_frames; //!< The batch of frames to be sent.
+  struct can_frame* frames;     //!< The batch of frames received.
+  size_t num_frames;            //!< The number of frames in the batch.
+  size_t next_frame;            //!< The index of the next frame to return.
+  
+  int timestamps;               //!< Flag enabling message timestamps.
+  double batch_time;            //!< Reception time of the batch in [s].
+
+  error_t error;                //!< The most recent device error.
+  error_t send_error;           //!< The most recent send error.
+  error_t receive_error;        //!< The most recent receive error.
+} can_socketcan_device_t;
+
+/** \brief Open the CAN-SocketCAN device with the specified name
+  * \param[in] dev The CAN-SocketCAN device to be opened.
+  * \param[in] name The name of the CAN network interface to be opened.
+  * \return The resulting error code.
+  */
+int can_socketcan_device_open(
+  can_socketcan_device_t* dev,
+  const char* name);
+
+/** \brief Close an open CAN-SocketCAN device
+  * \param[in] dev The open CAN-SocketCAN device to be closed.
+  * \return The resulting error code.
+  */
+int can_socketcan_device_close(
+  can_socketcan_device_t* dev);
+
+/** \brief Setup an already opened CAN-SocketCAN device
+  * \param[in] dev The open CAN-SocketCAN device to be set up.
+  * \param[in] batch_size The maximum number of frames to be transferred
+  *   by a single system call.
+  * \param[in] timeout The device poll timeout to be set in [s].
+  * \return The resulting error code.
+  */
+int can_socketcan_device_setup(
+  can_socketcan_device_t* dev,
+  size_t batch_size,
+  double timeout);
+
+/** \brief Set the message identifier filters of a CAN-SocketCAN device
+  * \param[in] dev The open CAN-SocketCAN device to set the filters for.
+  * \param[in] filters An array of filters, of which a received message
+  *   must pass at least one.
+  * \param[in] num The number of filters in the array. If zero, all
+  *   standard data frames will be received.
+  * \return The resulting error code.
+  *
+  * The filters are installed as CAN_RAW_FILTER socket option, such that
+  * the kernel discards unwanted frames before they are queued on the
+  * socket. Extended and remote frames never pass the filters, not even
+  * an empty set of them.
+  */
+int can_socketcan_device_set_filters(
+  can_socketcan_device_t* dev,
+  const can_filter_t* filters,
+  size_t num);
+
+/** \brief Send CANopen SDO messages over an open CAN-SocketCAN device
+  * \param[in] dev The open CAN-SocketCAN device to send the messages over.
+  * \param[in] messages An array of CANopen SDO messages to be sent over
+  *   the device.
+  * \param[in] num The number of messages in the array.
+  * \return The number of messages sent over the CAN-SocketCAN device or
+  *   the negative error code. If an error occurs after some messages
+  *   have been sent, their number is returned and the send error is set.
+  *
+  * The messages are encoded into the send batch of the device and
+  * submitted to the kernel in batches of at most the configured batch
+  * size, each batch using a single sendmmsg() call.
+  */
+int can_socketcan_device_send(
+  can_socketcan_device_t* dev,
+  const can_message_t* messages,
+  size_t num);
+
+/** \brief Receive CANopen SDO messages on an open CAN-SocketCAN device
+  * \param[in] dev The open CAN-SocketCAN device to receive the messages on.
+  * \param[out] messages An array of CANopen SDO messages received on the
+  *   device.
+  * \param[in] num The maximum number of messages to be received.
+  * \return The number of messages received on the CAN-SocketCAN device or
+  *   the negative error code.
+  *
+  * Frames are fetched from the kernel in batches using a single recvmmsg()
+  * call. Frames exceeding the requested number of messages are retained
+  * by the device and returned by subsequent calls. Extended, remote, and
+  * error frames are dropped, as they cannot be represented by a message.
+  * If timestamps are enabled, the messages carry the time their batch
+  * has been fetched.
+  */
+int can_socketcan_device_receive(
+  can_socketcan_device_t* dev,
+  can_message_t* messages,
+  size_t num);
+
+/** \brief Lend the send batch of an open CAN-SocketCAN device
+  * \param[in] dev The set up CAN-SocketCAN device to lend the batch of.
+  * \return The array of batch size frames which the caller may encode
+  *   in place and pass to can_socketcan_device_send_frames().
+  *
+  * The frames are submitted to the kernel from where they have been
+  * encoded, such that no message is converted or copied in between. The
+  * batch is shared with can_socketcan_device_send(), and the lent frames
+  * are therefore only valid until the next send call.
+  */
+struct can_frame* can_socketcan_device_lend_frames(
+  can_socketcan_device_t* dev);
+
+/** \brief Send frames encoded in the send batch of a CAN-SocketCAN device
+  * \param[in] dev The open CAN-SocketCAN device to send the frames over.
+  * \param[in] num The number of frames encoded at the beginning of the
+  *   batch, which must not exceed the batch size.
+  * \return The number of frames sent over the CAN-SocketCAN device or
+  *   the negative error code. If an error occurs after some frames have
+  *   been sent, their number is returned and the send error is set.
+  */
+int can_socketcan_device_send_frames(
+  can_socketcan_device_t* dev,
+  size_t num);
+
+/** \brief Receive frames in place on an open CAN-SocketCAN device
+  * \param[in] dev The open CAN-SocketCAN device to receive the frames on.
+  * \param[out] frames The frames received, which remain owned by the
+  *   device and are valid until the next receive call.
+  * \return The number of frames received on the CAN-SocketCAN device or
+  *   the negative error code.
+  *
+  * The frames pending in the receive batch, or otherwise those of a newly
+  * fetched batch, are lent to the caller as written by the kernel. Unlike
+  * can_socketcan_device_receive(), the function does not drop extended,
+  * remote, or error frames, whose flags the caller must check.
+  */
+int can_socketcan_device_receive_frames(
+  can_socketcan_device_t* dev,
+  const struct can_frame** frames);
+
+/** \brief Send CANopen SDO messages over a CAN-SocketCAN device without
+  *   blocking
+  * \param[in] dev The open CAN-SocketCAN device to send the messages over.
+  * \param[in] messages An array of CANopen SDO messages to be sent over
+  *   the device.
+  * \param[in] num The number of messages in the array.
+  * \return The number of messages sent over the CAN-SocketCAN device or
+  *   the negative error code. If the socket cannot accept any message,
+  *   the error code is CAN_SOCKETCAN_ERROR_TIMEOUT.
+  */
+int can_socketcan_device_try_send(
+  can_socketcan_device_t* dev,
+  const can_message_t* messages,
+  size_t num);
+
+/** \brief Receive CANopen SDO messages on a CAN-SocketCAN device without
+  *   blocking
+  * \param[in] dev The open CAN-SocketCAN device to receive the messages on.
+  * \param[out] messages An array of CANopen SDO messages received on the
+  *   device.
+  * \param[in] num The maximum number of messages to be received.
+  * \return The number of messages received on the CAN-SocketCAN device or
+  *   the negative error code. If neither the device nor the socket hold
+  *   a frame, the error code is CAN_SOCKETCAN_ERROR_TIMEOUT.
+  */
+int can_socketcan_device_try_receive(
+  can_socketcan_device_t* dev,
+  can_message_t* messages,
+  size_t num);
+
+#endif
@@ -22,9 +22,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
 #include <ftdi/ftdi.h>
 
+#include "can_crc.h"
+#include "can_epos.h"
+
 #include "can_usb.h"
 
 const char* can_usb_errors[] = {
@@ -34,10 +40,10 @@ const char* can_usb_errors[] = {
   "Failed to send to CAN-USB device",
   "Failed to receive from CAN-USB device",
   "CAN-USB checksum error",
+  "CAN-USB device timeout",
+  "CAN-USB event thread error",
 };
 
-const char* can_device_name = "CAN-USB";
-
 config_param_t can_usb_default_params[] = {
   {CAN_USB_PARAMETER_DEVICE,
     config_param_type_string,
@@ -89,25 +95,72 @@ config_param_t can_usb_default_params[] = {
     "0.001",
     "[0.001, 0.255]",
     "The CAN-USB serial communication latency in [s]"},
+  {CAN_USB_PARAMETER_LATENCY_IDLE,
+    config_param_type_float,
+    "0.0",
+    "[0.0, 0.255]",
+    "The CAN-USB serial communication latency in [s] while idle, values "
+    "above the latency enable adaptation of the latency timer"},
+  {CAN_USB_PARAMETER_ASYNC,
+    config_param_type_enum,
+    "off",
+    "off|on",
+    "Receive from the CAN-USB device by a dedicated event thread"},
 };
 
-const config_default_t can_default_config = {
+const config_default_t can_usb_default_config = {
   can_usb_default_params,
   sizeof(can_usb_default_params)/sizeof(config_param_t),
 };
 
+int can_usb_open(can_device_t* dev);
+int can_usb_close(can_device_t* dev);
+int can_usb_send_message(can_device_t* dev, const can_message_t* message);
+int can_usb_receive_message(can_device_t* dev, can_message_t* message);
+int can_usb_send_messages(can_device_t* dev, const can_message_t* messages,
+  size_t num);
+int can_usb_get_fd(can_device_t* dev);
+int can_usb_try_receive_message(can_device_t* dev, can_message_t* message);
+
+can_usb_cache_entry_t can_usb_cache[CAN_USB_CACHE_SIZE];
+pthread_mutex_t can_usb_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+const can_backend_t can_backend = {
+  "usb",
+  "CAN-USB",
+  &can_usb_default_config,
+  can_usb_open,
+  can_usb_close,
+  can_usb_send_message,
+  can_usb_receive_message,
+  0,
+  can_usb_send_messages,
+  0,
+  1,
+  can_usb_get_fd,
+  0,
+  can_usb_try_receive_message,
+};
+
 int can_usb_device_init(can_usb_device_t* dev, const char* name);
 void can_usb_device_destroy(can_usb_device_t* dev);
+int can_usb_device_rescan(can_usb_device_t* dev);
+int can_usb_device_parse(can_usb_device_t* dev, unsigned char byte);
+size_t can_usb_device_get_num_missing(can_usb_device_t* dev);
+int can_usb_device_read_frame(can_usb_device_t* dev, unsigned char* data);
+int can_usb_device_dequeue(can_usb_device_t* dev, unsigned char* data,
+  int wait);
+int can_usb_device_unpack(can_usb_device_t* dev, unsigned char* data,
+  size_t num);
+void* can_usb_device_run(void* arg);
+int can_usb_device_apply_latency(can_usb_device_t* dev, double latency);
 
-int can_device_open(can_device_t* dev) {
+int can_usb_open(can_device_t* dev) {
   error_clear(&dev->error);
     
   if (!dev->num_references) {
     dev->comm_dev = malloc(sizeof(can_usb_device_t));
 
-    dev->num_sent = 0;
-    dev->num_received = 0;
-
     can_usb_device_t* usb_dev = (can_usb_device_t*)dev->comm_dev;
     if (can_usb_device_init(dev->comm_dev,
         config_get_string(&dev->config, CAN_USB_PARAMETER_DEVICE))) {
@@ -121,9 +174,21 @@ int can_device_open(can_device_t* dev) {
       return dev->error.code;
     }
     
-    if (ftdi_device_open(usb_dev->ftdi_dev,
-        config_get_int(&dev->config, CAN_USB_PARAMETER_INTERFACE)) ||
-      ftdi_device_setup(usb_dev->ftdi_dev,
+    usb_dev->timestamps = dev->timestamps;
+    
+    if (can_usb_device_open(usb_dev,
+        config_get_int(&dev->config, CAN_USB_PARAMETER_INTERFACE))) {
+      error_blame(&dev->error, &usb_dev->error, CAN_ERROR_OPEN);
+      
+      can_usb_device_destroy(dev->comm_dev);
+      
+      free(dev->comm_dev);
+      dev->comm_dev = 0;
+      
+      return dev->error.code;
+    }
+    
+    if (can_usb_device_setup(usb_dev,
         config_get_int(&dev->config, CAN_USB_PARAMETER_BAUD_RATE),
         config_get_int(&dev->config, CAN_USB_PARAMETER_DATA_BITS),
         config_get_int(&dev->config, CAN_USB_PARAMETER_STOP_BITS),
@@ -131,9 +196,25 @@ int can_device_open(can_device_t* dev) {
         config_get_int(&dev->config, CAN_USB_PARAMETER_FLOW_CTRL),
         config_get_int(&dev->config, CAN_USB_PARAMETER_BREAK),
         config_get_float(&dev->config, CAN_USB_PARAMETER_TIMEOUT),
-        config_get_float(&dev->config, CAN_USB_PARAMETER_LATENCY))) {
-      error_blame(&dev->error, &usb_dev->ftdi_dev->error, CAN_ERROR_OPEN);
+        config_get_float(&dev->config, CAN_USB_PARAMETER_LATENCY),
+        config_get_float(&dev->config, CAN_USB_PARAMETER_LATENCY_IDLE))) {
+      error_blame(&dev->error, &usb_dev->error, CAN_ERROR_OPEN);
       
+      ftdi_device_close(usb_dev->ftdi_dev);
+      can_usb_device_destroy(dev->comm_dev);
+      
+      free(dev->comm_dev);
+      dev->comm_dev = 0;
+      
+      return dev->error.code;
+    }
+    
+    if (config_get_int(&dev->config, CAN_USB_PARAMETER_ASYNC) &&
+        can_usb_device_start(usb_dev,
+          config_get_float(&dev->config, CAN_USB_PARAMETER_TIMEOUT))) {
+      error_blame(&dev->error, &usb_dev->error, CAN_ERROR_OPEN);
+      
+      ftdi_device_close(usb_dev->ftdi_dev);
       can_usb_device_destroy(dev->comm_dev);
       
       free(dev->comm_dev);
@@ -147,7 +228,7 @@ int can_device_open(can_device_t* dev) {
   return dev->error.code;
 }
 
-int can_device_close(can_device_t* dev) {
+int can_usb_close(can_device_t* dev) {
   error_clear(&dev->error);
   
   if (dev->num_references) {
@@ -155,7 +236,8 @@ int can_device_close(can_device_t* dev) {
 
     if (!dev->num_references) {
       ftdi_device_t* ftdi_dev = ((can_usb_device_t*)dev->comm_dev)->ftdi_dev;
-        
+      
+      can_usb_device_stop(dev->comm_dev);
       if (!ftdi_device_close(ftdi_dev)) {
         can_usb_device_destroy(dev->comm_dev);
         
@@ -172,36 +254,96 @@ int can_device_close(can_device_t* dev) {
   return dev->error.code;
 }
 
-int can_device_send_message(can_device_t* dev, const can_message_t* message) {
-  unsigned char data[64];
+int can_usb_send_message(can_device_t* dev, const can_message_t* message) {
+  unsigned char data[CAN_USB_FRAME_SIZE];
   
-  error_clear(&dev->error);
+  error_clear(&dev->send_error);
 
   int result;
   if (((result = can_usb_device_from_epos(dev->comm_dev,
         message, data)) < 0) ||
       (can_usb_device_send(dev->comm_dev, data, result) < 0))
-    error_blame(&dev->error, &((can_usb_device_t*)dev->comm_dev)->error,
-      CAN_ERROR_SEND);
-  else
-    ++dev->num_sent;
+    error_blame(&dev->send_error,
+      &((can_usb_device_t*)dev->comm_dev)->error, CAN_ERROR_SEND);
 
-  return dev->error.code;
+  return dev->send_error.code;
 }
 
-int can_device_receive_message(can_device_t* dev, can_message_t* message) {
-  unsigned char data[64];
+int can_usb_send_messages(can_device_t* dev, const can_message_t* messages,
+    size_t num) {
+  can_usb_device_t* usb_dev = dev->comm_dev;
+  unsigned char data[CAN_USB_FRAME_SIZE];
+  size_t i = 0, num_sent = 0;
+  int result = 0;
 
-  error_clear(&dev->error);
+  error_clear(&dev->send_error);
+
+  while ((i < num) && !dev->send_error.code) {
+    if (((result = can_usb_device_from_epos(usb_dev, &messages[i],
+          data)) < 0) ||
+        ((result = can_usb_device_queue(usb_dev, data, result)) < 0))
+      error_blame(&dev->send_error, &usb_dev->error, CAN_ERROR_SEND);
+    else if (result)
+      ++i;
+    
+    if (usb_dev->num_queued && ((result <= 0) || (i == num))) {
+      if ((result = can_usb_device_flush(usb_dev)) >= 0)
+        num_sent += result;
+      else if (!dev->send_error.code)
+        error_blame(&dev->send_error, &usb_dev->error, CAN_ERROR_SEND);
+    }
+  }
+
+  return (num_sent || !dev->send_error.code) ? num_sent :
+    -dev->send_error.code;
+}
+
+int can_usb_receive_message(can_device_t* dev, can_message_t* message) {
+  unsigned char data[CAN_USB_FRAME_SIZE];
+
+  error_clear(&dev->receive_error);
   
   if ((can_usb_device_receive(dev->comm_dev, data) < 0) ||
       can_usb_device_to_epos(dev->comm_dev, data, message))
-    error_blame(&dev->error, &((can_usb_device_t*)dev->comm_dev)->error,
-      CAN_ERROR_RECEIVE);
-  else
-    ++dev->num_received;
+    error_blame(&dev->receive_error,
+      &((can_usb_device_t*)dev->comm_dev)->error, CAN_ERROR_RECEIVE);
+  else if (dev->timestamps)
+    message->timestamp = ((can_usb_device_t*)dev->comm_dev)->timestamp;
   
-  return dev->error.code;
+  return dev->receive_error.code;
+}
+
+int can_usb_get_fd(can_device_t* dev) {
+  can_usb_device_t* usb_dev = dev->comm_dev;
+  
+  error_clear(&dev->error);
+
+  if (!usb_dev || (usb_dev->event_fd < 0)) {
+    error_setf(&dev->error, CAN_ERROR_SETUP, "%s",
+      usb_dev ? "Asynchronous mode required" :
+      "Communication device unavailable");
+    return -dev->error.code;
+  }
+
+  return usb_dev->event_fd;
+}
+
+int can_usb_try_receive_message(can_device_t* dev, can_message_t* message) {
+  can_usb_device_t* usb_dev = dev->comm_dev;
+  unsigned char data[CAN_USB_FRAME_SIZE];
+  int result;
+
+  error_clear(&dev->receive_error);
+  
+  if (((result = can_usb_device_try_receive(usb_dev, data)) < 0) ||
+      ((result > 0) && can_usb_device_to_epos(usb_dev, data, message)))
+    error_blame(&dev->receive_error, &usb_dev->error, CAN_ERROR_RECEIVE);
+  else if (!result)
+    error_set(&dev->receive_error, CAN_ERROR_WOULD_BLOCK);
+  else if (dev->timestamps)
+    message->timestamp = usb_dev->timestamp;
+  
+  return dev->receive_error.code;
 }
 
 int can_usb_device_from_epos(can_usb_device_t* dev, const can_message_t*
@@ -272,147 +414,240 @@ int can_usb_device_to_epos(can_usb_device_t* dev, unsigned char* data,
     can_message_t* message) {
   error_clear(&dev->error);
   
-  if ((data[2] == 0) && (data[3] == 0) && (data[4] == 0) && (data[5] == 0)) {
-    switch (message->content[0]) {
-      case CAN_CMD_SDO_WRITE_SEND_1_BYTE:
-        message->content[0] = CAN_CMD_SDO_WRITE_RECEIVE;
-        break;
-      case CAN_CMD_SDO_WRITE_SEND_2_BYTE:
-        message->content[0] = CAN_CMD_SDO_WRITE_RECEIVE;
-        break;
-      case CAN_CMD_SDO_WRITE_SEND_4_BYTE:
-        message->content[0] = CAN_CMD_SDO_WRITE_RECEIVE;
-        break;
-      case CAN_CMD_SDO_READ_SEND:
-        message->content[0] = CAN_CMD_SDO_READ_RECEIVE_UNDEFINED;
-        break;
-      default:
-        error_setf(&dev->error, CAN_USB_ERROR_CONVERT,
-          "Invalid SDO command: 0x%02x", message->content[0]);
-        return dev->error.code;
-    }
-
-    message->content[1] = message->content[2];
-    message->content[2] = message->content[3];
-    message->content[3] = message->content[4];
-    message->content[7] = data[6];
-    message->content[6] = data[7];
-    message->content[5] = data[8];
-    message->content[4] = data[9];
-  }
-  else {
-    message->id -= CAN_COB_ID_SDO_SEND;
-    message->id += CAN_COB_ID_SDO_RECEIVE;
-
-    message->content[0] = CAN_CMD_SDO_ABORT;
-    message->content[1] = message->content[2];
-    message->content[2] = message->content[3];
-    message->content[3] = message->content[4];
-    message->content[7] = data[2];
-    message->content[6] = data[3];
-    message->content[5] = data[4];
-    message->content[4] = data[5];
-  }
-  message->length = 8;
+  if (can_epos_reply(data, message))
+    error_setf(&dev->error, CAN_USB_ERROR_CONVERT,
+      "Invalid SDO command: 0x%02x", message->content[0]);
 
   return dev->error.code;
 }
 
 int can_usb_device_send(can_usb_device_t* dev, unsigned char* data,
     size_t num) {
-  unsigned char sync[] = {CAN_USB_SYNC_DLE, CAN_USB_SYNC_STX};
+  int result;
+  
+  if (((result = can_usb_device_queue(dev, data, num)) == 0) &&
+      (can_usb_device_flush(dev) >= 0))
+    result = can_usb_device_queue(dev, data, num);
+  
+  if ((result <= 0) || (can_usb_device_flush(dev) < 0))
+    return -dev->error.code;
+  
+  return num;
+}
+
+int can_usb_device_queue(can_usb_device_t* dev, unsigned char* data,
+    size_t num) {
   unsigned char crc_value[2];
-  int i;
+  unsigned char* buffer;
+  int i, j;
 
   error_clear(&dev->error);
   
+  if (num > CAN_USB_FRAME_SIZE) {
+    error_setf(&dev->error, CAN_USB_ERROR_SEND,
+      "Frame size exceeds maximum: %d", (int)num);
+    return -dev->error.code;
+  }
+  
+  if (dev->send_size+2*num+2 > CAN_USB_SEND_BUFFER_SIZE)
+    return 0;
+  
   can_usb_calc_crc(data, num, crc_value);
   data[num-2] = crc_value[0];
   data[num-1] = crc_value[1];
 
   can_usb_change_byte_order(data, num);
 
-  if (ftdi_device_write(dev->ftdi_dev, sync, sizeof(sync)) < 0) {
-    error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_SEND);
-    return -dev->error.code;
+  buffer = &dev->send_buffer[dev->send_size];
+  buffer[0] = CAN_USB_SYNC_DLE;
+  buffer[1] = CAN_USB_SYNC_STX;
+  for (i = 0, j = 2; i < num; ++i) {
+    buffer[j++] = data[i];
+    if (data[i] == CAN_USB_SYNC_DLE)
+      buffer[j++] = data[i];
   }
+  dev->send_size += j;
+  ++dev->num_queued;
   
-  for (i = 0; i < num; ++i) {
-    if (ftdi_device_write(dev->ftdi_dev, &data[i], 1) < 1) {
-      error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_SEND);
-      return -dev->error.code;
-    }
-    if ((data[i] == CAN_USB_SYNC_DLE) &&
-        (ftdi_device_write(dev->ftdi_dev, &data[i], 1) < 1)) {
-      error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_SEND);
+  return num;
+}
+
+int can_usb_device_flush(can_usb_device_t* dev) {
+  size_t size = dev->send_size, num_queued = dev->num_queued;
+  
+  error_clear(&dev->error);
+  
+  dev->send_size = 0;
+  dev->num_queued = 0;
+  if (!num_queued)
+    return 0;
+  
+  if (dev->latency_idle > dev->latency_active) {
+    double time = can_get_time();
+    
+    pthread_mutex_lock(&dev->mutex);
+    if (dev->send_time > 0.0)
+      dev->send_interval += (time-dev->send_time-dev->send_interval)/8.0;
+    dev->send_time = time;
+    pthread_mutex_unlock(&dev->mutex);
+    
+    if (can_usb_device_set_latency(dev, dev->latency_active))
       return -dev->error.code;
-    }
   }
+
+  /* The event thread reconfigures the device under the mutex. */
+  if (dev->async)
+    pthread_mutex_lock(&dev->mutex);
+  if (ftdi_device_write(dev->ftdi_dev, dev->send_buffer, size) < size)
+    error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_SEND);
+  if (dev->async)
+    pthread_mutex_unlock(&dev->mutex);
   
-  return num;
+  return dev->error.code ? -dev->error.code : num_queued;
 }
 
 int can_usb_device_receive(can_usb_device_t* dev, unsigned char* data) {
-  unsigned char sync[2], header[2], buffer, crc_value[2];
-  int i, result = 0, num_exp = 0;
+  int result;
 
   error_clear(&dev->error);
-  
-  result = ftdi_device_read(dev->ftdi_dev, sync, sizeof(sync));
-  if (result > 0) {
-    if ((sync[0] != CAN_USB_SYNC_DLE) || (sync[1] != CAN_USB_SYNC_STX)) {
-      error_setf(&dev->error, CAN_USB_ERROR_RECEIVE,
-        "Unexpected response: 0x%02x 0x%02x", sync[0], sync[1]);
+
+  if (dev->async) {
+    if ((result = can_usb_device_dequeue(dev, data, 1)) < 0) {
+      error_set(&dev->error, CAN_USB_ERROR_TIMEOUT);
       return -dev->error.code;
     }
   }
-  else {
+  else if ((result = can_usb_device_read_frame(dev, data)) < 0) {
     error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_RECEIVE);
     return -dev->error.code;
   }
-  
-  result = ftdi_device_read(dev->ftdi_dev, header, sizeof(header));
-  if (result > 0) {
-    data[0] = header[0];
-    data[1] = header[1];
-  }
-  else {
-    error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_RECEIVE);
+  else
+    dev->timestamp = dev->frame_time;
+
+  return can_usb_device_unpack(dev, data, result);
+}
+
+int can_usb_device_try_receive(can_usb_device_t* dev, unsigned char* data) {
+  int result;
+
+  error_clear(&dev->error);
+
+  if (!dev->async) {
+    error_setf(&dev->error, CAN_USB_ERROR_RECEIVE,
+      "Asynchronous mode required");
     return -dev->error.code;
   }
   
-  num_exp = (data[1]+1)*sizeof(unsigned short);
-  for (i = 0; i < num_exp; ++i) {
-    if (ftdi_device_read(dev->ftdi_dev, &buffer, 1) > 0)
-      data[i+2] = buffer;
-    else {
-      error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_RECEIVE);
-      return -dev->error.code;
-    }
+  if ((result = can_usb_device_dequeue(dev, data, 0)) < 0)
+    return 0;
+
+  return can_usb_device_unpack(dev, data, result);
+}
+
+int can_usb_device_open(can_usb_device_t* dev, int interface) {
+  error_clear(&dev->error);
+  
+  if (ftdi_device_open(dev->ftdi_dev, interface)) {
+    if (dev->cached && !can_usb_device_rescan(dev) &&
+        !ftdi_device_open(dev->ftdi_dev, interface))
+      return dev->error.code;
     
-    if (buffer == CAN_USB_SYNC_DLE) {
-      unsigned char sync_dle;
-      if ((ftdi_device_read(dev->ftdi_dev, &sync_dle, 1) < 1) &&
-          (sync_dle != CAN_USB_SYNC_DLE)) {
-        error_setf(&dev->error, CAN_USB_ERROR_RECEIVE,
-          "Unexpected response: 0x%02x 0x%02x", buffer, sync_dle);
-        return -dev->error.code;
-      }
-    }
+    if (!dev->error.code)
+      error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_DEVICE);
   }
-  result = i+2;
+  
+  return dev->error.code;
+}
 
-  can_usb_change_byte_order(data, result);
+int can_usb_device_setup(can_usb_device_t* dev, int baud_rate, int
+    data_bits, int stop_bits, int parity, int flow_ctrl, int break_type,
+    double timeout, double latency, double latency_idle) {
+  error_clear(&dev->error);
+  
+  dev->baud_rate = baud_rate;
+  dev->data_bits = data_bits;
+  dev->stop_bits = stop_bits;
+  dev->parity = parity;
+  dev->flow_ctrl = flow_ctrl;
+  dev->break_type = break_type;
+  dev->timeout = timeout;
+  
+  dev->latency_active = latency;
+  dev->latency_idle = latency_idle;
+  dev->send_time = 0.0;
+  dev->send_interval = 0.0;
+  
+  if (can_usb_device_apply_latency(dev, latency))
+    error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_DEVICE);
+  
+  return dev->error.code;
+}
 
-  can_usb_calc_crc(data, result, crc_value);
-  if ((crc_value[0] != 0x00) || (crc_value[1] != 0x00)) {
-    error_set(&dev->error, CAN_USB_ERROR_CRC);
-    return -dev->error.code;
+int can_usb_device_set_latency(can_usb_device_t* dev, double latency) {
+  error_clear(&dev->error);
+  
+  if (dev->async) {
+    pthread_mutex_lock(&dev->mutex);
+    dev->latency_request = latency;
+    pthread_mutex_unlock(&dev->mutex);
   }
+  else if ((latency != dev->latency) &&
+      can_usb_device_apply_latency(dev, latency))
+    error_blame(&dev->error, &dev->ftdi_dev->error, CAN_USB_ERROR_DEVICE);
+  
+  return dev->error.code;
+}
 
-  can_usb_change_word_order(data, result);
+int can_usb_device_start(can_usb_device_t* dev, double timeout) {
+  error_clear(&dev->error);
 
-  return result;
+  if (dev->async) {
+    error_setf(&dev->error, CAN_USB_ERROR_THREAD, "Already started");
+    return dev->error.code;
+  }
+  
+  dev->timeout = timeout;
+  dev->queue_head = 0;
+  dev->queue_tail = 0;
+  
+  if ((dev->event_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE)) < 0) {
+    error_setf(&dev->error, CAN_USB_ERROR_THREAD, "%s", strerror(errno));
+    return dev->error.code;
+  }
+  
+  dev->running = 1;
+  if (pthread_create(&dev->thread, 0, can_usb_device_run, dev)) {
+    dev->running = 0;
+    error_setf(&dev->error, CAN_USB_ERROR_THREAD, "Failed to create thread");
+    
+    close(dev->event_fd);
+    dev->event_fd = -1;
+  }
+  else
+    dev->async = 1;
+
+  return dev->error.code;
+}
+
+int can_usb_device_stop(can_usb_device_t* dev) {
+  error_clear(&dev->error);
+
+  if (dev->async) {
+    pthread_mutex_lock(&dev->mutex);
+    dev->running = 0;
+    pthread_mutex_unlock(&dev->mutex);
+    
+    pthread_join(dev->thread, 0);
+    dev->async = 0;
+    
+    close(dev->event_fd);
+    dev->event_fd = -1;
+    
+    if (dev->latency_request != dev->latency)
+      can_usb_device_set_latency(dev, dev->latency_request);
+  }
+
+  return dev->error.code;
 }
 
 size_t can_usb_change_byte_order(unsigned char* data, size_t num) {
@@ -449,64 +684,391 @@ size_t can_usb_change_word_order(unsigned char* data, size_t num) {
 
 size_t can_usb_calc_crc(unsigned char* data, size_t num, unsigned char*
     crc_value) {
-  unsigned short* word_data = (unsigned short*)data;
-  size_t num_words = num/2;
+  unsigned char header[2] = {data[1], data[0]};
   unsigned short crc;
 
-  crc = can_usb_crc_alg(word_data, num_words);
+  crc = can_crc_ccitt(can_crc_ccitt(0, header, 2), &data[2], num-4)^
+    ((data[num-2] << 8) | data[num-1]);
   crc_value[0] = (crc >> 8);
   crc_value[1] = crc;
 
-  return num_words;
+  return num/2;
 }
 
-unsigned short can_usb_crc_alg(unsigned short* data, size_t num) {
-  unsigned short shift, c, carry, crc = 0;
-  int i;
+void can_usb_flush_cache(void) {
+  size_t i;
+  
+  pthread_mutex_lock(&can_usb_cache_mutex);
+  for (i = 0; i < CAN_USB_CACHE_SIZE; ++i)
+    if (can_usb_cache[i].name && !can_usb_cache[i].used) {
+      ftdi_context_release(&can_usb_cache[i].ftdi_context);
+      
+      free(can_usb_cache[i].name);
+      can_usb_cache[i].name = 0;
+    }
+  pthread_mutex_unlock(&can_usb_cache_mutex);
+}
 
-  for (i = 0; i < num; ++i) {
-    shift = 0x8000;
-    if (i)
-      c = (data[i] << 8) | (data[i] >> 8);
+int can_usb_device_init(can_usb_device_t* dev, const char* name) {
+  can_usb_cache_entry_t* entry = 0;
+  size_t i;
+  
+  dev->cache_entry = 0;
+  dev->cached = 0;
+  dev->ftdi_dev = 0;
+
+  dev->buffer_head = 0;
+  dev->buffer_tail = 0;
+  
+  dev->send_size = 0;
+  dev->num_queued = 0;
+  
+  dev->frame_pos = 0;
+  dev->frame_size = 0;
+  dev->framer_state = CAN_USB_FRAMER_SYNC;
+  dev->num_resyncs = 0;
+
+  dev->timestamps = 0;
+  dev->frame_time = 0.0;
+  dev->timestamp = 0.0;
+
+  dev->async = 0;
+  dev->timeout = 0.0;
+  dev->running = 0;
+  dev->event_fd = -1;
+  
+  dev->queue_head = 0;
+  dev->queue_tail = 0;
+  dev->num_overruns = 0;
+  
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&dev->cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  pthread_mutex_init(&dev->mutex, 0);
+  error_init(&dev->error, can_usb_errors);
+
+  pthread_mutex_lock(&can_usb_cache_mutex);
+  
+  for (i = 0; i < CAN_USB_CACHE_SIZE; ++i)
+    if (can_usb_cache[i].name && !strcmp(can_usb_cache[i].name, name)) {
+      entry = &can_usb_cache[i];
+      break;
+    }
+  
+  if (entry) {
+    if (entry->used) {
+      pthread_mutex_unlock(&can_usb_cache_mutex);
+      error_setf(&dev->error, CAN_USB_ERROR_DEVICE, "%s", name);
+      return dev->error.code;
+    }
+    
+    dev->cached = 1;
+  }
+  else {
+    for (i = 0; i < CAN_USB_CACHE_SIZE; ++i)
+      if (!can_usb_cache[i].name) {
+        entry = &can_usb_cache[i];
+        break;
+      }
+    for (i = 0; !entry && (i < CAN_USB_CACHE_SIZE); ++i)
+      if (!can_usb_cache[i].used) {
+        entry = &can_usb_cache[i];
+        
+        ftdi_context_release(&entry->ftdi_context);
+        free(entry->name);
+        entry->name = 0;
+      }
+    
+    if (!entry) {
+      pthread_mutex_unlock(&can_usb_cache_mutex);
+      error_setf(&dev->error, CAN_USB_ERROR_DEVICE, "%s", name);
+      return dev->error.code;
+    }
+    
+    memset(&entry->ftdi_context, 0, sizeof(ftdi_context_t));
+    if (ftdi_context_init(&entry->ftdi_context)) {
+      pthread_mutex_unlock(&can_usb_cache_mutex);
+      error_blame(&dev->error, &entry->ftdi_context.error,
+        CAN_USB_ERROR_DEVICE);
+      return dev->error.code;
+    }
+    
+    entry->name = strdup(name);
+  }
+  
+  entry->used = 1;
+  dev->cache_entry = entry;
+  
+  pthread_mutex_unlock(&can_usb_cache_mutex);
+  
+  dev->ftdi_dev = ftdi_context_match_name(&entry->ftdi_context, name);
+  if (!dev->ftdi_dev) {
+    if (dev->cached)
+      can_usb_device_rescan(dev);
     else
-      c = data[i];
+      error_setf(&dev->error, CAN_USB_ERROR_DEVICE, "%s", name);
+  }
+  
+  return dev->error.code;
+}
 
-    do {
-      carry = crc & 0x8000;
-      crc <<= 1;
+void can_usb_device_destroy(can_usb_device_t* dev) {
+  if (dev->cache_entry) {
+    pthread_mutex_lock(&can_usb_cache_mutex);
+    dev->cache_entry->used = 0;
+    pthread_mutex_unlock(&can_usb_cache_mutex);
+    
+    dev->cache_entry = 0;
+  }
+  dev->ftdi_dev = 0;
+  
+  pthread_cond_destroy(&dev->cond);
+  pthread_mutex_destroy(&dev->mutex);
+  
+  error_destroy(&dev->error);
+}
 
-      if (c & shift)
-        ++crc;
-      if (carry)
-        crc ^= 0x1021;
+int can_usb_device_rescan(can_usb_device_t* dev) {
+  can_usb_cache_entry_t* entry = dev->cache_entry;
+  
+  error_clear(&dev->error);
+  dev->cached = 0;
+  
+  if (ftdi_context_refresh(&entry->ftdi_context))
+    error_blame(&dev->error, &entry->ftdi_context.error,
+      CAN_USB_ERROR_DEVICE);
+  else {
+    dev->ftdi_dev = ftdi_context_match_name(&entry->ftdi_context,
+      entry->name);
+    if (!dev->ftdi_dev)
+      error_setf(&dev->error, CAN_USB_ERROR_DEVICE, "%s", entry->name);
+  }
+  
+  return dev->error.code;
+}
 
-      shift >>= 1;
+int can_usb_device_parse(can_usb_device_t* dev, unsigned char byte) {
+  switch (dev->framer_state) {
+    case CAN_USB_FRAMER_SYNC:
+      if (byte == CAN_USB_SYNC_DLE)
+        dev->framer_state = CAN_USB_FRAMER_STX;
+      return 0;
+    case CAN_USB_FRAMER_STX:
+      if (byte == CAN_USB_SYNC_STX) {
+        dev->frame_pos = 0;
+        dev->frame_size = 0;
+        dev->framer_state = CAN_USB_FRAMER_DATA;
+      }
+      else if (byte != CAN_USB_SYNC_DLE)
+        dev->framer_state = CAN_USB_FRAMER_SYNC;
+      return 0;
+    case CAN_USB_FRAMER_DLE:
+      if (byte == CAN_USB_SYNC_STX) {
+        ++dev->num_resyncs;
+        
+        dev->frame_pos = 0;
+        dev->frame_size = 0;
+        dev->framer_state = CAN_USB_FRAMER_DATA;
+        
+        return 0;
+      }
+      else if (byte != CAN_USB_SYNC_DLE) {
+        ++dev->num_resyncs;
+        
+        dev->frame_pos = 0;
+        dev->framer_state = CAN_USB_FRAMER_SYNC;
+        
+        return 0;
+      }
+      dev->framer_state = CAN_USB_FRAMER_DATA;
+      break;
+    default:
+      if (byte == CAN_USB_SYNC_DLE) {
+        dev->framer_state = CAN_USB_FRAMER_DLE;
+        return 0;
+      }
+  }
+
+  dev->frame[dev->frame_pos++] = byte;
+  if (dev->frame_pos == 2) {
+    dev->frame_size = 2*dev->frame[1]+4;
+    
+    if (dev->frame_size > CAN_USB_FRAME_SIZE) {
+      ++dev->num_resyncs;
+      
+      dev->frame_pos = 0;
+      dev->framer_state = CAN_USB_FRAMER_SYNC;
     }
-    while (shift);
+  }
+  else if (dev->frame_pos == dev->frame_size) {
+    dev->framer_state = CAN_USB_FRAMER_SYNC;
+    return 1;
   }
 
-  return crc;
+  return 0;
 }
 
-int can_usb_device_init(can_usb_device_t* dev, const char* name) {
-  ftdi_context_init(ftdi_default_context);
+size_t can_usb_device_get_num_missing(can_usb_device_t* dev) {
+  switch (dev->framer_state) {
+    case CAN_USB_FRAMER_SYNC:
+      return 4;
+    case CAN_USB_FRAMER_STX:
+      return 3;
+    default:
+      return (dev->frame_size ? dev->frame_size : 4)-dev->frame_pos;
+  }
+}
 
-  dev->ftdi_dev = ftdi_context_match_name(ftdi_default_context, name);
-  error_init(&dev->error, can_usb_errors);
+int can_usb_device_read_frame(can_usb_device_t* dev, unsigned char* data) {
+  size_t num, offset;
+  int result = 0;
+
+  while (!result) {
+    while (!result && (dev->buffer_head != dev->buffer_tail))
+      result = can_usb_device_parse(dev, dev->buffer[dev->buffer_head++ &
+        (CAN_USB_BUFFER_SIZE-1)]);
+
+    if (!result) {
+      num = can_usb_device_get_num_missing(dev);
+      offset = dev->buffer_tail & (CAN_USB_BUFFER_SIZE-1);
+      if (num > CAN_USB_BUFFER_SIZE-offset)
+        num = CAN_USB_BUFFER_SIZE-offset;
+      
+      if ((result = ftdi_device_read(dev->ftdi_dev, &dev->buffer[offset],
+          num)) < 1)
+        return -1;
+      dev->buffer_tail += result;
+      result = 0;
+    }
+  }
   
-  if (!dev->ftdi_dev) {
-    ftdi_context_release(ftdi_default_context);
-    error_setf(&dev->error, CAN_USB_ERROR_DEVICE, name);
+  if (dev->timestamps)
+    dev->frame_time = can_get_time();
+  
+  result = dev->frame_pos;
+  memcpy(data, dev->frame, result);
+  dev->frame_pos = 0;
+
+  return result;
+}
+
+int can_usb_device_dequeue(can_usb_device_t* dev, unsigned char* data,
+    int wait) {
+  struct timespec deadline;
+  eventfd_t value;
+  int result = 0;
+  
+  if (wait) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)dev->timeout;
+    deadline.tv_nsec += (dev->timeout-(time_t)dev->timeout)*1e9;
+    if (deadline.tv_nsec >= 1000000000) {
+      ++deadline.tv_sec;
+      deadline.tv_nsec -= 1000000000;
+    }
   }
   
-  return dev->error.code;
+  pthread_mutex_lock(&dev->mutex);
+  while (wait && (dev->queue_head == dev->queue_tail) && !result)
+    result = pthread_cond_timedwait(&dev->cond, &dev->mutex, &deadline);
+  
+  if (dev->queue_head != dev->queue_tail) {
+    size_t slot = dev->queue_head & (CAN_USB_QUEUE_SIZE-1);
+    
+    result = dev->queue_sizes[slot];
+    memcpy(data, dev->queue[slot], result);
+    dev->timestamp = dev->queue_times[slot];
+    ++dev->queue_head;
+    
+    eventfd_read(dev->event_fd, &value);
+  }
+  else
+    result = -1;
+  pthread_mutex_unlock(&dev->mutex);
+  
+  return result;
 }
 
-void can_usb_device_destroy(can_usb_device_t* dev) {
-  if (dev->ftdi_dev) {
-    dev->ftdi_dev = 0;
-    ftdi_context_release(ftdi_default_context);
+int can_usb_device_unpack(can_usb_device_t* dev, unsigned char* data,
+    size_t num) {
+  unsigned char crc_value[2];
+  
+  can_usb_change_byte_order(data, num);
+
+  can_usb_calc_crc(data, num, crc_value);
+  if ((crc_value[0] != 0x00) || (crc_value[1] != 0x00)) {
+    error_set(&dev->error, CAN_USB_ERROR_CRC);
+    return -dev->error.code;
   }
+
+  can_usb_change_word_order(data, num);
+
+  return num;
+}
+
+void* can_usb_device_run(void* arg) {
+  can_usb_device_t* dev = arg;
+  unsigned char frame[CAN_USB_FRAME_SIZE];
+  double time;
+  int result;
+
+  pthread_mutex_lock(&dev->mutex);
+  while (dev->running) {
+    pthread_mutex_unlock(&dev->mutex);
+    time = can_get_time();
+    result = can_usb_device_read_frame(dev, frame);
+    
+    /* A read failing before its timeout, e.g. on a detached device, would
+     * immediately be retried. Back off for the remainder of the timeout. */
+    if ((result < 0) && ((time = dev->timeout-(can_get_time()-time)) > 0.0)) {
+      struct timespec backoff;
+      
+      backoff.tv_sec = time;
+      backoff.tv_nsec = (time-backoff.tv_sec)*1e9;
+      while (nanosleep(&backoff, &backoff) && (errno == EINTR));
+    }
+    pthread_mutex_lock(&dev->mutex);
+
+    if ((result < 0) && (dev->latency_idle > dev->latency_request) &&
+        (dev->send_time > 0.0) && (can_get_time()-
+          dev->send_time > CAN_USB_IDLE_INTERVALS*dev->send_interval))
+      dev->latency_request = dev->latency_idle;
+    else if (result > 0) {
+      if (dev->queue_tail-dev->queue_head < CAN_USB_QUEUE_SIZE) {
+        size_t slot = dev->queue_tail & (CAN_USB_QUEUE_SIZE-1);
+        
+        memcpy(dev->queue[slot], frame, result);
+        dev->queue_sizes[slot] = result;
+        dev->queue_times[slot] = dev->frame_time;
+        ++dev->queue_tail;
+        
+        pthread_cond_signal(&dev->cond);
+        eventfd_write(dev->event_fd, 1);
+      }
+      else
+        ++dev->num_overruns;
+    }
+    
+    /* No read is pending here, so the device may be reconfigured. */
+    if (dev->latency_request != dev->latency)
+      can_usb_device_apply_latency(dev, dev->latency_request);
+  }
+  pthread_mutex_unlock(&dev->mutex);
+
+  return 0;
+}
+
+int can_usb_device_apply_latency(can_usb_device_t* dev, double latency) {
+  int result = ftdi_device_setup(dev->ftdi_dev, dev->baud_rate,
+    dev->data_bits, dev->stop_bits, dev->parity, dev->flow_ctrl,
+    dev->break_type, dev->timeout, latency);
   
-  error_destroy(&dev->error);
+  if (!result) {
+    dev->latency = latency;
+    dev->latency_request = latency;
+  }
+  
+  return result;
 }
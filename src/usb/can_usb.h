@@ -30,6 +30,8 @@
   *  FTDI serial connections over USB links to EPOS controllers.
   */
 
+#include <pthread.h>
+
 #include <ftdi/ftdi.h>
 
 #include "can.h"
@@ -48,6 +50,8 @@
 #define CAN_USB_PARAMETER_BREAK            "usb-serial-break"
 #define CAN_USB_PARAMETER_TIMEOUT          "usb-serial-timeout"
 #define CAN_USB_PARAMETER_LATENCY          "usb-serial-latency"
+#define CAN_USB_PARAMETER_LATENCY_IDLE     "usb-serial-latency-idle"
+#define CAN_USB_PARAMETER_ASYNC            "usb-async"
 //@}
 
 /** \name Operation Codes
@@ -67,6 +71,20 @@
 #define CAN_USB_SYNC_STX                   0x02
 //@}
 
+/** \name Framer States
+  * \brief Predefined CAN-USB receive framer states
+  */
+//@{
+#define CAN_USB_FRAMER_SYNC                0
+//!< Waiting for a DLE character starting a frame
+#define CAN_USB_FRAMER_STX                 1
+//!< Waiting for the STX character following a DLE
+#define CAN_USB_FRAMER_DATA                2
+//!< Receiving frame data
+#define CAN_USB_FRAMER_DLE                 3
+//!< Received a DLE character within frame data
+//@}
+
 /** \name Error Codes
   * \brief Predefined CAN-USB error codes
   */
@@ -83,20 +101,230 @@
 //!< Failed to receive from CAN-USB device
 #define CAN_USB_ERROR_CRC                  5
 //!< CAN-USB checksum error
+#define CAN_USB_ERROR_TIMEOUT              6
+//!< CAN-USB device timeout
+#define CAN_USB_ERROR_THREAD               7
+//!< CAN-USB event thread error
 //@}
 
+/** \brief Maximum size of an unstuffed CAN-USB data frame in [byte]
+  */
+#define CAN_USB_FRAME_SIZE                 514
+
+/** \brief Size of the CAN-USB receive ring buffer in [byte]
+  * \note The size must be a power of two.
+  */
+#define CAN_USB_BUFFER_SIZE                1024
+
+/** \brief Size of the CAN-USB send buffer in [byte]
+  * \note The buffer must hold at least one DLE-stuffed frame of maximum
+  *   size including the synchronization characters.
+  */
+#define CAN_USB_SEND_BUFFER_SIZE           2048
+
+/** \brief Number of mean send intervals after which a CAN-USB device is
+  *   considered idle
+  */
+#define CAN_USB_IDLE_INTERVALS             8
+
+/** \brief Number of frames held by the CAN-USB receive queue
+  * \note The size must be a power of two.
+  */
+#define CAN_USB_QUEUE_SIZE                 16
+
+/** \brief Number of device enumerations held by the CAN-USB enumeration
+  *   cache
+  */
+#define CAN_USB_CACHE_SIZE                 8
+
 /** \brief Predefined CAN-USB error descriptions
   */
 extern const char* can_usb_errors[];
 
+/** \brief CAN-USB enumeration cache entry structure
+  */
+typedef struct can_usb_cache_entry_t {
+  char* name;                   //!< Name of the enumerated device or null.
+  ftdi_context_t ftdi_context;  //!< FTDI context holding the enumeration.
+  int used;                     //!< Flag indicating an open device.
+} can_usb_cache_entry_t;
+
 /** \brief CAN-USB device structure
   */
 typedef struct can_usb_device_t {
+  can_usb_cache_entry_t* cache_entry;
+  //!< Enumeration cache entry holding the FTDI context of the device.
+  int cached;                   //!< Device was matched from the cache.
   ftdi_device_t* ftdi_dev;      //!< FTDI device.
+
+  int baud_rate;                //!< Serial baud rate in [baud].
+  int data_bits;                //!< Number of serial data bits.
+  int stop_bits;                //!< Number of serial stop bits.
+  int parity;                   //!< Serial parity setting.
+  int flow_ctrl;                //!< Serial flow control setting.
+  int break_type;               //!< Serial break setting.
+  double latency;               //!< Current serial latency in [s].
+  double latency_request;       //!< Serial latency to be applied in [s].
+  double latency_active;        //!< Serial latency while active in [s].
+  double latency_idle;          //!< Serial latency while idle in [s].
+
+  double send_time;             //!< Time of the most recent send in [s].
+  double send_interval;         //!< Mean interval between sends in [s].
+
+  unsigned char send_buffer[CAN_USB_SEND_BUFFER_SIZE];
+  //!< Stuffed frames queued for sending.
+  size_t send_size;             //!< Number of bytes in the send buffer.
+  size_t num_queued;            //!< Number of frames in the send buffer.
+
+  unsigned char buffer[CAN_USB_BUFFER_SIZE];
+  //!< Receive ring buffer of the device.
+  size_t buffer_head;           //!< Ring buffer position of the next byte.
+  size_t buffer_tail;           //!< Ring buffer position past the last byte.
+
+  unsigned char frame[CAN_USB_FRAME_SIZE];
+  //!< The unstuffed frame being received.
+  size_t frame_pos;             //!< Number of bytes received in the frame.
+  size_t frame_size;            //!< Size of the frame or zero if unknown.
+  int framer_state;             //!< State of the receive framer.
+  size_t num_resyncs;           //!< Number of frames dropped on corruption.
+
+  int timestamps;               //!< Flag enabling frame timestamps.
+  double frame_time;            //!< Completion time of the last frame in [s].
+  double timestamp;             //!< Completion time of the frame received.
+
+  int async;                    //!< Device operates asynchronously.
+  double timeout;               //!< Asynchronous receive timeout in [s].
+  pthread_t thread;             //!< Event thread in asynchronous mode.
+  pthread_mutex_t mutex;        //!< Mutex protecting the receive queue.
+  pthread_cond_t cond;          //!< Condition signaling a queued frame.
+  int event_fd;                 //!< Event descriptor counting queued frames.
+  int running;                  //!< Flag keeping the event thread running.
+
+  unsigned char queue[CAN_USB_QUEUE_SIZE][CAN_USB_FRAME_SIZE];
+  //!< Receive queue of completed frames in asynchronous mode.
+  size_t queue_sizes[CAN_USB_QUEUE_SIZE];
+  //!< Sizes of the frames in the receive queue.
+  double queue_times[CAN_USB_QUEUE_SIZE];
+  //!< Completion times of the frames in the receive queue.
+  size_t queue_head;            //!< Queue position of the next frame.
+  size_t queue_tail;            //!< Queue position past the last frame.
+  size_t num_overruns;          //!< Number of frames lost to a full queue.
   
   error_t error;                //!< The most recent device error.
 } can_usb_device_t;
 
+/** \brief Open an initialized CAN-USB device
+  * \param[in] dev The initialized CAN-USB device to be opened.
+  * \param[in] interface The FTDI interface of the device to be opened.
+  * \return The resulting error code.
+  * 
+  * The device is matched by name against the FTDI context of its entry in
+  * the enumeration cache. The bus is only enumerated when a name is first
+  * opened, such that reopening a device skips the rescan. Should the
+  * cached device fail to open, e.g. after it has been unplugged, the
+  * enumeration is refreshed once before giving up.
+  */
+int can_usb_device_open(
+  can_usb_device_t* dev,
+  int interface);
+
+/** \brief Setup an already opened CAN-USB device
+  * \param[in] dev The open CAN-USB device to be set up.
+  * \param[in] baud_rate The serial baud rate to be set in [baud].
+  * \param[in] data_bits The number of serial data bits to be set.
+  * \param[in] stop_bits The number of serial stop bits to be set.
+  * \param[in] parity The serial parity setting to be set.
+  * \param[in] flow_ctrl The serial flow control setting to be set.
+  * \param[in] break_type The serial break setting to be set.
+  * \param[in] timeout The serial communication timeout to be set in [s].
+  * \param[in] latency The serial latency to be set in [s].
+  * \param[in] latency_idle The serial latency to be applied while the
+  *   device is idle in [s]. If larger than the latency, the latency
+  *   timer will be adapted to the traffic. Otherwise, the latency
+  *   remains fixed.
+  * \return The resulting error code.
+  * 
+  * The FTDI latency timer determines how long the chip holds back
+  * received data which does not fill a USB packet. EPOS responses never
+  * fill a packet, and they carry no trailing delimiter which could be
+  * programmed as FTDI event character. The DLE STX sequence opening a
+  * frame is the only fixed structure, and DLE also occurs stuffed within
+  * frames. Responses are therefore always released by the latency timer,
+  * which should be kept at its minimum while requests are sent.
+  * 
+  * While a read is pending, the chip however answers each expiry of the
+  * latency timer with a status packet, even if there is no data. In
+  * asynchronous mode, where a read is always pending, the adaptive mode
+  * thus raises the latency timer to the idle latency once no frame has
+  * been sent for CAN_USB_IDLE_INTERVALS mean send intervals. The next
+  * send restores the minimum latency. As the latency timer can only be
+  * changed by reconfiguring the device, which must not overlap a pending
+  * read, the event thread applies the change between two reads. The
+  * first response after an idle period may thus still be held back by
+  * the idle latency.
+  */
+int can_usb_device_setup(
+  can_usb_device_t* dev,
+  int baud_rate,
+  int data_bits,
+  int stop_bits,
+  int parity,
+  int flow_ctrl,
+  int break_type,
+  double timeout,
+  double latency,
+  double latency_idle);
+
+/** \brief Change the latency of an already set up CAN-USB device
+  * \param[in] dev The open CAN-USB device to change the latency for.
+  * \param[in] latency The serial latency to be set in [s].
+  * \return The resulting error code.
+  * 
+  * In asynchronous mode, the latency is only requested here and applied
+  * by the event thread once its pending read has completed.
+  */
+int can_usb_device_set_latency(
+  can_usb_device_t* dev,
+  double latency);
+
+/** \brief Start asynchronous operation of a CAN-USB device
+  * \param[in] dev The open CAN-USB device to be operated asynchronously.
+  * \param[in] timeout The timeout in [s] for receiving a frame.
+  * \return The resulting error code.
+  * 
+  * An event thread is started which keeps a read pending on the device
+  * at all times. It runs the receive framer and hands completed frames
+  * to can_usb_device_receive() through the receive queue of the device.
+  * Frames arriving while the queue is full are counted and dropped.
+  * Should a read fail before the timeout has elapsed, the event thread
+  * waits out the remainder of the timeout before retrying. Sending is
+  * unaffected, as a frame is always passed to the device by a single
+  * write without waiting for the response. The event descriptor of the
+  * device counts the queued frames as an eventfd semaphore, such that it
+  * is readable whenever can_usb_device_try_receive() succeeds.
+  */
+int can_usb_device_start(
+  can_usb_device_t* dev,
+  double timeout);
+
+/** \brief Stop asynchronous operation of a CAN-USB device
+  * \param[in] dev The asynchronously operated CAN-USB device to be
+  *   stopped.
+  * \return The resulting error code.
+  * 
+  * The event thread terminates once its pending read has completed or
+  * timed out. Queued frames are discarded.
+  */
+int can_usb_device_stop(
+  can_usb_device_t* dev);
+
+/** \brief Flush the CAN-USB enumeration cache
+  * 
+  * The FTDI contexts of all cache entries which do not belong to an open
+  * device are released.
+  */
+void can_usb_flush_cache(void);
+
 /** \brief Convert a CANopen SDO message into USB data
   * \param[in] dev The sending CAN device for which to convert the message.
   * \param[in] message The CANopen SDO message to be converted.
@@ -133,23 +361,82 @@ int can_usb_device_to_epos(
   * \param[in] num The size of the USB data frame to be sent.
   * \return The number of bytes sent to the CAN-USB device or the
   *   negative error code.
+  * 
+  * The synchronization characters and the DLE-stuffed data frame are
+  * assembled in a single buffer and passed to the device by a single
+  * write, i.e., a single USB bulk transfer. Frames queued before are
+  * sent along.
   */
 int can_usb_device_send(
   can_usb_device_t* dev,
   unsigned char* data,
   size_t num);
 
+/** \brief Queue USB data for sending to a CAN device
+  * \param[in] dev The open CAN-USB device to queue data for.
+  * \param[in] data An array containing the USB data frame to be queued.
+  * \param[in] num The size of the USB data frame to be queued.
+  * \return The number of bytes queued, zero if the send buffer has no
+  *   room for the frame, or the negative error code.
+  * 
+  * The DLE-stuffed data frame is appended to the send buffer of the
+  * device, which is passed to the device by can_usb_device_flush().
+  */
+int can_usb_device_queue(
+  can_usb_device_t* dev,
+  unsigned char* data,
+  size_t num);
+
+/** \brief Send the queued USB data to a CAN device
+  * \param[in] dev The open CAN-USB device to send the queued data to.
+  * \return The number of frames sent to the CAN-USB device or the
+  *   negative error code.
+  * 
+  * All frames in the send buffer are passed to the device by a single
+  * write, i.e., a single USB bulk transfer. The buffer is emptied even
+  * if the write fails.
+  */
+int can_usb_device_flush(
+  can_usb_device_t* dev);
+
 /** \brief Receive USB data from a CAN device
   * \param[in] dev The open CAN-USB device to reveice data from.
   * \param[out] data An array representing the USB data frame received
-  *   via an EPOS USB connection.
+  *   via an EPOS USB connection, providing space for at least
+  *   CAN_USB_FRAME_SIZE bytes.
   * \return The number of bytes received from the CAN-USB device or the
   *   negative error code.
+  * 
+  * Incoming data is collected in the ring buffer of the device and
+  * unstuffed incrementally. Partially received frames survive across
+  * calls, and bytes beyond a completed frame are retained for subsequent
+  * calls. On a corrupted frame, the framer discards data until the next
+  * DLE STX sequence. Reads never request more bytes than are required
+  * to complete the frame in progress, such that no read waits for data
+  * the device is not going to send. If timestamps are enabled, the time
+  * the framer completed the frame is recorded as the device's timestamp,
+  * also in asynchronous mode.
   */
 int can_usb_device_receive(
   can_usb_device_t* dev,
   unsigned char* data);
 
+/** \brief Receive USB data from a CAN device without blocking
+  * \param[in] dev The asynchronously operated CAN-USB device to receive
+  *   data from.
+  * \param[out] data An array representing the USB data frame received
+  *   via an EPOS USB connection, providing space for at least
+  *   CAN_USB_FRAME_SIZE bytes.
+  * \return The number of bytes received from the CAN-USB device, zero if
+  *   the receive queue is empty, or the negative error code.
+  * 
+  * Since FTDI devices cannot be polled, non-blocking reception requires
+  * asynchronous operation of the device.
+  */
+int can_usb_device_try_receive(
+  can_usb_device_t* dev,
+  unsigned char* data);
+
 /** \brief Change the order of bytes in USB data frames
   * \param[in,out] data An array of bytes representing the USB data frame
   *   for which to change the order.
@@ -184,22 +471,14 @@ size_t can_usb_change_word_order(
   * \param[out] crc_value An array of two bytes to store the CRC-word.
   * \return The number of words built from the array.
   * 
-  * Calculation has to include all bytes in the data frame. Internally,
-  * the array is transformed to an array of words in order to calculate the
-  * CRC. The CRC word is then tranformed back to an array of characters.
+  * Calculation has to include all bytes in the data frame, where the
+  * final two bytes hold either the checksum to be verified or zeros. The
+  * frame is passed to can_crc_ccitt() as a stream of bytes with the two
+  * bytes of the header word swapped. A valid frame yields a zero checksum.
   */
 size_t can_usb_calc_crc(
   unsigned char* data,
   size_t num,
   unsigned char* crc_value);
 
-/** \brief Implementation of the CRC-CCITT algorithm
-  * \param[in] data An array of words containing the USB data frame.
-  * \param[in] num The number of words in the data frame.
-  * \return The calculated CRC-value.
-  */
-unsigned short can_usb_crc_alg(
-  unsigned short* data,
-  size_t num);
-
 #endif